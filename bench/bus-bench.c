@@ -0,0 +1,90 @@
+/* Dispatch cost of bus_handle_io versus the number of devices on the bus.
+ *
+ * "same" hits one device over and over, as a vcpu polling a register does,
+ * "spread" cycles through all of them. The linked list the bus used to be
+ * is measured alongside for reference.
+ *
+ * usage: bus-bench [iterations] */
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "../src/bus.h"
+
+#define MAX_DEVS 1024
+#define DEV_LEN 0x10
+
+struct list_dev {
+  struct dev dev;
+  struct list_dev *next;
+};
+
+static struct dev devs[MAX_DEVS];
+static struct list_dev list_devs[MAX_DEVS];
+static volatile uint64_t sink;
+
+static void dev_io(void *owner, void *data, uint8_t is_write, uint64_t offset,
+                   uint8_t size) {
+  sink += offset;
+}
+
+static void list_handle_io(struct list_dev *head, void *data, uint8_t is_write,
+                           uint64_t addr, uint8_t size) {
+  for (struct list_dev *p = head; p; p = p->next) {
+    if (addr >= p->dev.base && addr - p->dev.base < p->dev.len) {
+      p->dev.do_io(p->dev.owner, data, is_write, addr - p->dev.base, size);
+      return;
+    }
+  }
+}
+
+static double now_ns(void) {
+  struct timespec t;
+
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec * 1e9 + t.tv_nsec;
+}
+
+int main(int argc, char *argv[]) {
+  long iters = argc > 1 ? atol(argv[1]) : 10000000;
+  uint64_t addrs[MAX_DEVS];
+  uint32_t data = 0;
+
+  printf("%8s %12s %12s %12s %12s\n", "devices", "bus same", "bus spread",
+         "list same", "list spread");
+  for (int n = 1; n <= MAX_DEVS; n *= 2) {
+    struct bus bus;
+    struct list_dev *head = NULL;
+
+    bus_init(&bus);
+    for (int i = 0; i < n; i++) {
+      // registered in a scrambled order, ranges with gaps in between
+      uint64_t base = 0x1000 + (uint64_t)((i * 7919) % n) * DEV_LEN * 2;
+      dev_init(&devs[i], base, DEV_LEN, NULL, dev_io);
+      bus_register_dev(&bus, &devs[i]);
+      list_devs[i] = (struct list_dev){.dev = devs[i], .next = head};
+      head = &list_devs[i];
+      addrs[i] = base + 4;
+    }
+
+    double t[4];
+    for (int k = 0; k < 4; k++) {
+      bool spread = k & 1;
+      double t0 = now_ns();
+      for (long i = 0; i < iters; i++) {
+        uint64_t addr = addrs[spread ? i % n : n / 2];
+        if (k < 2)
+          bus_handle_io(&bus, &data, 0, addr, 4);
+        else
+          list_handle_io(head, &data, 0, addr, 4);
+      }
+      t[k] = (now_ns() - t0) / iters;
+    }
+    printf("%8d %10.1fns %10.1fns %10.1fns %10.1fns\n", n, t[0], t[1], t[2],
+           t[3]);
+    bus_exit(&bus);
+  }
+
+  return 0;
+}
@@ -0,0 +1,494 @@
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "acpi.h"
+
+#define ACPI_OEM_ID "KVMVMM"
+#define ACPI_OEM_TABLE_ID "LEARN   "
+
+struct acpi_rsdp {
+  char signature[8];
+  uint8_t checksum;
+  char oem_id[6];
+  uint8_t revision;
+  uint32_t rsdt_address;
+} __attribute__((packed));
+
+struct acpi_table_header {
+  char signature[4];
+  uint32_t length;
+  uint8_t revision;
+  uint8_t checksum;
+  char oem_id[6];
+  char oem_table_id[8];
+  uint32_t oem_revision;
+  char creator_id[4];
+  uint32_t creator_revision;
+} __attribute__((packed));
+
+struct acpi_rsdt {
+  struct acpi_table_header hdr;
+  uint32_t entry[2];
+} __attribute__((packed));
+
+// ACPI 1.0 FADT. Linux only keeps ACPI enabled with a FADT and a DSDT.
+struct acpi_fadt {
+  struct acpi_table_header hdr;
+  uint32_t facs;
+  uint32_t dsdt;
+  uint8_t int_model;
+  uint8_t reserved1;
+  uint16_t sci_int;
+  uint32_t smi_cmd;
+  uint8_t acpi_enable;
+  uint8_t acpi_disable;
+  uint8_t s4bios_req;
+  uint8_t reserved2;
+  uint32_t pm1a_evt_blk;
+  uint32_t pm1b_evt_blk;
+  uint32_t pm1a_cnt_blk;
+  uint32_t pm1b_cnt_blk;
+  uint32_t pm2_cnt_blk;
+  uint32_t pm_tmr_blk;
+  uint32_t gpe0_blk;
+  uint32_t gpe1_blk;
+  uint8_t pm1_evt_len;
+  uint8_t pm1_cnt_len;
+  uint8_t pm2_cnt_len;
+  uint8_t pm_tmr_len;
+  uint8_t gpe0_blk_len;
+  uint8_t gpe1_blk_len;
+  uint8_t gpe1_base;
+  uint8_t reserved3;
+  uint16_t p_lvl2_lat;
+  uint16_t p_lvl3_lat;
+  uint16_t flush_size;
+  uint16_t flush_stride;
+  uint8_t duty_offset;
+  uint8_t duty_width;
+  uint8_t day_alrm;
+  uint8_t mon_alrm;
+  uint8_t century;
+  uint8_t reserved4[3];
+  uint32_t flags;
+} __attribute__((packed));
+
+#define ACPI_FADT_WBINVD (1 << 0)
+#define ACPI_FADT_C1_SUPPORTED (1 << 2)
+#define ACPI_FADT_POWER_BUTTON (1 << 4) // no fixed power button
+#define ACPI_FADT_SLEEP_BUTTON (1 << 5) // no fixed sleep button
+
+struct acpi_facs {
+  char signature[4];
+  uint32_t length;
+  uint32_t hardware_signature;
+  uint32_t waking_vector;
+  uint32_t global_lock;
+  uint32_t flags;
+  uint8_t reserved[40];
+} __attribute__((packed));
+
+// One ECAM window: 1 MiB per bus, 4 KiB per function
+struct acpi_mcfg_allocation {
+  uint64_t address;
+  uint16_t segment;
+  uint8_t start_bus;
+  uint8_t end_bus;
+  uint32_t reserved;
+} __attribute__((packed));
+
+struct acpi_mcfg {
+  struct acpi_table_header hdr;
+  uint8_t reserved[8];
+  struct acpi_mcfg_allocation alloc[1];
+} __attribute__((packed));
+
+static uint8_t acpi_checksum(void *buf, size_t len) {
+  uint8_t sum = 0;
+
+  for (size_t i = 0; i < len; i++)
+    sum += ((uint8_t *)buf)[i];
+
+  return -sum;
+}
+
+static void acpi_init_header(struct acpi_table_header *hdr, const char *sig,
+                             uint32_t len, uint8_t revision) {
+  memset(hdr, 0, len);
+  memcpy(hdr->signature, sig, 4);
+  hdr->length = len;
+  hdr->revision = revision;
+  memcpy(hdr->oem_id, ACPI_OEM_ID, 6);
+  memcpy(hdr->oem_table_id, ACPI_OEM_TABLE_ID, 8);
+  hdr->oem_revision = 1;
+  memcpy(hdr->creator_id, "KVMM", 4);
+  hdr->creator_revision = 1;
+}
+
+// Resource descriptors of the host bridge _CRS
+#define ACPI_RES_IO 0x47
+#define ACPI_RES_DWORD_ADDR 0x87
+#define ACPI_RES_WORD_ADDR 0x88
+#define ACPI_RES_END 0x79
+#define ACPI_ADDR_MEM 0
+#define ACPI_ADDR_IO 1
+#define ACPI_ADDR_BUS 2
+#define ACPI_ADDR_FIXED 0x0c // min and max fixed, produced for the children
+#define ACPI_ADDR_MEM_RW 0x01
+#define ACPI_ADDR_IO_ENTIRE 0x03
+
+struct acpi_res_io {
+  uint8_t tag;
+  uint8_t decode;
+  uint16_t min;
+  uint16_t max;
+  uint8_t align;
+  uint8_t len;
+} __attribute__((packed));
+
+struct acpi_res_word {
+  uint8_t tag;
+  uint16_t len;
+  uint8_t type;
+  uint8_t flags;
+  uint8_t type_flags;
+  uint16_t granularity;
+  uint16_t min;
+  uint16_t max;
+  uint16_t translation;
+  uint16_t length;
+} __attribute__((packed));
+
+struct acpi_res_dword {
+  uint8_t tag;
+  uint16_t len;
+  uint8_t type;
+  uint8_t flags;
+  uint8_t type_flags;
+  uint32_t granularity;
+  uint32_t min;
+  uint32_t max;
+  uint32_t translation;
+  uint32_t length;
+} __attribute__((packed));
+
+#define AML_NAME_OP 0x08
+#define AML_BYTE_PREFIX 0x0a
+#define AML_WORD_PREFIX 0x0b
+#define AML_DWORD_PREFIX 0x0c
+#define AML_SCOPE_OP 0x10
+#define AML_BUFFER_OP 0x11
+#define AML_PACKAGE_OP 0x12
+#define AML_EXT_OP 0x5b
+#define AML_DEVICE_OP 0x82
+
+// EISA ids as the DSDT stores them: "PNP" compressed, then the product
+#define ACPI_EISA_PNP0A03 0x030ad041
+#define ACPI_EISA_PNP0A08 0x080ad041
+
+static uint8_t *aml_int(uint8_t *p, uint32_t val) {
+  if (val <= 1) {
+    *p++ = val; // ZeroOp and OneOp
+  } else if (val <= 0xff) {
+    *p++ = AML_BYTE_PREFIX;
+    *p++ = val;
+  } else if (val <= 0xffff) {
+    *p++ = AML_WORD_PREFIX;
+    memcpy(p, &val, 2);
+    p += 2;
+  } else {
+    *p++ = AML_DWORD_PREFIX;
+    memcpy(p, &val, 4);
+    p += 4;
+  }
+  return p;
+}
+
+static uint8_t *aml_name(uint8_t *p, const char *name, uint32_t val) {
+  *p++ = AML_NAME_OP;
+  memcpy(p, name, 4);
+  return aml_int(p + 4, val);
+}
+
+/* A package length covers itself and what follows it, so it is only known
+ * once the contents are written. aml_open leaves room for the longest
+ * encoding, aml_close writes the shortest one and moves the contents down. */
+static uint8_t *aml_open(uint8_t *p) { return p + 4; }
+
+static uint8_t *aml_close(uint8_t *start, uint8_t *end) {
+  static const size_t max[] = {0x3f, 0xfff, 0xfffff};
+  size_t body = end - (start + 4);
+  size_t n = 1;
+
+  // one byte holds 6 bits, the first of more bytes 4 and the others 8
+  while (n < 4 && body + n > max[n - 1])
+    n++;
+  size_t len = body + n;
+
+  memmove(start + n, start + 4, body);
+  if (n == 1) {
+    start[0] = len;
+  } else {
+    start[0] = (n - 1) << 6 | (len & 0xf);
+    for (size_t i = 1; i < n; i++)
+      start[i] = len >> (4 + 8 * (i - 1));
+  }
+  return start + n + body;
+}
+
+static uint8_t *aml_buffer(uint8_t *p, const void *data, size_t len) {
+  *p++ = AML_BUFFER_OP;
+  uint8_t *start = p;
+  p = aml_int(aml_open(p), len);
+  memcpy(p, data, len);
+  return aml_close(start, p + len);
+}
+
+/* acpi_crs writes the resources of the root bus: its bus number, and a share
+ * of the MMIO window for the BARs the guest places below it. Bus 0 also
+ * decodes the config ports and passes the rest of I/O space on. */
+static size_t acpi_crs(uint8_t *p, int bus, int nr_buses, uint64_t mmio_start,
+                       uint64_t mmio_end) {
+  uint32_t mmio_len = (mmio_end - mmio_start) / nr_buses;
+  uint8_t *start = p;
+
+  *(struct acpi_res_word *)p = (struct acpi_res_word){
+      .tag = ACPI_RES_WORD_ADDR,
+      .len = sizeof(struct acpi_res_word) - 3,
+      .type = ACPI_ADDR_BUS,
+      .flags = ACPI_ADDR_FIXED,
+      .min = bus,
+      .max = bus,
+      .length = 1,
+  };
+  p += sizeof(struct acpi_res_word);
+
+  if (!bus) {
+    *(struct acpi_res_io *)p = (struct acpi_res_io){
+        .tag = ACPI_RES_IO | (sizeof(struct acpi_res_io) - 1),
+        .decode = 1, // 16 bit
+        .min = PCI_CONFIG_ADDR,
+        .max = PCI_CONFIG_ADDR,
+        .align = 1,
+        .len = 8,
+    };
+    p += sizeof(struct acpi_res_io);
+
+    // I/O space but for the config ports
+    uint16_t io[2][2] = {{0, PCI_CONFIG_ADDR - 1}, {PCI_CONFIG_ADDR + 8, 0xffff}};
+    for (int i = 0; i < 2; i++) {
+      *(struct acpi_res_word *)p = (struct acpi_res_word){
+          .tag = ACPI_RES_WORD_ADDR,
+          .len = sizeof(struct acpi_res_word) - 3,
+          .type = ACPI_ADDR_IO,
+          .flags = ACPI_ADDR_FIXED,
+          .type_flags = ACPI_ADDR_IO_ENTIRE,
+          .min = io[i][0],
+          .max = io[i][1],
+          .length = io[i][1] - io[i][0] + 1,
+      };
+      p += sizeof(struct acpi_res_word);
+    }
+  }
+
+  *(struct acpi_res_dword *)p = (struct acpi_res_dword){
+      .tag = ACPI_RES_DWORD_ADDR,
+      .len = sizeof(struct acpi_res_dword) - 3,
+      .type = ACPI_ADDR_MEM,
+      .flags = ACPI_ADDR_FIXED,
+      .type_flags = ACPI_ADDR_MEM_RW,
+      .min = mmio_start + (uint64_t)bus * mmio_len,
+      .max = mmio_start + (uint64_t)(bus + 1) * mmio_len - 1,
+      .length = mmio_len,
+  };
+  p += sizeof(struct acpi_res_dword);
+
+  // end tag, a zero checksum counts as valid
+  *p++ = ACPI_RES_END | 1;
+  *p++ = 0;
+  return p - start;
+}
+
+/* acpi_prt routes INTx of the devices on a root bus. Each device has its own
+ * GSI, the one in its interrupt line register, so every entry names the GSI
+ * itself rather than a link device. */
+static uint8_t *acpi_prt(uint8_t *p, struct pci *pci, int bus) {
+  *p++ = AML_PACKAGE_OP;
+  uint8_t *prt = p;
+  p = aml_open(p);
+  uint8_t *count = p++;
+  *count = 0;
+
+  for (int slot = 0; slot < PCI_DEVS_PER_BUS; slot++) {
+    int n = bus * PCI_DEVS_PER_BUS + slot;
+    if (n >= pci->nr_devs)
+      break;
+    uint8_t pin = PCI_HDR_READ(pci->devs[n]->hdr, PCI_INTERRUPT_PIN, 8);
+    if (!pin)
+      continue;
+    *p++ = AML_PACKAGE_OP;
+    uint8_t *entry = p;
+    p = aml_open(p);
+    *p++ = 4;
+    p = aml_int(p, slot << 16 | 0xffff); // any function of the slot
+    p = aml_int(p, pin - 1);
+    p = aml_int(p, 0);
+    p = aml_int(p, PCI_HDR_READ(pci->devs[n]->hdr, PCI_INTERRUPT_LINE, 8));
+    p = aml_close(entry, p);
+    (*count)++;
+  }
+  return aml_close(prt, p);
+}
+
+/* acpi_dsdt describes one PCI Express host bridge per root bus in use, with
+ * the resources it decodes and its interrupt routing. With ACPI on, Linux
+ * only scans the root buses it finds here. */
+static size_t acpi_dsdt(uint8_t *p, struct pci *pci, uint64_t mmio_start,
+                        uint64_t mmio_end) {
+  int nr_buses = pci_nr_buses(pci) ? pci_nr_buses(pci) : 1;
+  uint8_t *start = p;
+
+  *p++ = AML_SCOPE_OP;
+  uint8_t *scope = p;
+  p = aml_open(p);
+  memcpy(p, "\\_SB_", 5);
+  p += 5;
+
+  for (int bus = 0; bus < nr_buses; bus++) {
+    // PCI0 to PCIF: there are at most PCI_ECAM_BUSES buses
+    char name[4] = {'P', 'C', 'I', "0123456789ABCDEF"[bus]};
+
+    *p++ = AML_EXT_OP;
+    *p++ = AML_DEVICE_OP;
+    uint8_t *dev = p;
+    p = aml_open(p);
+    memcpy(p, name, 4);
+    p += 4;
+    p = aml_name(p, "_HID", ACPI_EISA_PNP0A08);
+    p = aml_name(p, "_CID", ACPI_EISA_PNP0A03);
+    p = aml_name(p, "_SEG", 0);
+    p = aml_name(p, "_BBN", bus);
+    p = aml_name(p, "_UID", bus);
+    uint8_t crs[128];
+    *p++ = AML_NAME_OP;
+    memcpy(p, "_CRS", 4);
+    p = aml_buffer(p + 4, crs,
+                   acpi_crs(crs, bus, nr_buses, mmio_start, mmio_end));
+    *p++ = AML_NAME_OP;
+    memcpy(p, "_PRT", 4);
+    p = acpi_prt(p + 4, pci, bus);
+    p = aml_close(dev, p);
+  }
+
+  p = aml_close(scope, p);
+  return p - start;
+}
+
+/* acpi_setup writes an RSDP, an RSDT, a FADT with its FACS, the MCFG
+ * describing the PCI Express config space window and a DSDT with the host
+ * bridges. BARs are placed in [mmio_start, mmio_end). */
+int acpi_setup(void *mem, struct pci *pci, uint64_t mmio_start,
+               uint64_t mmio_end) {
+  uint8_t *base = (uint8_t *)mem + ACPI_START;
+  struct acpi_rsdp *rsdp = (struct acpi_rsdp *)base;
+  // the RSDP is found on a 16 byte boundary, the tables follow it
+  struct acpi_rsdt *rsdt = (struct acpi_rsdt *)(base + 32);
+  // the FACS has to be 64 byte aligned
+  struct acpi_facs *facs = (struct acpi_facs *)(base + 128);
+  struct acpi_fadt *fadt = (struct acpi_fadt *)(facs + 1);
+  struct acpi_mcfg *mcfg = (struct acpi_mcfg *)(fadt + 1);
+  // the DSDT grows with the number of buses, so it goes last
+  struct acpi_table_header *dsdt = (struct acpi_table_header *)(mcfg + 1);
+
+  memset(facs, 0, sizeof(*facs));
+  memcpy(facs->signature, "FACS", 4);
+  facs->length = sizeof(*facs);
+
+  acpi_init_header(dsdt, "DSDT", sizeof(*dsdt), 1);
+  dsdt->length += acpi_dsdt((uint8_t *)(dsdt + 1), pci, mmio_start, mmio_end);
+  dsdt->checksum = acpi_checksum(dsdt, dsdt->length);
+
+  // Without an SMI command port the guest takes ACPI mode as already on
+  acpi_init_header(&fadt->hdr, "FACP", sizeof(*fadt), 1);
+  fadt->facs = ACPI_START + ((uint8_t *)facs - base);
+  fadt->dsdt = ACPI_START + ((uint8_t *)dsdt - base);
+  fadt->sci_int = ACPI_SCI_IRQ;
+  fadt->pm1a_evt_blk = ACPI_PM_BASE + ACPI_PM1_EVT;
+  fadt->pm1_evt_len = 4;
+  fadt->pm1a_cnt_blk = ACPI_PM_BASE + ACPI_PM1_CNT;
+  fadt->pm1_cnt_len = 2;
+  fadt->pm_tmr_blk = ACPI_PM_BASE + ACPI_PM_TMR;
+  fadt->pm_tmr_len = 4;
+  // no C2 or C3 states
+  fadt->p_lvl2_lat = 101;
+  fadt->p_lvl3_lat = 1001;
+  fadt->flags = ACPI_FADT_WBINVD | ACPI_FADT_C1_SUPPORTED |
+                ACPI_FADT_POWER_BUTTON | ACPI_FADT_SLEEP_BUTTON;
+  fadt->hdr.checksum = acpi_checksum(fadt, sizeof(*fadt));
+
+  acpi_init_header(&mcfg->hdr, "MCFG", sizeof(*mcfg), 1);
+  mcfg->alloc[0] = (struct acpi_mcfg_allocation){
+      .address = PCI_ECAM_BASE,
+      .segment = 0,
+      .start_bus = 0,
+      .end_bus = PCI_ECAM_BUSES - 1,
+  };
+  mcfg->hdr.checksum = acpi_checksum(mcfg, sizeof(*mcfg));
+
+  acpi_init_header(&rsdt->hdr, "RSDT", sizeof(*rsdt), 1);
+  rsdt->entry[0] = ACPI_START + ((uint8_t *)fadt - base);
+  rsdt->entry[1] = ACPI_START + ((uint8_t *)mcfg - base);
+  rsdt->hdr.checksum = acpi_checksum(rsdt, sizeof(*rsdt));
+
+  memset(rsdp, 0, sizeof(*rsdp));
+  memcpy(rsdp->signature, "RSD PTR ", 8);
+  memcpy(rsdp->oem_id, ACPI_OEM_ID, 6);
+  rsdp->revision = 0; // ACPI 1.0, RSDT only
+  rsdp->rsdt_address = ACPI_START + ((uint8_t *)rsdt - base);
+  rsdp->checksum = acpi_checksum(rsdp, sizeof(*rsdp));
+
+  return 0;
+}
+
+/* The PM1 registers only hold what the guest writes. No fixed event is ever
+ * raised, so the SCI never fires and the status reads as clear. SCI_EN is
+ * always set: the guest is in ACPI mode from the start. */
+static void acpi_pm_io(void *owner, void *data, uint8_t is_write,
+                       uint64_t offset, uint8_t size) {
+  struct acpi_pm *pm = (struct acpi_pm *)owner;
+  uint32_t val = 0;
+
+  if (is_write) {
+    memcpy(&val, data, size);
+    if (offset == ACPI_PM1_EVT + 2 && size == 2)
+      pm->pm1_enable = val;
+    else if (offset == ACPI_PM1_CNT && size == 2)
+      pm->pm1_control = val | ACPI_PM1_SCI_EN;
+    return;
+  }
+
+  if (offset == ACPI_PM1_EVT + 2)
+    val = pm->pm1_enable;
+  else if (offset == ACPI_PM1_CNT)
+    val = pm->pm1_control;
+  else if (offset == ACPI_PM_TMR) {
+    // 24 bits at 3.579545 MHz
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    uint64_t ns = (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+    val = (uint32_t)(ns * 3579545 / 1000000000) & 0xffffff;
+  }
+  memcpy(data, &val, size);
+}
+
+void acpi_pm_reset(struct acpi_pm *pm) {
+  pm->pm1_enable = 0;
+  pm->pm1_control = ACPI_PM1_SCI_EN;
+}
+
+void acpi_pm_init(struct acpi_pm *pm, struct bus *io_bus) {
+  acpi_pm_reset(pm);
+  dev_init(&pm->dev, ACPI_PM_BASE, ACPI_PM_LEN, pm, acpi_pm_io);
+  bus_register_dev(io_bus, &pm->dev);
+}
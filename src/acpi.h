@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "bus.h"
+#include "pci.h"
+
+/* The ACPI tables live in the BIOS area below the MP table, where Linux
+ * looks for the RSDP. A FADT and a DSDT keep ACPI enabled: the DSDT holds
+ * the PCI host bridges with their _PRT, the MCFG describes ECAM. CPUs and
+ * the IOAPIC are still described by the MP table. */
+#define ACPI_START 0xe0000
+
+// PM1a event and control blocks and the PM timer, in I/O space
+#define ACPI_PM_BASE 0x600
+#define ACPI_PM_LEN 12
+#define ACPI_PM1_EVT 0
+#define ACPI_PM1_CNT 4
+#define ACPI_PM_TMR 8
+#define ACPI_PM1_SCI_EN 1
+#define ACPI_SCI_IRQ 9
+
+struct acpi_pm {
+  struct dev dev;
+  uint16_t pm1_enable;
+  uint16_t pm1_control;
+};
+
+int acpi_setup(void *mem, struct pci *pci, uint64_t mmio_start,
+               uint64_t mmio_end);
+void acpi_pm_init(struct acpi_pm *pm, struct bus *io_bus);
+void acpi_pm_reset(struct acpi_pm *pm);
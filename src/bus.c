@@ -0,0 +1,260 @@
+#include <sched.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bus.h"
+#include "err.h"
+
+// The last range hit on each bus, per thread. A vcpu polling a status
+// register keeps hitting the same device. Slots are tagged with the bus id,
+// ids are never reused so a bus at the address of a former one (or a forked
+// clone) does not inherit its entries.
+#define BUS_CACHE_SLOTS 8
+
+struct bus_cache {
+  int id;
+  uint64_t gen;
+  struct bus_range range;
+};
+
+static __thread struct bus_cache bus_cache[BUS_CACHE_SLOTS];
+static int bus_next_id = 1;
+
+// bus_map_find returns the range holding addr, ranges do not overlap
+static const struct bus_range *bus_map_find(const struct bus_map *map,
+                                            uint64_t addr) {
+  size_t lo = 0, hi = map->nr;
+
+  // first range starting past addr, the candidate is the one before it
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    if (map->ranges[mid].base <= addr)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (!lo || addr > map->ranges[lo - 1].end)
+    return NULL;
+
+  return &map->ranges[lo - 1];
+}
+
+static bool bus_find(struct bus *bus, uint64_t addr, struct bus_range *range) {
+  struct bus_cache *cache = &bus_cache[bus->id % BUS_CACHE_SLOTS];
+  // read before the map: a cache filled from a newer map is only refilled
+  uint64_t gen = __atomic_load_n(&bus->gen, __ATOMIC_ACQUIRE);
+
+  if (cache->id == bus->id && cache->gen == gen && addr >= cache->range.base &&
+      addr <= cache->range.end) {
+    *range = cache->range;
+    return true;
+  }
+
+  unsigned int idx = __atomic_load_n(&bus->epoch, __ATOMIC_SEQ_CST) & 1;
+  __atomic_fetch_add(&bus->readers[idx], 1, __ATOMIC_SEQ_CST);
+  struct bus_map *map = __atomic_load_n(&bus->map, __ATOMIC_SEQ_CST);
+  const struct bus_range *r = bus_map_find(map, addr);
+  if (r)
+    *range = *r;
+  __atomic_fetch_sub(&bus->readers[idx], 1, __ATOMIC_RELEASE);
+
+  if (!r)
+    return false;
+  *cache = (struct bus_cache){.id = bus->id, .gen = gen, .range = *range};
+  return true;
+}
+
+// bus_synchronize waits until no lookup still uses a map unpublished before
+// the call. A lookup may have read the epoch just before a flip, hence two.
+static void bus_synchronize(struct bus *bus) {
+  for (int i = 0; i < 2; i++) {
+    unsigned int idx = __atomic_fetch_add(&bus->epoch, 1, __ATOMIC_SEQ_CST) & 1;
+    while (__atomic_load_n(&bus->readers[idx], __ATOMIC_SEQ_CST))
+      sched_yield();
+  }
+}
+
+// Called with bus->lock held
+static void bus_publish(struct bus *bus, struct bus_map *map) {
+  struct bus_map *old = bus->map;
+
+  __atomic_store_n(&bus->map, map, __ATOMIC_SEQ_CST);
+  __atomic_add_fetch(&bus->gen, 1, __ATOMIC_RELEASE);
+  bus_synchronize(bus);
+  free(old);
+}
+
+static struct bus_map *bus_map_alloc(size_t nr) {
+  struct bus_map *map =
+      malloc(sizeof(struct bus_map) + nr * sizeof(struct bus_range));
+
+  if (!map) {
+    throw_err("Failed to allocate the bus map");
+    return NULL;
+  }
+  map->nr = nr;
+  return map;
+}
+
+// A port I/O exit is one load from the table. rep ins/outs goes to the
+// device in one call when it can take it.
+void bus_handle_pio(struct bus *bus, uint16_t port, void *data, uint8_t size,
+                    uint32_t count, bool is_write) {
+  struct dev *dev = __atomic_load_n(&bus->ports[port], __ATOMIC_ACQUIRE);
+
+  if (!dev || port + size - 1 > dev->base + dev->len - 1)
+    return;
+
+  uint64_t offset = port - dev->base;
+  if (dev->do_rep_io) {
+    dev->do_rep_io(dev->owner, data, is_write, offset, size, count);
+    return;
+  }
+  for (; count--; data += size)
+    dev->do_io(dev->owner, data, is_write, offset, size);
+}
+
+// The callback function for KVM_EXIT_IO and KVM_EXIT_MMIO. The handler runs
+// outside of the lookup, it may itself (de)register devices, e.g. a BAR
+// write through the config space.
+void bus_handle_io(struct bus *bus, void *data, uint8_t is_write, uint64_t addr,
+                   uint8_t size) {
+  struct bus_range range;
+
+  if (bus->ports) {
+    if (addr < BUS_PIO_PORTS)
+      bus_handle_pio(bus, addr, data, size, 1, is_write);
+    return;
+  }
+  if (!bus_find(bus, addr, &range) || addr + size - 1 > range.end)
+    return;
+
+  range.do_io(range.owner, data, is_write, addr - range.base, size);
+}
+
+static void bus_set_ports(struct bus *bus, struct dev *dev, struct dev *old,
+                          struct dev *new) {
+  uint64_t end = dev->base + dev->len;
+
+  for (uint64_t port = dev->base; port < end && port < BUS_PIO_PORTS; port++) {
+    if (bus->ports[port] == old)
+      __atomic_store_n(&bus->ports[port], new, __ATOMIC_RELEASE);
+  }
+}
+
+static int bus_conflict(struct dev *dev, uint64_t base, uint64_t end) {
+  fprintf(stderr, "Bus: device at 0x%llx-0x%llx overlaps 0x%llx-0x%llx\n",
+          (unsigned long long)dev->base,
+          (unsigned long long)(dev->base + dev->len - 1),
+          (unsigned long long)base, (unsigned long long)end);
+  return -1;
+}
+
+// Adding a new device to bus. A device overlapping one already there is
+// refused as a whole.
+int bus_register_dev(struct bus *bus, struct dev *dev) {
+  pthread_mutex_lock(&bus->lock);
+  if (bus->ports) {
+    uint64_t end = dev->base + dev->len;
+    for (uint64_t port = dev->base; port < end && port < BUS_PIO_PORTS;
+         port++) {
+      struct dev *owner = bus->ports[port];
+      if (owner) {
+        pthread_mutex_unlock(&bus->lock);
+        return bus_conflict(dev, owner->base, owner->base + owner->len - 1);
+      }
+    }
+    bus_set_ports(bus, dev, NULL, dev);
+    bus->dev_num++;
+    pthread_mutex_unlock(&bus->lock);
+    return 0;
+  }
+
+  struct bus_map *old = bus->map;
+  size_t pos = 0;
+  while (pos < old->nr && old->ranges[pos].base < dev->base)
+    pos++;
+  // the neighbours in the sorted map are the only ranges it could overlap
+  const struct bus_range *prev = pos ? &old->ranges[pos - 1] : NULL;
+  const struct bus_range *next = pos < old->nr ? &old->ranges[pos] : NULL;
+  const struct bus_range *hit =
+      prev && prev->end >= dev->base ? prev
+      : next && next->base <= dev->base + dev->len - 1 ? next
+                                                       : NULL;
+  if (hit) {
+    pthread_mutex_unlock(&bus->lock);
+    return bus_conflict(dev, hit->base, hit->end);
+  }
+
+  struct bus_map *map = bus_map_alloc(old->nr + 1);
+  if (!map) {
+    pthread_mutex_unlock(&bus->lock);
+    return -1;
+  }
+
+  memcpy(map->ranges, old->ranges, pos * sizeof(struct bus_range));
+  map->ranges[pos] = (struct bus_range){
+      .base = dev->base,
+      .end = dev->base + dev->len - 1,
+      .owner = dev->owner,
+      .do_io = dev->do_io,
+      .dev = dev,
+  };
+  memcpy(map->ranges + pos + 1, old->ranges + pos,
+         (old->nr - pos) * sizeof(struct bus_range));
+
+  bus_publish(bus, map);
+  bus->dev_num++;
+  pthread_mutex_unlock(&bus->lock);
+  return 0;
+}
+
+// Remove a device from bus
+void bus_deregsiter_dev(struct bus *bus, struct dev *dev) {
+  pthread_mutex_lock(&bus->lock);
+  if (bus->ports) {
+    bus_set_ports(bus, dev, dev, NULL);
+    pthread_mutex_unlock(&bus->lock);
+    return;
+  }
+
+  struct bus_map *old = bus->map;
+
+  // find device
+  size_t pos = 0;
+  while (pos < old->nr && old->ranges[pos].dev != dev)
+    pos++;
+  // Remove it if it is found
+  if (pos < old->nr) {
+    struct bus_map *map = bus_map_alloc(old->nr - 1);
+    if (map) {
+      memcpy(map->ranges, old->ranges, pos * sizeof(struct bus_range));
+      memcpy(map->ranges + pos, old->ranges + pos + 1,
+             (old->nr - pos - 1) * sizeof(struct bus_range));
+      bus_publish(bus, map);
+    }
+  }
+  pthread_mutex_unlock(&bus->lock);
+}
+
+void bus_init(struct bus *bus) {
+  memset(bus, 0, sizeof(*bus));
+  bus->id = __atomic_fetch_add(&bus_next_id, 1, __ATOMIC_RELAXED);
+  bus->map = calloc(1, sizeof(struct bus_map));
+  pthread_mutex_init(&bus->lock, NULL);
+}
+
+void bus_init_pio(struct bus *bus) {
+  bus_init(bus);
+  bus->ports = calloc(BUS_PIO_PORTS, sizeof(struct dev *));
+}
+
+void bus_exit(struct bus *bus) {
+  free(bus->map);
+  bus->map = NULL;
+  free(bus->ports);
+  bus->ports = NULL;
+  pthread_mutex_destroy(&bus->lock);
+}
@@ -0,0 +1,73 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define BUS_PIO_PORTS 0x10000
+
+typedef void (*dev_io_fn)(void *onwer, void *data, uint8_t is_write,
+                          uint64_t offset, uint8_t size);
+// count accesses of size bytes to the same offset, data advancing by size
+typedef void (*dev_rep_io_fn)(void *owner, void *data, uint8_t is_write,
+                              uint64_t offset, uint8_t size, uint32_t count);
+
+struct dev {
+  uint64_t base;
+  uint64_t len;
+  void *owner;
+  dev_io_fn do_io;
+  dev_rep_io_fn do_rep_io; // optional, rep ins/outs in one call
+};
+
+// A registered device as the lookup sees it, copied at registration time
+struct bus_range {
+  uint64_t base;
+  uint64_t end; // last address
+  void *owner;
+  dev_io_fn do_io;
+  struct dev *dev;
+};
+
+// An immutable snapshot of the bus, sorted by base
+struct bus_map {
+  size_t nr;
+  struct bus_range ranges[];
+};
+
+/* Lookups binary search the current map without taking a lock. An update
+ * builds a new map, publishes it and frees the old one after a grace
+ * period: once every lookup that started on the old map is done, counted
+ * in readers[] by epoch like SRCU does. */
+struct bus {
+  struct bus_map *map;
+  uint64_t gen; // bumped with every new map, invalidates the lookup caches
+  uint64_t dev_num;
+  int id; // lookup cache slot
+  unsigned int epoch;
+  unsigned long readers[2];
+  pthread_mutex_t lock; // serializes updates
+  // A port I/O bus is a table with a device per port instead of the map. A
+  // device is only moved with its decoding off, so no access races with it.
+  struct dev **ports;
+};
+
+static inline void dev_init(struct dev *dev, uint64_t base, uint64_t len,
+                            void *owner, dev_io_fn do_io) {
+  dev->base = base;
+  dev->len = len;
+  dev->owner = owner;
+  dev->do_io = do_io;
+  dev->do_rep_io = NULL;
+}
+
+int bus_register_dev(struct bus *bus, struct dev *dev);
+void bus_deregsiter_dev(struct bus *bus, struct dev *dev);
+void bus_handle_io(struct bus *bus, void *data, uint8_t is_write, uint64_t addr,
+                   uint8_t size);
+void bus_handle_pio(struct bus *bus, uint16_t port, void *data, uint8_t size,
+                    uint32_t count, bool is_write);
+void bus_init(struct bus *bus);
+void bus_init_pio(struct bus *bus);
+void bus_exit(struct bus *bus);
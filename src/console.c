@@ -0,0 +1,290 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <inttypes.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "console.h"
+#include "err.h"
+
+#define CONSOLE_RING_MASK (CONSOLE_RING_SIZE - 1)
+// how long exit waits for a stuck reader to take the rest of the output
+#define CONSOLE_EXIT_TIMEOUT_MS 500
+
+int console_parse_policy(const char *arg, enum console_policy *policy) {
+  if (!strcmp(arg, "drop"))
+    *policy = CONSOLE_POLICY_DROP;
+  else if (!strcmp(arg, "block"))
+    *policy = CONSOLE_POLICY_BLOCK;
+  else
+    return -1;
+  return 0;
+}
+
+// A unix socket console takes one client at a time, output produced while
+// nobody is connected is thrown away.
+static void console_accept(struct console *c) {
+  int fd = accept4(c->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+  if (fd < 0)
+    return;
+  if (c->fd >= 0) {
+    close(fd);
+    return;
+  }
+  c->fd = fd;
+}
+
+static void console_wake_room(struct console *c) {
+  if (!__atomic_load_n(&c->waiting, __ATOMIC_SEQ_CST))
+    return;
+  pthread_mutex_lock(&c->lock);
+  pthread_cond_broadcast(&c->room);
+  pthread_mutex_unlock(&c->lock);
+}
+
+static void console_drain_wake(struct console *c) {
+  uint64_t n;
+
+  if (read(c->wake_fd, &n, sizeof(n)) < 0)
+    return;
+}
+
+static void *console_thread(void *arg) {
+  struct console *c = (struct console *)arg;
+
+  for (;;) {
+    size_t head = c->head;
+    size_t tail = __atomic_load_n(&c->tail, __ATOMIC_ACQUIRE);
+    bool stop = __atomic_load_n(&c->stop, __ATOMIC_ACQUIRE);
+    struct pollfd fds[3] = {
+        {.fd = c->wake_fd, .events = POLLIN},
+        {.fd = c->listen_fd, .events = POLLIN},
+        {.fd = -1, .events = POLLOUT},
+    };
+
+    if (head == tail) {
+      if (stop)
+        break;
+      // the producer only kicks the eventfd when it sees this flag
+      __atomic_store_n(&c->sleeping, true, __ATOMIC_SEQ_CST);
+      if (__atomic_load_n(&c->tail, __ATOMIC_SEQ_CST) == head &&
+          poll(fds, 2, -1) > 0 && fds[0].revents)
+        console_drain_wake(c);
+      __atomic_store_n(&c->sleeping, false, __ATOMIC_RELAXED);
+      if (fds[1].revents)
+        console_accept(c);
+      continue;
+    }
+
+    size_t off = head & CONSOLE_RING_MASK;
+    size_t len = tail - head;
+    if (len > CONSOLE_RING_SIZE - off)
+      len = CONSOLE_RING_SIZE - off;
+
+    ssize_t done;
+    if (c->fd < 0)
+      done = len;
+    else if (c->kind == CONSOLE_UNIX) // a client hanging up is no SIGPIPE
+      done = send(c->fd, c->ring + off, len, MSG_NOSIGNAL);
+    else
+      done = write(c->fd, c->ring + off, len);
+    if (done < 0 && errno == EINTR)
+      continue;
+    if (done < 0 && errno == EAGAIN) {
+      // the reader is behind, producers keep filling the ring meanwhile
+      fds[2].fd = c->fd;
+      int ret = poll(fds, 3, stop ? CONSOLE_EXIT_TIMEOUT_MS : -1);
+      if (!ret)
+        break;
+      if (ret > 0 && fds[0].revents)
+        console_drain_wake(c);
+      if (fds[1].revents)
+        console_accept(c);
+      continue;
+    }
+    if (done < 0) {
+      // the reader went away (EPIPE, EIO on a pty): its output is lost
+      if (c->kind == CONSOLE_UNIX) {
+        close(c->fd);
+        c->fd = -1;
+      }
+      done = len;
+    }
+
+    __atomic_store_n(&c->head, head + done, __ATOMIC_SEQ_CST);
+    console_wake_room(c);
+  }
+
+  return NULL;
+}
+
+static int console_open_unix(struct console *c) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+  if (strlen(c->path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Console: socket path too long: %s\n", c->path);
+    return -1;
+  }
+  strcpy(addr.sun_path, c->path);
+
+  c->listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (c->listen_fd < 0)
+    return throw_err("Failed to create the console socket");
+  unlink(c->path);
+  if (bind(c->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(c->listen_fd, 1) < 0)
+    return throw_err("Failed to listen on the console socket");
+
+  printf("Console: waiting for a connection on %s\n", c->path);
+  return 0;
+}
+
+static int console_open_pty(struct console *c) {
+  struct termios tio;
+
+  c->fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+  if (c->fd < 0 || grantpt(c->fd) < 0 || unlockpt(c->fd) < 0)
+    return throw_err("Failed to open the console pty");
+
+  // raw, the guest does its own line discipline
+  if (tcgetattr(c->fd, &tio) == 0) {
+    cfmakeraw(&tio);
+    tcsetattr(c->fd, TCSANOW, &tio);
+  }
+
+  printf("Console: %s\n", ptsname(c->fd));
+  return 0;
+}
+
+// console_init opens the backend named by spec: stdout (or NULL), file:PATH,
+// unix:PATH or pty, and starts the writer thread.
+int console_init(struct console *c, const char *spec,
+                 enum console_policy policy) {
+  memset(c, 0, sizeof(*c));
+  c->fd = c->listen_fd = c->wake_fd = -1;
+  pthread_mutex_init(&c->lock, NULL);
+  pthread_cond_init(&c->room, NULL);
+
+  int ret = 0;
+  if (!spec || !strcmp(spec, "stdout")) {
+    // blocking: stdout is shared with stdio, only the writer thread waits
+    c->kind = CONSOLE_STDOUT;
+    c->fd = STDOUT_FILENO;
+  } else if (!strncmp(spec, "file:", 5)) {
+    c->kind = CONSOLE_FILE;
+    c->path = strdup(spec + 5);
+    c->fd = open(c->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (c->fd < 0)
+      ret = throw_err("Failed to open the console file");
+  } else if (!strncmp(spec, "unix:", 5)) {
+    c->kind = CONSOLE_UNIX;
+    c->path = strdup(spec + 5);
+    ret = console_open_unix(c);
+  } else if (!strcmp(spec, "pty")) {
+    c->kind = CONSOLE_PTY;
+    ret = console_open_pty(c);
+  } else {
+    fprintf(stderr, "Console: unknown backend %s\n", spec);
+    return -1;
+  }
+  if (ret < 0)
+    return -1;
+
+  // nobody may be reading a socket or a pty, the guest must not wait on it
+  if (policy == CONSOLE_POLICY_DEFAULT)
+    policy = c->kind == CONSOLE_UNIX || c->kind == CONSOLE_PTY
+                 ? CONSOLE_POLICY_DROP
+                 : CONSOLE_POLICY_BLOCK;
+  c->policy = policy;
+
+  c->ring = malloc(CONSOLE_RING_SIZE);
+  if (!c->ring)
+    return throw_err("Failed to allocate the console ring");
+  if ((c->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+    return throw_err("Failed to create the console eventfd");
+  if (pthread_create(&c->tid, NULL, console_thread, c))
+    return throw_err("Failed to create the console thread");
+
+  return 0;
+}
+
+static void console_wait_room(struct console *c) {
+  pthread_mutex_lock(&c->lock);
+  __atomic_store_n(&c->waiting, true, __ATOMIC_SEQ_CST);
+  while (c->tail - __atomic_load_n(&c->head, __ATOMIC_SEQ_CST) ==
+             CONSOLE_RING_SIZE &&
+         !c->stop)
+    pthread_cond_wait(&c->room, &c->lock);
+  __atomic_store_n(&c->waiting, false, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&c->lock);
+}
+
+// console_write queues guest output. Calls are serialized by the caller,
+// the device lock, which keeps the ring single producer.
+void console_write(struct console *c, const void *buf, size_t len) {
+  const uint8_t *p = buf;
+
+  while (len) {
+    size_t tail = c->tail;
+    size_t room =
+        CONSOLE_RING_SIZE - (tail - __atomic_load_n(&c->head, __ATOMIC_ACQUIRE));
+    if (!room) {
+      if (c->policy == CONSOLE_POLICY_DROP || c->stop) {
+        __atomic_add_fetch(&c->dropped, len, __ATOMIC_RELAXED);
+        break;
+      }
+      console_wait_room(c);
+      continue;
+    }
+
+    size_t off = tail & CONSOLE_RING_MASK;
+    size_t n = len < room ? len : room;
+    if (n > CONSOLE_RING_SIZE - off)
+      n = CONSOLE_RING_SIZE - off;
+    memcpy(c->ring + off, p, n);
+    __atomic_store_n(&c->tail, tail + n, __ATOMIC_SEQ_CST);
+    p += n;
+    len -= n;
+  }
+
+  uint64_t one = 1;
+  if (__atomic_exchange_n(&c->sleeping, false, __ATOMIC_SEQ_CST) &&
+      write(c->wake_fd, &one, sizeof(one)) < 0)
+    throw_err("Failed to wake the console thread");
+}
+
+// console_exit lets the writer drain what the guest has written so far
+void console_exit(struct console *c) {
+  uint64_t one = 1;
+
+  if (!c->tid)
+    return;
+  pthread_mutex_lock(&c->lock);
+  __atomic_store_n(&c->stop, true, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&c->room);
+  pthread_mutex_unlock(&c->lock);
+  if (write(c->wake_fd, &one, sizeof(one)) == sizeof(one))
+    pthread_join(c->tid, NULL);
+  c->tid = 0;
+
+  if (c->dropped)
+    fprintf(stderr, "Console: %" PRIu64 " bytes of guest output dropped\n",
+            c->dropped);
+  if (c->fd >= 0 && c->kind != CONSOLE_STDOUT)
+    close(c->fd);
+  if (c->listen_fd >= 0) {
+    close(c->listen_fd);
+    unlink(c->path);
+  }
+  close(c->wake_fd);
+  free(c->ring);
+  free(c->path);
+}
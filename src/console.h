@@ -0,0 +1,51 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CONSOLE_RING_SIZE (256 << 10) // power of two
+
+enum console_kind {
+  CONSOLE_STDOUT,
+  CONSOLE_FILE,
+  CONSOLE_UNIX,
+  CONSOLE_PTY,
+};
+
+// What the guest side does when the ring is full
+enum console_policy {
+  CONSOLE_POLICY_DEFAULT, // block for stdout and files, drop otherwise
+  CONSOLE_POLICY_DROP,
+  CONSOLE_POLICY_BLOCK,
+};
+
+/* Guest console output. The UART appends to a single producer, single
+ * consumer ring and a writer thread drains it to the host with nonblocking
+ * writes, so a slow terminal or reader never stalls a vcpu (unless the
+ * block policy is chosen and the ring fills up). */
+struct console {
+  enum console_kind kind;
+  enum console_policy policy;
+  int fd;        // output, -1 while no unix client is connected
+  int listen_fd; // unix socket
+  int wake_fd;   // eventfd, the writer waits on it when the ring is empty
+  char *path;
+  uint8_t *ring;
+  size_t head; // consumer
+  size_t tail; // producer
+  bool sleeping;
+  bool waiting; // a producer waits for room, block policy
+  bool stop;
+  uint64_t dropped;
+  pthread_mutex_t lock; // only taken by a blocked producer and to wake it
+  pthread_cond_t room;
+  pthread_t tid;
+};
+
+int console_parse_policy(const char *arg, enum console_policy *policy);
+int console_init(struct console *c, const char *spec,
+                 enum console_policy policy);
+void console_write(struct console *c, const void *buf, size_t len);
+void console_exit(struct console *c);
@@ -1,28 +1,337 @@
+#define _GNU_SOURCE
+#include <errno.h>
 #include <fcntl.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <unistd.h>
 
 #include "diskimg.h"
 
-ssize_t diskimg_read(struct diskimg *diskimg, void *data, off_t offset,
-                     size_t size) {
-  lseek(diskimg->fd, offset, SEEK_SET);
-  return read(diskimg->fd, data, size);
+static void diskimg_ring_close(struct diskimg_ring *ring);
+
+static size_t diskimg_iov_len(const struct iovec *iov, int iovcnt) {
+  size_t len = 0;
+
+  for (int i = 0; i < iovcnt; i++)
+    len += iov[i].iov_len;
+  return len;
+}
+
+// diskimg_iov_copy copies between buf and the iovec from byte off on
+static void diskimg_iov_copy(const struct iovec *iov, int iovcnt, size_t off,
+                             uint8_t *buf, size_t len, bool to_buf) {
+  for (int i = 0; i < iovcnt && len; i++) {
+    if (off >= iov[i].iov_len) {
+      off -= iov[i].iov_len;
+      continue;
+    }
+    size_t n = iov[i].iov_len - off;
+    if (n > len)
+      n = len;
+    uint8_t *p = (uint8_t *)iov[i].iov_base + off;
+    memcpy(to_buf ? buf : p, to_buf ? p : buf, n);
+    buf += n;
+    len -= n;
+    off = 0;
+  }
+}
+
+// O_DIRECT takes guest memory as is only when every buffer is aligned
+static bool diskimg_aligned(struct diskimg *diskimg, const struct iovec *iov,
+                            int iovcnt) {
+  for (int i = 0; i < iovcnt; i++) {
+    if ((uintptr_t)iov[i].iov_base & (diskimg->mem_align - 1) ||
+        iov[i].iov_len & (diskimg->io_align - 1))
+      return false;
+  }
+  return true;
 }
 
-ssize_t diskimg_write(struct diskimg *diskimg, void *data, off_t offset,
-                      size_t size) {
-  lseek(diskimg->fd, offset, SEEK_SET);
-  return write(diskimg->fd, data, size);
+// diskimg_bounce_sync moves a request through the spare buffer of the pool,
+// a piece at a time
+static ssize_t diskimg_bounce_sync(struct diskimg_ring *ring,
+                                   struct diskimg *diskimg, bool write,
+                                   const struct iovec *iov, int iovcnt,
+                                   off_t offset, size_t len) {
+  uint8_t *buf = ring->pool + DISKIMG_BOUNCE_SLOTS * DISKIMG_BOUNCE_SIZE;
+  size_t done = 0;
+
+  while (done < len) {
+    size_t n = len - done;
+    if (n > DISKIMG_BOUNCE_SIZE)
+      n = DISKIMG_BOUNCE_SIZE;
+    if (write)
+      diskimg_iov_copy(iov, iovcnt, done, buf, n, true);
+    ssize_t ret = write ? pwrite(diskimg->fd, buf, n, offset + done)
+                        : pread(diskimg->fd, buf, n, offset + done);
+    if (ret <= 0)
+      return done ? (ssize_t)done : ret;
+    if (!write)
+      diskimg_iov_copy(iov, iovcnt, done, buf, ret, false);
+    done += ret;
+  }
+  return done;
+}
+
+/* diskimg_ring_init sets up an io_uring of at least entries requests, and
+ * the bounce buffers if the image is opened with O_DIRECT. If the kernel has
+ * no io_uring, fd is left at -1 and requests run synchronously. */
+int diskimg_ring_init(struct diskimg_ring *ring, struct diskimg *diskimg,
+                      unsigned int entries) {
+  struct io_uring_params p;
+
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = ring->event_fd = -1;
+  if (diskimg->direct) {
+    size_t align = sysconf(_SC_PAGESIZE);
+    if (align < diskimg->mem_align)
+      align = diskimg->mem_align;
+    if (posix_memalign((void **)&ring->pool, align,
+                       (DISKIMG_BOUNCE_SLOTS + 1) * DISKIMG_BOUNCE_SIZE))
+      return -1;
+    for (int i = 0; i < DISKIMG_BOUNCE_SLOTS; i++) {
+      ring->bounce[i].buf = ring->pool + i * DISKIMG_BOUNCE_SIZE;
+      ring->free_bounce[ring->nr_free_bounce++] = i;
+    }
+  }
+
+  memset(&p, 0, sizeof(p));
+  int fd = syscall(__NR_io_uring_setup, entries, &p);
+  if (fd < 0)
+    return 0;
+
+  ring->sq_map_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+  ring->cq_map_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  // both rings can share a mapping, the longer one covers the other
+  if (p.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_map_len > ring->sq_map_len)
+      ring->sq_map_len = ring->cq_map_len;
+    ring->cq_map_len = 0;
+  }
+  ring->sq_map = mmap(NULL, ring->sq_map_len, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+  ring->cq_map = ring->cq_map_len
+                     ? mmap(NULL, ring->cq_map_len, PROT_READ | PROT_WRITE,
+                            MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING)
+                     : ring->sq_map;
+  ring->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+  ring->fd = fd;
+  if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED ||
+      ring->sqes == MAP_FAILED) {
+    diskimg_ring_close(ring);
+    return 0;
+  }
+
+  uint8_t *sq = ring->sq_map, *cq = ring->cq_map;
+  ring->sq_head = (unsigned int *)(sq + p.sq_off.head);
+  ring->sq_tail = (unsigned int *)(sq + p.sq_off.tail);
+  ring->sq_mask = (unsigned int *)(sq + p.sq_off.ring_mask);
+  ring->sq_array = (unsigned int *)(sq + p.sq_off.array);
+  ring->cq_head = (unsigned int *)(cq + p.cq_off.head);
+  ring->cq_tail = (unsigned int *)(cq + p.cq_off.tail);
+  ring->cq_mask = (unsigned int *)(cq + p.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+  ring->entries = p.sq_entries;
+
+  ring->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  if (ring->event_fd < 0 ||
+      syscall(__NR_io_uring_register, fd, IORING_REGISTER_EVENTFD,
+              &ring->event_fd, 1) < 0)
+    diskimg_ring_close(ring);
+  return 0;
+}
+
+/* diskimg_ring_queue queues a vectored read or write, it is started by the
+ * next diskimg_ring_submit. It returns 1 once queued, -1 if the ring is
+ * full. When the request cannot be queued, without io_uring or a bounce
+ * buffer, the I/O is done right away: the result goes to sync and it
+ * returns 0. */
+int diskimg_ring_queue(struct diskimg_ring *ring, struct diskimg *diskimg,
+                       bool write, const struct iovec *iov, int iovcnt,
+                       off_t offset, uint64_t tag,
+                       struct diskimg_completion *sync) {
+  size_t len = diskimg_iov_len(iov, iovcnt);
+  bool bounce = diskimg->direct && !diskimg_aligned(diskimg, iov, iovcnt);
+  ssize_t res;
+
+  // the guest is told the block size, a smaller I/O cannot be done
+  if (diskimg->direct && (offset | len) & (diskimg->io_align - 1)) {
+    *sync = (struct diskimg_completion){tag, -EINVAL};
+    return 0;
+  }
+
+  if (ring->fd < 0 ||
+      (bounce && (!ring->nr_free_bounce || len > DISKIMG_BOUNCE_SIZE))) {
+    if (bounce)
+      res = diskimg_bounce_sync(ring, diskimg, write, iov, iovcnt, offset,
+                                len);
+    else
+      res = write ? pwritev(diskimg->fd, iov, iovcnt, offset)
+                  : preadv(diskimg->fd, iov, iovcnt, offset);
+    *sync = (struct diskimg_completion){tag, res < 0 ? -errno : res};
+    return 0;
+  }
+
+  unsigned int tail = *ring->sq_tail;
+  if (tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE) == ring->entries)
+    return -1;
+
+  unsigned int idx = tail & *ring->sq_mask;
+  struct io_uring_sqe *sqe = &ring->sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->fd = diskimg->fd;
+  sqe->off = offset;
+  if (bounce) {
+    int slot = ring->free_bounce[--ring->nr_free_bounce];
+    struct diskimg_bounce *b = &ring->bounce[slot];
+
+    *b = (struct diskimg_bounce){tag, iov, iovcnt, write, b->buf};
+    if (write)
+      diskimg_iov_copy(iov, iovcnt, 0, b->buf, len, true);
+    sqe->opcode = write ? IORING_OP_WRITE : IORING_OP_READ;
+    sqe->addr = (uint64_t)b->buf;
+    sqe->len = len;
+    sqe->user_data = DISKIMG_BOUNCE_TAG | slot;
+  } else {
+    sqe->opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+    sqe->addr = (uint64_t)iov;
+    sqe->len = iovcnt;
+    sqe->user_data = tag;
+  }
+  ring->sq_array[idx] = idx;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->queued++;
+  return 1;
 }
 
-int diskimg_init(struct diskimg *diskimg, const char *file_path) {
-  diskimg->fd = open(file_path, O_RDWR);
+// diskimg_ring_submit starts all queued requests with one system call. It
+// fails with errno set, EAGAIN or EBUSY if the kernel is short of resources
+// until completions are reaped.
+int diskimg_ring_submit(struct diskimg_ring *ring) {
+  while (ring->queued) {
+    int ret = syscall(__NR_io_uring_enter, ring->fd, ring->queued, 0, 0, NULL,
+                      0);
+    if (ret < 0 && errno == EINTR)
+      continue;
+    if (ret < 0)
+      return -1;
+    ring->queued -= ret;
+  }
+  return 0;
+}
+
+// diskimg_ring_wait sleeps until at least one request completed
+int diskimg_ring_wait(struct diskimg_ring *ring) {
+  for (;;) {
+    int ret = syscall(__NR_io_uring_enter, ring->fd, 0, 1,
+                      IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret >= 0 || errno != EINTR)
+      return ret < 0 ? -1 : 0;
+  }
+}
+
+// diskimg_ring_done turns what the kernel reported for user_data into the
+// completion of the request, a bounce buffer goes back to the pool
+static struct diskimg_completion diskimg_ring_done(struct diskimg_ring *ring,
+                                                   uint64_t user_data,
+                                                   int64_t res) {
+  if (!(user_data & DISKIMG_BOUNCE_TAG))
+    return (struct diskimg_completion){user_data, res};
+
+  int slot = user_data & ~DISKIMG_BOUNCE_TAG;
+  struct diskimg_bounce *b = &ring->bounce[slot];
+
+  if (!b->write && res > 0)
+    diskimg_iov_copy(b->iov, b->iovcnt, 0, b->buf, res, false);
+  ring->free_bounce[ring->nr_free_bounce++] = slot;
+  return (struct diskimg_completion){b->tag, res};
+}
+
+// diskimg_ring_reap collects up to max completions without waiting
+int diskimg_ring_reap(struct diskimg_ring *ring,
+                      struct diskimg_completion *done, int max) {
+  if (ring->fd < 0)
+    return 0;
+
+  unsigned int head = *ring->cq_head;
+  unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+  int n = 0;
+  for (; head != tail && n < max; head++, n++) {
+    struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+    done[n] = diskimg_ring_done(ring, cqe->user_data, cqe->res);
+  }
+  __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  return n;
+}
+
+/* diskimg_ring_cancel takes the queued requests the kernel did not take off
+ * the submission queue back. They go to done as failed, there are at most
+ * as many as the ring has entries. */
+int diskimg_ring_cancel(struct diskimg_ring *ring,
+                        struct diskimg_completion *done) {
+  unsigned int tail = *ring->sq_tail;
+  int n = 0;
+
+  for (; ring->queued; ring->queued--, n++) {
+    struct io_uring_sqe *sqe = &ring->sqes[--tail & *ring->sq_mask];
+    done[n] = diskimg_ring_done(ring, sqe->user_data, -ECANCELED);
+  }
+  __atomic_store_n(ring->sq_tail, tail, __ATOMIC_RELEASE);
+  return n;
+}
+
+static void diskimg_ring_close(struct diskimg_ring *ring) {
+  if (ring->fd < 0)
+    return;
+  if (ring->sqes && ring->sqes != MAP_FAILED)
+    munmap(ring->sqes, ring->sqes_len);
+  if (ring->cq_map_len && ring->cq_map && ring->cq_map != MAP_FAILED)
+    munmap(ring->cq_map, ring->cq_map_len);
+  if (ring->sq_map && ring->sq_map != MAP_FAILED)
+    munmap(ring->sq_map, ring->sq_map_len);
+  if (ring->event_fd >= 0)
+    close(ring->event_fd);
+  close(ring->fd);
+  ring->fd = ring->event_fd = -1;
+}
+
+void diskimg_ring_exit(struct diskimg_ring *ring) {
+  diskimg_ring_close(ring);
+  free(ring->pool);
+  ring->pool = NULL;
+}
+
+// With direct, the image is opened with O_DIRECT: guest I/O bypasses the
+// host page cache, the guest caches the data already
+int diskimg_init(struct diskimg *diskimg, const char *file_path, bool direct) {
+  struct statx st;
+
+  diskimg->direct = direct;
+  diskimg->fd = open(file_path, O_RDWR | (direct ? O_DIRECT : 0));
   if (diskimg->fd < 0)
     return -1;
-  struct stat st;
-  fstat(diskimg->fd, &st);
-  diskimg->size = st.st_size;
+  if (statx(diskimg->fd, "", AT_EMPTY_PATH, STATX_SIZE | STATX_DIOALIGN,
+            &st) < 0)
+    return -1;
+  diskimg->size = st.stx_size;
+
+  // kernels without STATX_DIOALIGN: the traditional sector alignment
+  diskimg->mem_align = diskimg->io_align = 512;
+  if (direct && (st.stx_mask & STATX_DIOALIGN)) {
+    if (!st.stx_dio_offset_align) {
+      errno = EINVAL;
+      return -1;
+    }
+    diskimg->mem_align = st.stx_dio_mem_align;
+    diskimg->io_align = st.stx_dio_offset_align;
+  }
   return 0;
 }
 
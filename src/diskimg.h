@@ -1,19 +1,79 @@
 #pragma once
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <sys/uio.h>
+
+#define DISKIMG_BOUNCE_SLOTS 16
+#define DISKIMG_BOUNCE_SIZE (256 << 10)
+// user_data of a bounced request, the slot is in the low bits
+#define DISKIMG_BOUNCE_TAG (1ULL << 63)
 
 /* simple backed by disk image file */
 struct diskimg {
   int fd;
   size_t size;
+  bool direct;        // O_DIRECT, the host page cache is bypassed
+  uint32_t mem_align; // O_DIRECT alignment of the buffers
+  uint32_t io_align;  // O_DIRECT alignment of offsets and lengths
+};
+
+// A request going through an aligned buffer of the pool instead of guest
+// memory, which it is copied to or from
+struct diskimg_bounce {
+  uint64_t tag;
+  const struct iovec *iov;
+  int iovcnt;
+  bool write;
+  uint8_t *buf;
+};
+
+/* An io_uring submission and completion queue pair, one per request queue
+ * of the device so they need no locking. Requests point straight into
+ * guest memory and complete in any order, each with the tag it was queued
+ * with. Without io_uring (fd < 0) they are done at once, synchronously. */
+struct diskimg_ring {
+  int fd;
+  int event_fd; // signalled on completions, -1 without io_uring
+  unsigned int entries;
+  unsigned int queued; // written to the SQ, not submitted yet
+  unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned int *cq_head, *cq_tail, *cq_mask;
+  struct io_uring_cqe *cqes;
+  void *sq_map, *cq_map;
+  size_t sq_map_len, cq_map_len, sqes_len;
+  // With O_DIRECT, the bounce buffers and one more: a request that does not
+  // get one goes through it synchronously, piece by piece
+  uint8_t *pool;
+  struct diskimg_bounce bounce[DISKIMG_BOUNCE_SLOTS];
+  uint16_t free_bounce[DISKIMG_BOUNCE_SLOTS];
+  int nr_free_bounce;
+};
+
+struct diskimg_completion {
+  uint64_t tag;
+  int64_t res; // bytes transferred or -errno
 };
 
-ssize_t diskimg_read(struct diskimg *diskimg,
-		     void *data,
-		     off_t offset,
-		     size_t size);
-ssize_t diskimg_write(struct diskimg *diskimg,
-		      void *data,
-		      off_t offset,
-		      size_t size);
-int diskimg_init(struct diskimg *diskimg, const char *file_path);
+int diskimg_ring_init(struct diskimg_ring *ring,
+		      struct diskimg *diskimg,
+		      unsigned int entries);
+int diskimg_ring_queue(struct diskimg_ring *ring,
+		       struct diskimg *diskimg,
+		       bool write,
+		       const struct iovec *iov,
+		       int iovcnt,
+		       off_t offset,
+		       uint64_t tag,
+		       struct diskimg_completion *sync);
+int diskimg_ring_submit(struct diskimg_ring *ring);
+int diskimg_ring_wait(struct diskimg_ring *ring);
+int diskimg_ring_reap(struct diskimg_ring *ring,
+		      struct diskimg_completion *done,
+		      int max);
+int diskimg_ring_cancel(struct diskimg_ring *ring,
+			struct diskimg_completion *done);
+void diskimg_ring_exit(struct diskimg_ring *ring);
+int diskimg_init(struct diskimg *diskimg, const char *file_path, bool direct);
 void diskimg_exit(struct diskimg *diskimg);
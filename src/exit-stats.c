@@ -0,0 +1,329 @@
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "exit-stats.h"
+#include "vm.h"
+
+// tag the address space so that port 0 still gets a non-zero key
+#define EXIT_ADDR_MMIO (1ULL << 63)
+#define EXIT_ADDR_PIO (1ULL << 62)
+#define EXIT_ADDR_MASK (~(EXIT_ADDR_MMIO | EXIT_ADDR_PIO))
+
+static const char *exit_reason_names[EXIT_STATS_REASONS] = {
+    [KVM_EXIT_UNKNOWN] = "UNKNOWN",
+    [KVM_EXIT_EXCEPTION] = "EXCEPTION",
+    [KVM_EXIT_IO] = "IO",
+    [KVM_EXIT_HYPERCALL] = "HYPERCALL",
+    [KVM_EXIT_DEBUG] = "DEBUG",
+    [KVM_EXIT_HLT] = "HLT",
+    [KVM_EXIT_MMIO] = "MMIO",
+    [KVM_EXIT_IRQ_WINDOW_OPEN] = "IRQ_WINDOW_OPEN",
+    [KVM_EXIT_SHUTDOWN] = "SHUTDOWN",
+    [KVM_EXIT_FAIL_ENTRY] = "FAIL_ENTRY",
+    [KVM_EXIT_INTR] = "INTR",
+    [KVM_EXIT_SET_TPR] = "SET_TPR",
+    [KVM_EXIT_TPR_ACCESS] = "TPR_ACCESS",
+    [KVM_EXIT_NMI] = "NMI",
+    [KVM_EXIT_INTERNAL_ERROR] = "INTERNAL_ERROR",
+    [KVM_EXIT_SYSTEM_EVENT] = "SYSTEM_EVENT",
+    [KVM_EXIT_IOAPIC_EOI] = "IOAPIC_EOI",
+    [KVM_EXIT_X86_RDMSR] = "X86_RDMSR",
+    [KVM_EXIT_X86_WRMSR] = "X86_WRMSR",
+    [KVM_EXIT_X86_BUS_LOCK] = "X86_BUS_LOCK",
+};
+
+static const char *json_path;
+static double tsc_per_ns;
+static int report_pipe[2] = {-1, -1};
+static pthread_t report_tid;
+
+static inline const char *exit_reason_name(uint32_t reason) {
+  return exit_reason_names[reason] ? exit_reason_names[reason] : "OTHER";
+}
+
+static inline double cycles_to_ns(uint64_t cycles) {
+  return tsc_per_ns > 0 ? cycles / tsc_per_ns : 0;
+}
+
+static void exit_stats_add_addr(struct exit_stats *st, uint64_t key,
+                                uint64_t count, uint64_t writes,
+                                uint64_t cycles) {
+  // Fibonacci hashing spreads the neighbouring ports of one device
+  unsigned int i = (key * 0x9E3779B97F4A7C15ULL) >> 56;
+
+  for (unsigned int n = 0; n < EXIT_STATS_ADDRS; n++) {
+    struct exit_addr *a = &st->addr[(i + n) % EXIT_STATS_ADDRS];
+    if (a->key == 0)
+      a->key = key;
+    if (a->key == key) {
+      a->count += count;
+      a->writes += writes;
+      a->cycles += cycles;
+      return;
+    }
+  }
+  st->addr_dropped += count;
+}
+
+// exit_stats_account records one exit which took cycles to handle in the VMM
+void exit_stats_account(struct exit_stats *st, struct kvm_run *run,
+                        uint32_t reason, uint64_t cycles) {
+  struct exit_hist *h = &st->reason[reason % EXIT_STATS_REASONS];
+
+  h->count++;
+  h->cycles += cycles;
+  if (cycles > h->max)
+    h->max = cycles;
+  h->buckets[cycles ? 63 - __builtin_clzll(cycles) : 0]++;
+
+  if (reason == KVM_EXIT_IO)
+    exit_stats_add_addr(st, run->io.port | EXIT_ADDR_PIO, 1,
+                        run->io.direction == KVM_EXIT_IO_OUT, cycles);
+  else if (reason == KVM_EXIT_MMIO)
+    exit_stats_add_addr(st, run->mmio.phys_addr | EXIT_ADDR_MMIO, 1,
+                        run->mmio.is_write, cycles);
+}
+
+// Sum the stats of every vcpu, the result is a snapshot of racing counters
+static void exit_stats_sum(vm_t *v, struct exit_stats *sum) {
+  memset(sum, 0, sizeof(*sum));
+  for (int i = 0; i < v->nr_vcpus; i++) {
+    struct exit_stats *st = v->vcpus[i].stats;
+    if (!st)
+      continue;
+    for (int r = 0; r < EXIT_STATS_REASONS; r++) {
+      struct exit_hist *h = &sum->reason[r];
+      h->count += st->reason[r].count;
+      h->cycles += st->reason[r].cycles;
+      if (st->reason[r].max > h->max)
+        h->max = st->reason[r].max;
+      for (int b = 0; b < EXIT_STATS_BUCKETS; b++)
+        h->buckets[b] += st->reason[r].buckets[b];
+    }
+    for (int a = 0; a < EXIT_STATS_ADDRS; a++) {
+      struct exit_addr *e = &st->addr[a];
+      if (e->key)
+        exit_stats_add_addr(sum, e->key, e->count, e->writes, e->cycles);
+    }
+    sum->addr_dropped += st->addr_dropped;
+  }
+}
+
+// upper bound (in cycles) of the bucket holding the given percentile
+static uint64_t exit_hist_percentile(struct exit_hist *h, double pct) {
+  uint64_t rank = h->count * pct / 100.0, seen = 0;
+
+  for (int b = 0; b < EXIT_STATS_BUCKETS; b++) {
+    seen += h->buckets[b];
+    if (seen > rank)
+      return b >= 63 ? ~0ULL : (2ULL << b) - 1;
+  }
+  return h->max;
+}
+
+static int exit_addr_cmp(const void *a, const void *b) {
+  const struct exit_addr *x = a, *y = b;
+  return (x->count < y->count) - (x->count > y->count);
+}
+
+#define EXIT_STATS_TOP_ADDRS 10
+
+void exit_stats_print(vm_t *v) {
+  struct exit_stats *sum = malloc(sizeof(*sum));
+  if (!sum)
+    return;
+  exit_stats_sum(v, sum);
+
+  fprintf(stderr, "\n=== VM exit statistics (%d vcpus, %.2f TSC cycles/ns) ===\n",
+          v->nr_vcpus, tsc_per_ns);
+  fprintf(stderr, "%-16s %12s %12s %10s %10s %10s\n", "reason", "count",
+          "avg(ns)", "p50(ns)", "p99(ns)", "max(ns)");
+  for (int r = 0; r < EXIT_STATS_REASONS; r++) {
+    struct exit_hist *h = &sum->reason[r];
+    if (!h->count)
+      continue;
+    fprintf(stderr, "%-16s %12" PRIu64 " %12.0f %10.0f %10.0f %10.0f\n",
+            exit_reason_name(r), h->count, cycles_to_ns(h->cycles / h->count),
+            cycles_to_ns(exit_hist_percentile(h, 50)),
+            cycles_to_ns(exit_hist_percentile(h, 99)), cycles_to_ns(h->max));
+  }
+
+  qsort(sum->addr, EXIT_STATS_ADDRS, sizeof(struct exit_addr), exit_addr_cmp);
+  fprintf(stderr, "\n%-6s %-18s %12s %12s %12s\n", "space", "address", "count",
+          "writes", "avg(ns)");
+  for (int a = 0; a < EXIT_STATS_TOP_ADDRS && sum->addr[a].count; a++) {
+    struct exit_addr *e = &sum->addr[a];
+    bool mmio = e->key & EXIT_ADDR_MMIO;
+    fprintf(stderr, "%-6s 0x%-16" PRIx64 " %12" PRIu64 " %12" PRIu64 " %12.0f\n", mmio ? "mmio" : "pio",
+            (uint64_t)(e->key & EXIT_ADDR_MASK), e->count, e->writes,
+            cycles_to_ns(e->cycles / e->count));
+  }
+  if (sum->addr_dropped)
+    fprintf(stderr, "(%" PRIu64 " exits on untracked addresses)\n", sum->addr_dropped);
+
+  // kicks through an ioeventfd never exit to userspace, they are counted by
+  // the device
+  struct virtio_blk_dev *blk = &v->virtio_blk_dev;
+  if (blk->enable) {
+    fprintf(stderr, "\n%-16s %12s %12s\n", "virtio-blk", "kicks",
+            "interrupts");
+    for (int i = 0; i < blk->num_queues; i++)
+      fprintf(stderr, "queue %-10d %12" PRIu64 " %12" PRIu64 "\n", i,
+              blk->queues[i].kicks, blk->queues[i].irqs);
+  }
+
+  free(sum);
+}
+
+static void exit_stats_json_hist(FILE *f, struct exit_hist *h) {
+  int last = 0;
+
+  for (int b = 0; b < EXIT_STATS_BUCKETS; b++)
+    if (h->buckets[b])
+      last = b;
+  fprintf(f, "\"count\": %" PRIu64 ", \"cycles\": %" PRIu64
+             ", \"max_cycles\": %" PRIu64 ", \"log2_hist\": [",
+          h->count, h->cycles, h->max);
+  for (int b = 0; b <= last; b++)
+    fprintf(f, "%s%" PRIu64, b ? ", " : "", h->buckets[b]);
+  fprintf(f, "]");
+}
+
+// exit_stats_dump_json writes the per-vcpu stats, histogram bucket b counts
+// the exits handled in [2^b, 2^(b+1)) TSC cycles.
+int exit_stats_dump_json(vm_t *v, const char *path) {
+  char tmp[4096];
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  FILE *f = fopen(tmp, "w");
+  if (!f)
+    return throw_err("Failed to open the exit stats file");
+
+  fprintf(f, "{\n  \"tsc_cycles_per_ns\": %f,\n  \"vcpus\": [", tsc_per_ns);
+  for (int i = 0; i < v->nr_vcpus; i++) {
+    struct exit_stats *st = v->vcpus[i].stats;
+    bool first = true;
+    if (!st)
+      continue;
+
+    fprintf(f, "%s\n    {\"id\": %d, \"reasons\": {", i ? "," : "", i);
+    for (int r = 0; r < EXIT_STATS_REASONS; r++) {
+      if (!st->reason[r].count)
+        continue;
+      fprintf(f, "%s\n      \"%s\": {", first ? "" : ",", exit_reason_name(r));
+      exit_stats_json_hist(f, &st->reason[r]);
+      fprintf(f, "}");
+      first = false;
+    }
+    fprintf(f, "},\n     \"addresses\": [");
+    first = true;
+    for (int a = 0; a < EXIT_STATS_ADDRS; a++) {
+      struct exit_addr *e = &st->addr[a];
+      if (!e->key)
+        continue;
+      fprintf(f, "%s\n      {\"space\": \"%s\", \"addr\": %" PRIu64
+                 ", \"count\": %" PRIu64 ", \"writes\": %" PRIu64
+                 ", \"cycles\": %" PRIu64 "}",
+              first ? "" : ",", e->key & EXIT_ADDR_MMIO ? "mmio" : "pio",
+              (uint64_t)(e->key & EXIT_ADDR_MASK), e->count, e->writes,
+              e->cycles);
+      first = false;
+    }
+    fprintf(f, "],\n     \"untracked_addresses\": %" PRIu64 "}",
+            st->addr_dropped);
+  }
+  fprintf(f, "\n  ]\n}\n");
+  fclose(f);
+
+  if (rename(tmp, path) < 0)
+    return throw_err("Failed to write the exit stats file");
+  return 0;
+}
+
+static void exit_stats_report(vm_t *v) {
+  exit_stats_print(v);
+  if (json_path)
+    exit_stats_dump_json(v, json_path);
+}
+
+static void exit_stats_signal(int sig) {
+  char c = 0;
+  // only async-signal-safe work here, the report thread does the rest
+  if (write(report_pipe[1], &c, 1) < 0)
+    return;
+}
+
+static void *exit_stats_thread(void *arg) {
+  vm_t *v = (vm_t *)arg;
+  char c;
+
+  while (read(report_pipe[0], &c, 1) == 1 && c == 0)
+    exit_stats_report(v);
+
+  return NULL;
+}
+
+static void exit_stats_calibrate(void) {
+  struct timespec t0, t1, delay = {.tv_nsec = 20 * 1000 * 1000};
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  uint64_t c0 = exit_stats_now();
+  nanosleep(&delay, NULL);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  uint64_t c1 = exit_stats_now();
+
+  double ns = (t1.tv_sec - t0.tv_sec) * 1e9 + (t1.tv_nsec - t0.tv_nsec);
+  tsc_per_ns = (c1 - c0) / ns;
+}
+
+// exit_stats_init turns on exit accounting for every vcpu. SIGUSR2 prints a
+// summary (and rewrites json_path if given) while the guest keeps running.
+int exit_stats_init(vm_t *v, const char *path) {
+  for (int i = 0; i < v->nr_vcpus; i++) {
+    v->vcpus[i].stats = calloc(1, sizeof(struct exit_stats));
+    if (!v->vcpus[i].stats)
+      return throw_err("Failed to allocate exit stats");
+  }
+
+  json_path = path;
+  exit_stats_calibrate();
+
+  if (pipe(report_pipe) < 0)
+    return throw_err("Failed to create the exit stats pipe");
+  if (pthread_create(&report_tid, NULL, exit_stats_thread, v))
+    return throw_err("Failed to create the exit stats thread");
+
+  struct sigaction sa = {.sa_handler = exit_stats_signal,
+                         .sa_flags = SA_RESTART};
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGUSR2, &sa, NULL) < 0)
+    return throw_err("Failed to install the SIGUSR2 handler");
+
+  return 0;
+}
+
+void exit_stats_exit(vm_t *v) {
+  char c = 1;
+
+  if (report_pipe[1] < 0)
+    return;
+
+  signal(SIGUSR2, SIG_IGN);
+  if (write(report_pipe[1], &c, 1) == 1)
+    pthread_join(report_tid, NULL);
+  close(report_pipe[0]);
+  close(report_pipe[1]);
+  report_pipe[0] = report_pipe[1] = -1;
+
+  exit_stats_report(v);
+  for (int i = 0; i < v->nr_vcpus; i++) {
+    free(v->vcpus[i].stats);
+    v->vcpus[i].stats = NULL;
+  }
+}
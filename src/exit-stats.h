@@ -0,0 +1,45 @@
+#pragma once
+
+#include <linux/kvm.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <x86intrin.h>
+
+#include "vm.h"
+
+#define EXIT_STATS_REASONS 64 // covers every KVM_EXIT_* we can see on x86
+#define EXIT_STATS_BUCKETS 64 // log2(cycles) buckets
+#define EXIT_STATS_ADDRS 256  // per vcpu, open addressing
+
+/* latency distribution of the exits sharing one exit reason */
+struct exit_hist {
+  uint64_t count;
+  uint64_t cycles;
+  uint64_t max;
+  uint64_t buckets[EXIT_STATS_BUCKETS];
+};
+
+/* a port or MMIO address that caused exits */
+struct exit_addr {
+  uint64_t key; // address | EXIT_ADDR_MMIO, 0 means the slot is free
+  uint64_t count;
+  uint64_t writes;
+  uint64_t cycles;
+};
+
+/* Each vcpu owns its stats and is the only writer, so nothing is shared on
+ * the exit path. Readers (the summary) tolerate slightly stale values. */
+struct exit_stats {
+  struct exit_hist reason[EXIT_STATS_REASONS];
+  struct exit_addr addr[EXIT_STATS_ADDRS];
+  uint64_t addr_dropped;
+};
+
+static inline uint64_t exit_stats_now(void) { return __rdtsc(); }
+
+void exit_stats_account(struct exit_stats *st, struct kvm_run *run,
+                        uint32_t reason, uint64_t cycles);
+void exit_stats_print(vm_t *v);
+int exit_stats_dump_json(vm_t *v, const char *path);
+int exit_stats_init(vm_t *v, const char *json_path);
+void exit_stats_exit(vm_t *v);
@@ -1,10 +1,45 @@
 #include "err.h"
+#include "exit-stats.h"
+#include "snapshot.h"
+#include "template.h"
 #include "vm.h"
+#include <errno.h>
 #include <getopt.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 static char *kernel_file = NULL;
 static char *initrd_file = NULL;
+static struct vm_config config = {
+    .nr_vcpus = 1,
+    .mem_size = RAM_SIZE_DEFAULT,
+    .mem_backend = MEM_BACKEND_ANON,
+    .mem_prealloc = -1,
+    .ram_fd = -1,
+};
+static bool exit_stats = false;
+static char *exit_stats_file = NULL;
+static char *save_snapshot_file = NULL;
+static char *restore_file = NULL;
+static struct template template;
+
+enum {
+  OPT_MEM_BACKEND = 0x100, // long-only options
+  OPT_MEM_PREALLOC,
+  OPT_SAVE_SNAPSHOT,
+  OPT_RESTORE,
+  OPT_LAZY_RESTORE,
+  OPT_CLONES,
+  OPT_NO_REBOOT,
+  OPT_CONSOLE,
+  OPT_CONSOLE_FULL,
+  OPT_VCONSOLE,
+  OPT_DISK_QUEUES,
+  OPT_DISK_CACHE,
+  OPT_SPLIT_RING,
+  OPT_DISK_CPUS,
+};
 
 #define print_option(args, help_msg) printf("    %-30s%s\n", args, help_msg)
 
@@ -15,23 +50,232 @@ static void usage(const char* execpath)
 
   print_option("-h, --help", "Print help menu\n");
   print_option("-i, --initrd initrd", "initrd path \n");
+  print_option("-d, --disk image", "virtio-blk disk image path\n");
+  print_option("--disk-queues N",
+               "virtio-blk request queues, each served by a thread of its\n");
+  print_option("", "own (default: one per vcpu, at most 16)\n");
+  print_option("--disk-cpus list",
+               "pin the queue threads to these host CPUs, round robin,\n");
+  print_option("", "e.g. 2,3,6\n");
+  print_option("--disk-cache mode",
+               "writeback (default) or none, which opens the image with\n");
+  print_option("", "O_DIRECT to bypass the host page cache\n");
+  print_option("--split-ring",
+               "virtio devices offer only split virtqueues, for guests\n");
+  print_option("", "without or slower with packed ones\n");
+  print_option("-c, --cpus N", "number of vcpus (default: 1)\n");
+  print_option("-m, --memory size",
+               "guest RAM, in MiB or with a K/M/G suffix (default: 1G)\n");
+  print_option("-s, --exit-stats[=file]",
+               "count VM exits, summary on exit and SIGUSR2, JSON to file\n");
+  print_option("--mem-backend type",
+               "guest RAM backing: anon (default), thp, hugetlb-2M,\n");
+  print_option("", "hugetlb-1G, memfd, memfd-2M or memfd-1G\n");
+  print_option("--mem-prealloc[=threads]",
+               "fault in all guest RAM before boot (default: one thread\n");
+  print_option("", "per host CPU)\n");
+  print_option("--save-snapshot file",
+               "on SIGINT/SIGTERM, save the VM to file and exit\n");
+  print_option("--restore file",
+               "resume a saved VM instead of booting a kernel\n");
+  print_option("--lazy-restore",
+               "with --restore, start the vcpus at once and fill guest\n");
+  print_option("", "RAM on demand through userfaultfd\n");
+  print_option("--clones N",
+               "template mode: on SIGINT/SIGTERM, fork N clones resuming\n");
+  print_option("", "from the current state, sharing the guest RAM copy on\n");
+  print_option("", "write. A disk cannot be used: the clones would all\n");
+  print_option("", "write to the same image\n");
+  print_option("--no-reboot",
+               "exit when the guest shuts down or reboots, instead of\n");
+  print_option("", "booting the kernel again in the same process\n");
+  print_option("--console backend",
+               "serial output to stdout (default), file:path, unix:path\n");
+  print_option("", "(a listening socket) or pty\n");
+  print_option("--console-full drop|block",
+               "when the output buffer is full, drop guest output or\n");
+  print_option("", "stall the guest (default: block for stdout and files)\n");
+  print_option("--vconsole backend[,name=N]",
+               "add a virtio-console port on file:path, unix:path or\n");
+  print_option("", "pty, up to 8. The first one is hvc0, the others show\n");
+  print_option("", "up as /dev/virtio-ports/N in the guest\n");
+}
+
+// parse_size accepts a decimal size in MiB, or with a K, M or G suffix. Zero
+// and sizes that do not fit in 64 bits are refused.
+static int parse_size(const char *arg, uint64_t *size) {
+  char *end;
+  int shift;
+
+  // strtoull takes a minus sign and negates
+  if (strchr(arg, '-'))
+    return -1;
+  errno = 0;
+  // base 10: a leading zero does not make it octal
+  uint64_t value = strtoull(arg, &end, 10);
+  if (errno || end == arg)
+    return -1;
+
+  switch (*end) {
+  case 'k':
+  case 'K':
+    shift = 10;
+    break;
+  case '\0':
+  case 'm':
+  case 'M':
+    shift = 20;
+    break;
+  case 'g':
+  case 'G':
+    shift = 30;
+    break;
+  default:
+    return -1;
+  }
+  if (*end && end[1])
+    return -1;
+  if (!value || value > (UINT64_MAX >> shift))
+    return -1;
+
+  *size = value << shift;
+  return 0;
+}
+
+// parse_cpus reads a comma separated list of CPU numbers
+static int parse_cpus(const char *arg, int *cpus, int *nr) {
+  char *end;
+
+  for (*nr = 0; *nr < VIRTIO_BLK_MAX_QUEUES; arg = end + 1) {
+    long cpu = strtol(arg, &end, 10);
+    if (end == arg || cpu < 0 || (*end && *end != ','))
+      return -1;
+    cpus[(*nr)++] = cpu;
+    if (!*end)
+      return 0;
+  }
+  return -1;
+}
+
+static int save_snapshot(vm_t *v, void *path) {
+  return vm_snapshot_save(v, (const char *)path);
 }
 
 int main(int argc, char *argv[]) {
   int option_index = 0;
   struct option opts[] = {{"kernel", 1, NULL, 'k'},
                           {"initrd", 1, NULL, 'i'},
-                          {"help", 0, NULL, 'h'}};
+                          {"disk", 1, NULL, 'd'},
+                          {"cpus", 1, NULL, 'c'},
+                          {"memory", 1, NULL, 'm'},
+                          {"exit-stats", 2, NULL, 's'},
+                          {"mem-backend", 1, NULL, OPT_MEM_BACKEND},
+                          {"mem-prealloc", 2, NULL, OPT_MEM_PREALLOC},
+                          {"save-snapshot", 1, NULL, OPT_SAVE_SNAPSHOT},
+                          {"restore", 1, NULL, OPT_RESTORE},
+                          {"lazy-restore", 0, NULL, OPT_LAZY_RESTORE},
+                          {"clones", 1, NULL, OPT_CLONES},
+                          {"no-reboot", 0, NULL, OPT_NO_REBOOT},
+                          {"console", 1, NULL, OPT_CONSOLE},
+                          {"console-full", 1, NULL, OPT_CONSOLE_FULL},
+                          {"vconsole", 1, NULL, OPT_VCONSOLE},
+                          {"disk-queues", 1, NULL, OPT_DISK_QUEUES},
+                          {"disk-cpus", 1, NULL, OPT_DISK_CPUS},
+                          {"disk-cache", 1, NULL, OPT_DISK_CACHE},
+                          {"split-ring", 0, NULL, OPT_SPLIT_RING},
+                          {"help", 0, NULL, 'h'},
+                          {NULL, 0, NULL, 0}};
 
   int c;
-  while ((c = getopt_long(argc, argv, "k:i:h", opts, &option_index)) != -1) {
+  while ((c = getopt_long(argc, argv, "k:i:d:c:m:s::h", opts, &option_index)) != -1) {
     switch (c) {
       case 'i':
         initrd_file = optarg;
         break;
+      case 'c':
+        config.nr_vcpus = atoi(optarg);
+        break;
+      case 'm':
+        if (parse_size(optarg, &config.mem_size) < 0) {
+          usage(argv[0]);
+          exit(1);
+        }
+        break;
+      case OPT_MEM_PREALLOC:
+        config.mem_prealloc = optarg ? atoi(optarg) : 0;
+        break;
+      case OPT_MEM_BACKEND:
+        if (mem_backend_parse(optarg, &config.mem_backend) < 0) {
+          usage(argv[0]);
+          exit(1);
+        }
+        break;
+      case OPT_SAVE_SNAPSHOT:
+        save_snapshot_file = optarg;
+        break;
+      case OPT_RESTORE:
+        restore_file = optarg;
+        break;
+      case OPT_LAZY_RESTORE:
+        config.ram_lazy = true;
+        break;
+      case OPT_CLONES:
+        template.nr_clones = atoi(optarg);
+        break;
+      case OPT_NO_REBOOT:
+        config.no_reboot = true;
+        break;
+      case OPT_CONSOLE:
+        config.console = optarg;
+        break;
+      case OPT_CONSOLE_FULL:
+        if (console_parse_policy(optarg, &config.console_policy) < 0) {
+          usage(argv[0]);
+          exit(1);
+        }
+        break;
+      case OPT_VCONSOLE:
+        if (config.nr_vconsoles == VIRTIO_CONSOLE_MAX_PORTS) {
+          usage(argv[0]);
+          exit(1);
+        }
+        config.vconsole[config.nr_vconsoles++] = optarg;
+        break;
+      case OPT_DISK_QUEUES:
+        config.disk_queues = atoi(optarg);
+        if (config.disk_queues < 1 ||
+            config.disk_queues > VIRTIO_BLK_MAX_QUEUES) {
+          usage(argv[0]);
+          exit(1);
+        }
+        break;
+      case OPT_DISK_CPUS:
+        if (parse_cpus(optarg, config.disk_cpus, &config.nr_disk_cpus) < 0) {
+          usage(argv[0]);
+          exit(1);
+        }
+        break;
+      case OPT_SPLIT_RING:
+        config.split_ring = true;
+        break;
+      case OPT_DISK_CACHE:
+        if (!strcmp(optarg, "none"))
+          config.disk_direct = true;
+        else if (strcmp(optarg, "writeback")) {
+          usage(argv[0]);
+          exit(1);
+        }
+        break;
+      case 's':
+        exit_stats = true;
+        exit_stats_file = optarg;
+        break;
       case 'k':
         kernel_file = optarg;
         break;
+      case 'd':
+        config.disk = optarg;
+        break;
       case 'h':
         usage(argv[0]);
         exit(123);
@@ -40,22 +284,69 @@ int main(int argc, char *argv[]) {
     } 
   }
 
+  if (template.nr_clones > 0 && save_snapshot_file)
+    return throw_err("--clones and --save-snapshot are exclusive");
+  // every clone would write to the one image, corrupting what is on it
+  if (template.nr_clones > 0 && config.disk)
+    return throw_err("--clones cannot be used with a disk");
+
+  // guest output bypasses stdio, keep our own messages in step with it
+  setvbuf(stdout, NULL, _IOLBF, 0);
+
+  // clones map the template RAM, it has to live in a memfd
+  if (template.nr_clones > 0)
+    config.mem_backend = mem_backend_shared(config.mem_backend);
+
+  // The snapshot dictates the shape of the VM, its RAM is mapped from the file
+  struct snapshot snap = {.fd = -1};
+  if (restore_file) {
+    if (snapshot_open(&snap, restore_file) < 0)
+      return throw_err("Failed to open the snapshot");
+    config.nr_vcpus = snap.hdr.nr_vcpus;
+    config.mem_size = snap.hdr.ram_size;
+    config.ram_fd = snap.fd;
+    config.ram_offset = snap.hdr.ram_offset;
+  }
+
   vm_t vm;
-  if (vm_init(&vm) < 0)
+  if (vm_init(&vm, &config) < 0)
     return throw_err("Failed to initialize guest vm");
 
-  if (!kernel_file) {
-    return throw_err("The kernel image must be used as the input!");
-  }
+  // clones map the template RAM through its fd
+  if (template.nr_clones > 0 && vm.ram.fd < 0)
+    return throw_err("--clones needs guest RAM in a memfd");
 
-  if (vm_load_image(&vm, kernel_file) < 0)
-    return throw_err("Failed to load guest image");
+  if (exit_stats && exit_stats_init(&vm, exit_stats_file) < 0)
+    return throw_err("Failed to enable exit statistics");
 
-  if (initrd_file && vm_load_initrd(&vm, initrd_file))
-    return throw_err("Failed to load guest initrd");
+  if (restore_file) {
+    if (vm_snapshot_restore(&vm, &snap) < 0)
+      return throw_err("Failed to restore the snapshot");
+    snapshot_close(&snap);
+  } else {
+    if (!kernel_file) {
+      return throw_err("The kernel image must be used as the input!");
+    }
+
+    if (vm_load_image(&vm, kernel_file) < 0)
+      return throw_err("Failed to load guest image");
+
+    if (initrd_file && vm_load_initrd(&vm, initrd_file))
+      return throw_err("Failed to load guest initrd");
+  }
+
+  if (template.nr_clones > 0) {
+    template.config = config;
+    if (snapshot_trigger_init(&vm, template_clone, &template) < 0)
+      return throw_err("Failed to set up the template trigger");
+  } else if (save_snapshot_file &&
+             snapshot_trigger_init(&vm, save_snapshot, save_snapshot_file) < 0) {
+    return throw_err("Failed to set up the snapshot trigger");
+  }
 
   printf("Running VM\n");
   vm_run(&vm);
+  snapshot_trigger_exit();
   vm_exit(&vm);
 
   return 0;
@@ -0,0 +1,390 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <linux/memfd.h>
+#include <linux/mman.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "mem.h"
+
+#define SZ_2M (2UL << 20)
+#define SZ_1G (1UL << 30)
+
+static const struct {
+  const char *name;
+  const char *desc;
+  size_t page_size;
+} backends[] = {
+    [MEM_BACKEND_ANON] = {"anon", "anonymous memory", 0},
+    [MEM_BACKEND_THP] = {"thp", "anonymous memory with THP", SZ_2M},
+    [MEM_BACKEND_HUGETLB_2M] = {"hugetlb-2M", "hugetlbfs 2M pages", SZ_2M},
+    [MEM_BACKEND_HUGETLB_1G] = {"hugetlb-1G", "hugetlbfs 1G pages", SZ_1G},
+    [MEM_BACKEND_MEMFD_2M] = {"memfd-2M", "memfd hugetlb 2M pages", SZ_2M},
+    [MEM_BACKEND_MEMFD_1G] = {"memfd-1G", "memfd hugetlb 1G pages", SZ_1G},
+    [MEM_BACKEND_MEMFD] = {"memfd", "memfd shared memory", 0},
+    [MEM_BACKEND_FILE] = {"file", "a private file mapping", 0},
+};
+
+#define N_BACKENDS (sizeof(backends) / sizeof(backends[0]))
+
+int mem_backend_parse(const char *name, enum mem_backend *backend) {
+  for (unsigned int i = 0; i < N_BACKENDS; i++) {
+    if (i != MEM_BACKEND_FILE && !strcmp(name, backends[i].name)) {
+      *backend = i;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+const char *mem_backend_name(enum mem_backend backend) {
+  return backends[backend].name;
+}
+
+// mem_backend_shared picks the memfd flavour of backend, for RAM that other
+// processes have to map as well
+enum mem_backend mem_backend_shared(enum mem_backend backend) {
+  switch (backend) {
+  case MEM_BACKEND_HUGETLB_2M:
+  case MEM_BACKEND_MEMFD_2M:
+    return MEM_BACKEND_MEMFD_2M;
+  case MEM_BACKEND_HUGETLB_1G:
+  case MEM_BACKEND_MEMFD_1G:
+    return MEM_BACKEND_MEMFD_1G;
+  default:
+    return MEM_BACKEND_MEMFD;
+  }
+}
+
+static inline size_t align_up(size_t x, size_t align) {
+  return (x + align - 1) & ~(align - 1);
+}
+
+// Anonymous mappings are only 4K aligned, over-allocate so that the guest
+// RAM (and thus the memslot userspace_addr) starts on a huge page boundary.
+static int mem_alloc_anon(struct guest_mem *mem, size_t size, size_t align) {
+  mem->map_size = size + align;
+  mem->map_base = mmap(NULL, mem->map_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mem->map_base == MAP_FAILED)
+    return -1;
+
+  mem->host = (void *)align_up((uintptr_t)mem->map_base, align);
+  return 0;
+}
+
+static int mem_alloc_hugetlb(struct guest_mem *mem, size_t size,
+                             size_t page_size) {
+  int flags = page_size == SZ_1G ? MAP_HUGE_1GB : MAP_HUGE_2MB;
+
+  mem->map_size = size;
+  mem->map_base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | flags, -1, 0);
+  if (mem->map_base == MAP_FAILED)
+    return -1;
+
+  mem->host = mem->map_base;
+  return 0;
+}
+
+static int mem_alloc_memfd(struct guest_mem *mem, size_t size,
+                           size_t page_size) {
+  unsigned int flags = MFD_CLOEXEC;
+
+  if (page_size)
+    flags |= MFD_HUGETLB | (page_size == SZ_1G ? MFD_HUGE_1GB : MFD_HUGE_2MB);
+
+  mem->fd = memfd_create("guest-ram", flags);
+  if (mem->fd < 0)
+    return -1;
+
+  if (ftruncate(mem->fd, size) < 0)
+    goto err;
+
+  mem->map_size = size;
+  mem->map_base =
+      mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, mem->fd, 0);
+  if (mem->map_base == MAP_FAILED)
+    goto err;
+
+  mem->host = mem->map_base;
+  return 0;
+
+err:
+  close(mem->fd);
+  mem->fd = -1;
+  return -1;
+}
+
+// THP is only used for MADV_HUGEPAGE regions if the host does not disable it
+static bool thp_available(void) {
+  char buf[64] = {0};
+  FILE *f = fopen("/sys/kernel/mm/transparent_hugepage/enabled", "r");
+
+  if (!f)
+    return false;
+  if (!fgets(buf, sizeof(buf), f))
+    buf[0] = 0;
+  fclose(f);
+
+  return !strstr(buf, "[never]");
+}
+
+// mem_alloc backs size bytes of guest RAM with the requested backend. If the
+// host cannot provide huge pages (none reserved, no THP), it falls back to
+// THP and then to plain anonymous memory and reports what it got. A huge page
+// memfd falls back to a plain memfd first, so the RAM keeps its fd.
+int mem_alloc(struct guest_mem *mem, size_t size, enum mem_backend backend) {
+  long base_page = sysconf(_SC_PAGESIZE);
+  int ret = -1;
+
+  memset(mem, 0, sizeof(*mem));
+  mem->fd = -1;
+
+  switch (backend) {
+  case MEM_BACKEND_HUGETLB_2M:
+  case MEM_BACKEND_HUGETLB_1G:
+    mem->size = align_up(size, backends[backend].page_size);
+    ret = mem_alloc_hugetlb(mem, mem->size, backends[backend].page_size);
+    break;
+  case MEM_BACKEND_MEMFD_2M:
+  case MEM_BACKEND_MEMFD_1G:
+    mem->size = align_up(size, backends[backend].page_size);
+    ret = mem_alloc_memfd(mem, mem->size, backends[backend].page_size);
+    break;
+  case MEM_BACKEND_MEMFD:
+    mem->size = align_up(size, base_page);
+    ret = mem_alloc_memfd(mem, mem->size, 0);
+    break;
+  default:
+    break;
+  }
+
+  if (ret < 0 && (backend == MEM_BACKEND_MEMFD_2M ||
+                  backend == MEM_BACKEND_MEMFD_1G)) {
+    fprintf(stderr, "Guest RAM: %s unavailable (errno=%d), falling back to %s\n",
+            backends[backend].desc, errno, backends[MEM_BACKEND_MEMFD].desc);
+    backend = MEM_BACKEND_MEMFD;
+    mem->size = align_up(size, base_page);
+    ret = mem_alloc_memfd(mem, mem->size, 0);
+  }
+
+  if (ret < 0 && backend != MEM_BACKEND_ANON && backend != MEM_BACKEND_THP) {
+    fprintf(stderr, "Guest RAM: %s unavailable (errno=%d), falling back to %s\n",
+            backends[backend].desc, errno, backends[MEM_BACKEND_THP].desc);
+    backend = MEM_BACKEND_THP;
+  }
+
+  if (ret < 0) {
+    mem->size = align_up(size, base_page);
+    if (mem_alloc_anon(mem, mem->size,
+                       backend == MEM_BACKEND_THP ? SZ_2M : base_page) < 0)
+      return throw_err("Failed to mmap vm memory");
+    if (backend == MEM_BACKEND_THP &&
+        (!thp_available() || madvise(mem->host, mem->size, MADV_HUGEPAGE) < 0)) {
+      fprintf(stderr, "Guest RAM: transparent huge pages are disabled\n");
+      backend = MEM_BACKEND_ANON;
+    }
+  }
+
+  mem->backend = backend;
+  mem->page_size = backends[backend].page_size ? backends[backend].page_size
+                                               : base_page;
+
+  printf("Guest RAM: %zu MiB backed by %s (host address %p)\n",
+         mem->size >> 20, backends[backend].desc, mem->host);
+  return 0;
+}
+
+// mem_map_file maps size bytes of fd at offset as guest RAM. The mapping is
+// private: pages are read from the file on first touch and guest writes
+// never reach it.
+int mem_map_file(struct guest_mem *mem, size_t size, int fd, off_t offset) {
+  memset(mem, 0, sizeof(*mem));
+  mem->fd = -1;
+
+  mem->size = size;
+  mem->map_size = size;
+  mem->map_base =
+      mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, offset);
+  if (mem->map_base == MAP_FAILED) {
+    mem->map_base = NULL;
+    return throw_err("Failed to mmap vm memory from file");
+  }
+
+  mem->host = mem->map_base;
+  mem->backend = MEM_BACKEND_FILE;
+  mem->page_size = sysconf(_SC_PAGESIZE);
+
+  printf("Guest RAM: %zu MiB backed by %s (host address %p)\n",
+         mem->size >> 20, backends[MEM_BACKEND_FILE].desc, mem->host);
+  return 0;
+}
+
+#ifndef MADV_POPULATE_WRITE
+#define MADV_POPULATE_WRITE 23
+#endif
+
+#define PREALLOC_MAX_THREADS 64
+
+struct prealloc_range {
+  uint8_t *start;
+  size_t size;
+  size_t page_size;
+  bool hugetlb;
+  bool touched; // MADV_POPULATE_WRITE was not available
+  int err;      // errno of MADV_POPULATE_WRITE on hugetlb, 0 if it worked
+  pthread_t tid;
+};
+
+static bool mem_is_hugetlb(enum mem_backend backend) {
+  switch (backend) {
+  case MEM_BACKEND_HUGETLB_2M:
+  case MEM_BACKEND_HUGETLB_1G:
+  case MEM_BACKEND_MEMFD_2M:
+  case MEM_BACKEND_MEMFD_1G:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static void *mem_prealloc_thread(void *arg) {
+  struct prealloc_range *r = (struct prealloc_range *)arg;
+
+  // Linux 5.14+ populates the range in one call, without dirtying content
+  if (!madvise(r->start, r->size, MADV_POPULATE_WRITE))
+    return NULL;
+
+  // Touching a hugetlb page the pool cannot back raises SIGBUS
+  if (r->hugetlb) {
+    r->err = errno;
+    return NULL;
+  }
+
+  // Otherwise write fault every page, keeping what is already there
+  r->touched = true;
+  for (size_t off = 0; off < r->size; off += r->page_size) {
+    volatile uint8_t *p = r->start + off;
+    *p = *p;
+  }
+
+  return NULL;
+}
+
+// mem_prealloc faults in the whole guest RAM before the guest runs, so that
+// early boot does not pay for first touch page faults. The range is split in
+// page aligned chunks across nr_threads workers. Hugetlb RAM is only
+// prefaulted with MADV_POPULATE_WRITE, which fails when the pool runs out.
+int mem_prealloc(struct guest_mem *mem, int nr_threads) {
+  struct prealloc_range ranges[PREALLOC_MAX_THREADS];
+  struct timespec t0, t1;
+  size_t pages = mem->size / mem->page_size;
+  bool touched = false;
+  int err = 0;
+
+  if (nr_threads <= 0)
+    nr_threads = sysconf(_SC_NPROCESSORS_ONLN);
+  if (nr_threads > PREALLOC_MAX_THREADS)
+    nr_threads = PREALLOC_MAX_THREADS;
+  if ((size_t)nr_threads > pages)
+    nr_threads = pages;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
+  size_t offset = 0;
+  int started = 0;
+  for (; started < nr_threads; started++) {
+    struct prealloc_range *r = &ranges[started];
+    size_t n = pages / nr_threads + ((size_t)started < pages % nr_threads);
+
+    r->start = (uint8_t *)mem->host + offset;
+    r->size = n * mem->page_size;
+    r->page_size = mem->page_size;
+    r->hugetlb = mem_is_hugetlb(mem->backend);
+    r->touched = false;
+    r->err = 0;
+    offset += r->size;
+
+    if (pthread_create(&r->tid, NULL, mem_prealloc_thread, r)) {
+      // do the rest from this thread
+      r->size = mem->size - (offset - r->size);
+      mem_prealloc_thread(r);
+      touched |= r->touched;
+      err = err ? err : r->err;
+      break;
+    }
+  }
+
+  for (int i = 0; i < started; i++) {
+    pthread_join(ranges[i].tid, NULL);
+    touched |= ranges[i].touched;
+    err = err ? err : ranges[i].err;
+  }
+
+  // an older kernel without MADV_POPULATE_WRITE: hugetlb RAM stays lazy
+  if (err == EINVAL) {
+    printf("Guest RAM: hugetlb pages are not prefaulted without "
+           "MADV_POPULATE_WRITE\n");
+    return 0;
+  }
+  if (err) {
+    errno = err;
+    return throw_err("Failed to prefault hugetlb guest RAM, is the huge "
+                     "page pool large enough?");
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  long ms = (t1.tv_sec - t0.tv_sec) * 1000 + (t1.tv_nsec - t0.tv_nsec) / 1000000;
+  printf("Guest RAM: prefaulted %zu MiB in %ld ms with %d threads (%s)\n",
+         mem->size >> 20, ms, started,
+         touched ? "page touching" : "MADV_POPULATE_WRITE");
+
+  return 0;
+}
+
+// mem_discard gives the guest RAM back to the host and leaves it zeroed,
+// the mapping and thus the memslots stay where they are.
+int mem_discard(struct guest_mem *mem) {
+  switch (mem->backend) {
+  case MEM_BACKEND_FILE:
+    // dropping the private copies would bring the file content back
+    if (mmap(mem->host, mem->size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+      return throw_err("Failed to replace guest RAM mapping");
+    mem->backend = MEM_BACKEND_ANON;
+    return 0;
+  default:
+    break;
+  }
+
+  // shared memory keeps its content in the memfd, not in the mapping
+  if (mem->fd >= 0) {
+    if (fallocate(mem->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0,
+                  mem->size) < 0)
+      return throw_err("Failed to discard guest RAM");
+    return 0;
+  }
+
+  if (madvise(mem->host, mem->size, MADV_DONTNEED) < 0)
+    return throw_err("Failed to discard guest RAM");
+  return 0;
+}
+
+void mem_free(struct guest_mem *mem) {
+  if (mem->map_base && mem->map_base != MAP_FAILED)
+    munmap(mem->map_base, mem->map_size);
+  if (mem->fd >= 0)
+    close(mem->fd);
+  mem->map_base = NULL;
+  mem->fd = -1;
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stddef.h>
+#include <sys/types.h>
+
+enum mem_backend {
+  MEM_BACKEND_ANON,       // plain anonymous memory, 4K pages
+  MEM_BACKEND_THP,        // anonymous memory with MADV_HUGEPAGE
+  MEM_BACKEND_HUGETLB_2M, // MAP_HUGETLB, 2M pages
+  MEM_BACKEND_HUGETLB_1G, // MAP_HUGETLB, 1G pages
+  MEM_BACKEND_MEMFD_2M,   // memfd with MFD_HUGETLB, 2M pages
+  MEM_BACKEND_MEMFD_1G,   // memfd with MFD_HUGETLB, 1G pages
+  MEM_BACKEND_MEMFD,      // memfd, 4K pages
+  MEM_BACKEND_FILE,       // private mapping of a snapshot, not selectable
+};
+
+/* host memory backing the guest RAM */
+struct guest_mem {
+  void *host;                // start of guest RAM, aligned to page_size
+  size_t size;
+  size_t page_size;          // backing page size actually obtained
+  enum mem_backend backend;  // backend actually obtained
+  int fd;                    // memfd, -1 for anonymous mappings
+  void *map_base;            // the whole mapping, including alignment slack
+  size_t map_size;
+};
+
+int mem_backend_parse(const char *name, enum mem_backend *backend);
+const char *mem_backend_name(enum mem_backend backend);
+enum mem_backend mem_backend_shared(enum mem_backend backend);
+int mem_alloc(struct guest_mem *mem, size_t size, enum mem_backend backend);
+int mem_map_file(struct guest_mem *mem, size_t size, int fd, off_t offset);
+int mem_prealloc(struct guest_mem *mem, int nr_threads);
+int mem_discard(struct guest_mem *mem);
+void mem_free(struct guest_mem *mem);
@@ -0,0 +1,191 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "mptable.h"
+
+/* Intel MultiProcessor Specification v1.4 structures */
+#define MPC_SPEC 4
+#define MP_PROCESSOR 0
+#define MP_BUS 1
+#define MP_IOAPIC 2
+#define MP_INTSRC 3
+#define MP_LINTSRC 4
+
+#define CPU_ENABLED 1
+#define CPU_BOOTPROCESSOR 2
+#define MPC_APIC_USABLE 1
+
+#define MP_INT 0
+#define MP_NMI 1
+#define MP_EXTINT 3
+#define MP_IRQDIR_DEFAULT 0
+
+#define APIC_VERSION 0x14
+#define IOAPIC_VERSION 0x11
+#define ISA_IRQS 16
+
+struct mpf_intel {
+  char signature[4];
+  uint32_t physptr;
+  uint8_t length;
+  uint8_t specification;
+  uint8_t checksum;
+  uint8_t feature1;
+  uint8_t feature2;
+  uint8_t feature3;
+  uint8_t feature4;
+  uint8_t feature5;
+} __attribute__((packed));
+
+struct mpc_table {
+  char signature[4];
+  uint16_t length;
+  uint8_t spec;
+  uint8_t checksum;
+  char oem[8];
+  char productid[12];
+  uint32_t oemptr;
+  uint16_t oemsize;
+  uint16_t oemcount;
+  uint32_t lapic;
+  uint32_t reserved;
+} __attribute__((packed));
+
+struct mpc_cpu {
+  uint8_t type;
+  uint8_t apicid;
+  uint8_t apicver;
+  uint8_t cpuflag;
+  uint32_t cpufeature;
+  uint32_t featureflag;
+  uint32_t reserved[2];
+} __attribute__((packed));
+
+struct mpc_bus {
+  uint8_t type;
+  uint8_t busid;
+  char bustype[6];
+} __attribute__((packed));
+
+struct mpc_ioapic {
+  uint8_t type;
+  uint8_t apicid;
+  uint8_t apicver;
+  uint8_t flags;
+  uint32_t apicaddr;
+} __attribute__((packed));
+
+struct mpc_intsrc {
+  uint8_t type;
+  uint8_t irqtype;
+  uint16_t irqflag;
+  uint8_t srcbus;
+  uint8_t srcbusirq;
+  uint8_t dstapic;
+  uint8_t dstirq;
+} __attribute__((packed));
+
+static uint8_t mptable_checksum(void *buf, size_t len) {
+  uint8_t sum = 0;
+
+  for (size_t i = 0; i < len; i++)
+    sum += ((uint8_t *)buf)[i];
+
+  return -sum;
+}
+
+// mptable_setup writes the MP floating pointer and the configuration table
+// describing nr_cpus local APICs, one ISA bus and the in-kernel IOAPIC.
+int mptable_setup(void *mem, int nr_cpus) {
+  uint8_t *base = (uint8_t *)mem + MPTABLE_START;
+  struct mpf_intel *mpf = (struct mpf_intel *)base;
+  struct mpc_table *mpc = (struct mpc_table *)(mpf + 1);
+  uint8_t *p = (uint8_t *)(mpc + 1);
+  uint8_t ioapic_id = nr_cpus;
+  const uint8_t isa_bus = 0;
+
+  memset(mpf, 0, sizeof(*mpf));
+  memcpy(mpf->signature, "_MP_", 4);
+  mpf->physptr = MPTABLE_START + sizeof(*mpf);
+  mpf->length = 1; // in 16 bytes paragraphs
+  mpf->specification = MPC_SPEC;
+
+  memset(mpc, 0, sizeof(*mpc));
+  memcpy(mpc->signature, "PCMP", 4);
+  mpc->spec = MPC_SPEC;
+  memcpy(mpc->oem, "KVMVMM  ", 8);
+  memcpy(mpc->productid, "LEARN       ", 12);
+  mpc->lapic = MPTABLE_LAPIC_ADDR;
+
+  for (int i = 0; i < nr_cpus; i++) {
+    struct mpc_cpu *cpu = (struct mpc_cpu *)p;
+    *cpu = (struct mpc_cpu){
+        .type = MP_PROCESSOR,
+        .apicid = i,
+        .apicver = APIC_VERSION,
+        .cpuflag = CPU_ENABLED | (i == 0 ? CPU_BOOTPROCESSOR : 0),
+        .cpufeature = 0x600, // family 6
+        .featureflag = 0x201, // FPU | APIC
+    };
+    p += sizeof(*cpu);
+    mpc->oemcount++;
+  }
+
+  struct mpc_bus *bus = (struct mpc_bus *)p;
+  *bus = (struct mpc_bus){.type = MP_BUS, .busid = isa_bus};
+  memcpy(bus->bustype, "ISA   ", 6);
+  p += sizeof(*bus);
+  mpc->oemcount++;
+
+  struct mpc_ioapic *ioapic = (struct mpc_ioapic *)p;
+  *ioapic = (struct mpc_ioapic){
+      .type = MP_IOAPIC,
+      .apicid = ioapic_id,
+      .apicver = IOAPIC_VERSION,
+      .flags = MPC_APIC_USABLE,
+      .apicaddr = MPTABLE_IOAPIC_ADDR,
+  };
+  p += sizeof(*ioapic);
+  mpc->oemcount++;
+
+  // ISA interrupts are identity mapped to the IOAPIC pins, except that the
+  // timer on IRQ 0 is wired to pin 2 as KVM's default routing does.
+  for (int irq = 0; irq < ISA_IRQS; irq++) {
+    struct mpc_intsrc *src = (struct mpc_intsrc *)p;
+    if (irq == 2)
+      continue;
+    *src = (struct mpc_intsrc){
+        .type = MP_INTSRC,
+        .irqtype = MP_INT,
+        .irqflag = MP_IRQDIR_DEFAULT,
+        .srcbus = isa_bus,
+        .srcbusirq = irq,
+        .dstapic = ioapic_id,
+        .dstirq = irq == 0 ? 2 : irq,
+    };
+    p += sizeof(*src);
+    mpc->oemcount++;
+  }
+
+  // Local interrupts: ExtINT on LINT0 and NMI on LINT1 of every local APIC
+  for (int lint = 0; lint < 2; lint++) {
+    struct mpc_intsrc *src = (struct mpc_intsrc *)p;
+    *src = (struct mpc_intsrc){
+        .type = MP_LINTSRC,
+        .irqtype = lint ? MP_NMI : MP_EXTINT,
+        .irqflag = MP_IRQDIR_DEFAULT,
+        .srcbus = isa_bus,
+        .srcbusirq = 0,
+        .dstapic = 0xff, // all local APICs
+        .dstirq = lint,
+    };
+    p += sizeof(*src);
+    mpc->oemcount++;
+  }
+
+  mpc->length = p - (uint8_t *)mpc;
+  mpc->checksum = mptable_checksum(mpc, mpc->length);
+  mpf->checksum = mptable_checksum(mpf, sizeof(*mpf));
+
+  return 0;
+}
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <stdint.h>
+
+/* The MP floating pointer and configuration table live in the BIOS area,
+ * which Linux scans during early boot (and which is reserved in E820). */
+#define MPTABLE_START 0xf0000
+
+#define MPTABLE_LAPIC_ADDR 0xfee00000
+#define MPTABLE_IOAPIC_ADDR 0xfec00000
+
+int mptable_setup(void *mem, int nr_cpus);
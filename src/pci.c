@@ -1,79 +1,25 @@
 #include <linux/pci_regs.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 
 #include "pci.h"
+#include "snapshot.h"
 #include "utils.h"
 
-// bus_find_dev returns the pci device which has address addr from bus
-static inline struct dev *bus_find_dev(struct bus *bus, uint64_t addr) {
-  struct dev **p = &bus->head;
-
-  for (; *p; p = &(*p)->next) {
-    uint64_t start = (*p)->base;
-    uint64_t end = start + (*p)->len - 1;
-    if (addr >= start && addr <= end)
-      return *p;
-  }
-
-  return NULL;
-}
-
-// The call back function for KVM_EXIT_IO
-void bus_handle_io(struct bus *bus, void *data, uint8_t is_write, uint64_t addr,
-                   uint8_t size) {
-  struct dev *dev = bus_find_dev(bus, addr);
-
-  if (dev && addr + size - 1 <= dev->base + dev->len - 1) {
-    dev->do_io(dev->owner, data, is_write, addr - dev->base, size);
-  }
-}
-
-// Adding a new device to bus
-void bus_register_dev(struct bus *bus, struct dev *dev) {
-  dev->next = bus->head;
-  bus->head = dev;
-  bus->dev_num++;
-}
-
-// Remove a device from bus
-void bus_deregsiter_dev(struct bus *bus, struct dev *dev) {
-  struct dev **p = &bus->head;
-
-  // find device
-  while (*p != dev && *p) {
-    p = &(*p)->next;
-  }
-  // Remove it if it is found
-  if (*p)
-    *p = (*p)->next;
-}
-
-void bus_init(struct bus *bus) {
-  bus->dev_num = 0;
-  bus->head = NULL;
-}
-
-static inline void dev_init(struct dev *dev, uint64_t base, uint64_t len,
-                            void *owner, dev_io_fn do_io) {
-  dev->base = base;
-  dev->len = len;
-  dev->owner = owner;
-  dev->do_io = do_io;
-  dev->next = NULL;
-}
-
 static void pci_address_io(void *owner, void *data, uint8_t is_write,
                            uint64_t offset, uint8_t size) {
   struct pci *pci = (struct pci *)owner;
   void *p = (void *)&pci->pci_addr + offset;
 
+  pthread_mutex_lock(&pci->lock);
   if (is_write)
     memcpy(p, data, size);
   else
     memcpy(data, p, size);
 
   pci->pci_addr.reg_offset = 0;
+  pthread_mutex_unlock(&pci->lock);
 }
 
 static inline void pci_activate_bar(struct pci_dev *dev, uint8_t bar,
@@ -86,7 +32,7 @@ static inline void pci_activate_bar(struct pci_dev *dev, uint8_t bar,
 
 static inline void pci_deactivate_bar(struct pci_dev *dev, uint8_t bar,
                                       struct bus *bus) {
-  uint32_t mask = ~(dev->bar_active[bar] - 1);
+  uint32_t mask = ~(dev->bar_size[bar] - 1);
   if (dev->bar_active[bar] && dev->space_dev[bar].base & mask)
     bus_deregsiter_dev(bus, &dev->space_dev[bar]);
 
@@ -111,12 +57,21 @@ static void pci_command_bar(struct pci_dev *dev) {
 
 static void pci_config_command(struct pci_dev *dev) { pci_command_bar(dev); }
 
+// The bus keeps a copy of the range, a BAR moved while decoding is
+// registered again at its new address.
 static void pci_config_bar(struct pci_dev *dev, uint8_t bar) {
   uint32_t mask = ~(dev->bar_size[bar] - 1);
   uint32_t old_bar = PCI_HDR_READ(dev->hdr, PCI_BAR_OFFSET(bar), 32);
   uint32_t new_bar = (old_bar & mask) | dev->bar_is_io_space[bar];
+  struct bus *bus = dev->bar_is_io_space[bar] ? dev->io_bus : dev->mmio_bus;
+  bool active = dev->bar_active[bar];
+
+  if (active)
+    pci_deactivate_bar(dev, bar, bus);
   PCI_HDR_WRITE(dev->hdr, PCI_BAR_OFFSET(bar), new_bar, 32);
-  dev->space_dev[bar].base = new_bar;
+  dev->space_dev[bar].base = new_bar & mask;
+  if (active)
+    pci_activate_bar(dev, bar, bus);
 }
 
 static void pci_config_write(struct pci_dev *dev, void *data, uint64_t offset,
@@ -152,8 +107,11 @@ static void pci_config_do_io(void *owner, void *data, uint8_t is_write,
 static void pci_data_io(void *owner, void *data, uint8_t is_write,
                         uint64_t offset, uint8_t size) {
   struct pci *pci = (struct pci *)owner;
+
+  pthread_mutex_lock(&pci->lock);
   uint64_t addr = pci->pci_addr.value | offset;
   bus_handle_io(&pci->pci_bus, data, is_write, addr, size);
+  pthread_mutex_unlock(&pci->lock);
 }
 
 void pci_set_bar(struct pci_dev *dev, uint8_t bar, uint32_t bar_size,
@@ -174,26 +132,87 @@ void pci_dev_init(struct pci_dev *dev, struct pci *pci, struct bus *io_bus, stru
   memset(dev, 0x00, sizeof(struct pci_dev));
   dev->hdr = dev->cfg_space;
   dev->pci_bus = &pci->pci_bus;
+  dev->pci = pci;
   dev->io_bus = io_bus;
   dev->mmio_bus = mmio_bus;
 }
 
+// Devices fill bus 0 and spill over to the next buses, all root buses: no
+// bridge is emulated.
 void pci_dev_register(struct pci_dev *dev)
 {
-    /* FIXEME: It just simplifies the registration on pci bus 0 */
-    /* FIXEME: dev_num might exceed 32 */
+    struct pci *pci = dev->pci;
+
+    if (pci->nr_devs >= PCI_MAX_DEVS) {
+        fprintf(stderr, "PCI: no slot left for another device\n");
+        return;
+    }
+    int n = pci->nr_devs++;
     union pci_config_address addr = {.enable_bit = 1,
-                                     .dev_num = dev->pci_bus->dev_num};
+                                     .bus_num = n / PCI_DEVS_PER_BUS,
+                                     .dev_num = n % PCI_DEVS_PER_BUS};
+    pci->devs[n] = dev;
     dev_init(&dev->config_dev, addr.value, PCI_CFG_SPACE_SIZE, dev,
              pci_config_do_io);
     bus_register_dev(dev->pci_bus, &dev->config_dev);
 }
 
-#define PCI_CONFIG_ADDR 0xCF8
-#define PCI_CONFIG_DATA 0xCFC
+int pci_nr_buses(struct pci *pci)
+{
+    return (pci->nr_devs + PCI_DEVS_PER_BUS - 1) / PCI_DEVS_PER_BUS;
+}
+
+// pci_ecam_io decodes the function from the offset in the window and goes
+// straight to its config space. Only function 0 exists, and only the
+// conventional 256 bytes of it: the extended space reads as zeros.
+static void pci_ecam_io(void *owner, void *data, uint8_t is_write,
+                        uint64_t offset, uint8_t size)
+{
+    struct pci *pci = (struct pci *)owner;
+    unsigned int bus = offset >> 20;
+    unsigned int slot = (offset >> 15) & 0x1f;
+    unsigned int func = (offset >> 12) & 0x7;
+    uint64_t reg = offset & 0xfff;
+    int n = bus * PCI_DEVS_PER_BUS + slot;
+
+    pthread_mutex_lock(&pci->lock);
+    struct pci_dev *dev = !func && n < pci->nr_devs ? pci->devs[n] : NULL;
+    if (dev && reg + size <= PCI_CFG_SPACE_SIZE)
+        pci_config_do_io(dev, data, is_write, reg, size);
+    else if (!is_write)
+        memset(data, dev ? 0x00 : 0xff, size);
+    pthread_mutex_unlock(&pci->lock);
+}
+
+// pci_dev_restore loads a saved config space and maps the BARs it enables
+void pci_dev_restore(struct pci_dev *dev, const uint8_t *cfg_space)
+{
+    memcpy(dev->cfg_space, cfg_space, PCI_CFG_SPACE_SIZE);
+    for (int i = 0; i < PCI_STD_NUM_BARS; i++) {
+        if (dev->bar_size[i])
+            pci_config_bar(dev, i);
+    }
+    pci_command_bar(dev);
+}
+
+// pci_dev_reset unmaps the BARs and clears them as a bus reset would, the
+// rest of the header describes the device and is kept.
+void pci_dev_reset(struct pci_dev *dev)
+{
+    PCI_HDR_WRITE(dev->hdr, PCI_COMMAND, 0, 16);
+    pci_command_bar(dev);
+    for (int i = 0; i < PCI_STD_NUM_BARS; i++) {
+        if (!dev->bar_size[i])
+            continue;
+        PCI_HDR_WRITE(dev->hdr, PCI_BAR_OFFSET(i), dev->bar_is_io_space[i], 32);
+        dev->space_dev[i].base = 0;
+    }
+}
 
-void pci_init(struct pci *pci, struct bus *io_bus)
+void pci_init(struct pci *pci, struct bus *io_bus, struct bus *mmio_bus)
 {
+    pthread_mutex_init(&pci->lock, NULL);
+    pci->nr_devs = 0;
     dev_init(&pci->pci_addr_dev, PCI_CONFIG_ADDR, sizeof(uint32_t), pci,
              pci_address_io);
     dev_init(&pci->pci_bus_dev, PCI_CONFIG_DATA, sizeof(uint32_t), pci,
@@ -201,4 +220,28 @@ void pci_init(struct pci *pci, struct bus *io_bus)
     bus_init(&pci->pci_bus);
     bus_register_dev(io_bus, &pci->pci_addr_dev);
     bus_register_dev(io_bus, &pci->pci_bus_dev);
+    dev_init(&pci->ecam_dev, PCI_ECAM_BASE, PCI_ECAM_SIZE, pci, pci_ecam_io);
+    bus_register_dev(mmio_bus, &pci->ecam_dev);
+}
+
+int pci_save(struct pci *pci, struct snapshot *snap)
+{
+    pthread_mutex_lock(&pci->lock);
+    int ret = snapshot_put(snap, SNAP_PCI, &pci->pci_addr,
+                           sizeof(pci->pci_addr));
+    pthread_mutex_unlock(&pci->lock);
+
+    return ret;
+}
+
+void pci_reset(struct pci *pci)
+{
+    pthread_mutex_lock(&pci->lock);
+    pci->pci_addr.value = 0;
+    pthread_mutex_unlock(&pci->lock);
+}
+
+int pci_restore(struct pci *pci, struct snapshot *snap)
+{
+    return snapshot_get(snap, SNAP_PCI, &pci->pci_addr, sizeof(pci->pci_addr));
 }
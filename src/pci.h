@@ -2,32 +2,13 @@
 
 #include <linux/kvm.h>
 #include <linux/pci_regs.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 
-struct dev;
+#include "bus.h"
 
-typedef void (*dev_io_fn)(void *onwer, void *data, uint8_t is_write,
-                          uint64_t offset, uint8_t size);
-
-struct dev {
-  uint64_t base;
-  uint64_t len;
-  void *owner;
-  dev_io_fn do_io;
-  struct dev *next;
-};
-
-struct bus {
-  uint64_t dev_num;
-  struct dev *head;
-};
-
-void bus_register_dev(struct bus *bus, struct dev *dev);
-void bus_deregsiter_dev(struct bus *bus, struct dev *dev);
-void bus_handle_io(struct bus *bus, void *data, uint8_t is_write, uint64_t addr,
-                   uint8_t size);
-void bus_init(struct bus *bus);
+struct snapshot;
 
 union pci_config_address {
   struct {
@@ -47,6 +28,21 @@ union pci_config_address {
   ((uint##width##_t *)(hdr + offset))[0] = value
 #define PCI_BAR_OFFSET(bar) (PCI_BASE_ADDRESS_0 + ((bar) << 2))
 
+#define PCI_CONFIG_ADDR 0xCF8
+#define PCI_CONFIG_DATA 0xCFC
+
+/* PCI Express enhanced configuration access (ECAM): the config space of
+ * every function is mapped at base + (bus << 20 | dev << 15 | fn << 12), so
+ * an access is a single MMIO exit. It sits in the MMIO hole and is
+ * advertised to the guest by the ACPI MCFG table. */
+#define PCI_ECAM_BASE 0xe0000000ULL
+#define PCI_ECAM_BUSES 16
+#define PCI_ECAM_SIZE ((uint64_t)PCI_ECAM_BUSES << 20)
+#define PCI_DEVS_PER_BUS 32
+#define PCI_MAX_DEVS (PCI_ECAM_BUSES * PCI_DEVS_PER_BUS)
+
+struct pci;
+
 struct pci_dev {
   uint8_t cfg_space[PCI_CFG_SPACE_SIZE];
   void *hdr;
@@ -58,13 +54,19 @@ struct pci_dev {
   struct bus *io_bus;
   struct bus *mmio_bus;
   struct bus *pci_bus;
+  struct pci *pci;
 };
 
 struct pci{
+  pthread_mutex_t lock; // serializes config space accesses across vcpus
   union pci_config_address pci_addr;
   struct bus pci_bus;
   struct dev pci_bus_dev;
   struct dev pci_addr_dev;
+  struct dev ecam_dev;
+  // function 0 of device n % 32 on bus n / 32, as ECAM looks them up
+  struct pci_dev *devs[PCI_MAX_DEVS];
+  int nr_devs;
 };
 
 void pci_set_bar(struct pci_dev *dev,
@@ -78,4 +80,10 @@ void pci_dev_init(struct pci_dev *dev,
                   struct pci *pci,
                   struct bus *io_bus,
                   struct bus *mmio_bus);
-void pci_init(struct pci *pci, struct bus *io_bus);
+void pci_dev_restore(struct pci_dev *dev, const uint8_t *cfg_space);
+void pci_dev_reset(struct pci_dev *dev);
+void pci_init(struct pci *pci, struct bus *io_bus, struct bus *mmio_bus);
+int pci_nr_buses(struct pci *pci);
+void pci_reset(struct pci *pci);
+int pci_save(struct pci *pci, struct snapshot *snap);
+int pci_restore(struct pci *pci, struct snapshot *snap);
@@ -1,4 +1,4 @@
-#include <bits/types/siginfo_t.h>
+#define _GNU_SOURCE
 #include <linux/serial_reg.h>
 #include <poll.h>
 #include <pthread.h>
@@ -6,11 +6,12 @@
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/eventfd.h>
 #include <time.h>
 #include <unistd.h>
-#include <signal.h>
 
 #include "serial.h"
+#include "snapshot.h"
 #include "utils.h"
 #include "vm.h"
 #include "err.h"
@@ -22,87 +23,243 @@
 /* global state to stop the loop of thread */
 static volatile bool thread_stop = false;
 
+#define SERIAL_FIFO_SIZE 16
+#define SERIAL_CLOCK 115200 // baud rate at divisor 1
+#define SERIAL_CHAR_BITS 10 // start, 8 data, stop
+#define NS_PER_SEC 1000000000ULL
+
 struct serial_dev_priv {
     uint8_t dll;
     uint8_t dlm;
     uint8_t iir;
     uint8_t ier;
-    uint8_t fcr;
+    uint8_t fcr; // FIFO enable and RX trigger bits
     uint8_t lcr;
     uint8_t mcr;
     uint8_t lsr;
     uint8_t msr;
     uint8_t scr;
+    bool thri;    // THR empty interrupt, until IIR reports it or THR is written
+    bool timeout; // character timeout interrupt, until RBR is read
 
     struct fifo rx_buf;
+    struct fifo tx_buf;
 };
 
-static struct serial_dev_priv serial_dev_priv = {
+/* register values after a reset */
+static const struct serial_dev_priv serial_dev_priv_reset = {
   .iir = UART_IIR_NO_INT,
   .mcr = UART_MCR_OUT2,
   .lsr = UART_LSR_TEMT | UART_LSR_THRE,
   .msr = UART_MSR_DCD|UART_MSR_DSR| UART_MSR_CTS,
 };
 
+static struct serial_dev_priv serial_dev_priv;
+
+static uint64_t serial_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+// Without FIFOs (16450 mode) both sides hold a single character
+static unsigned int serial_fifo_size(struct serial_dev_priv *priv)
+{
+  return priv->fcr & UART_FCR_ENABLE_FIFO ? SERIAL_FIFO_SIZE : 1;
+}
+
+static unsigned int serial_rx_trigger(struct serial_dev_priv *priv)
+{
+  static const uint8_t levels[] = {1, 4, 8, 14};
+
+  if (!(priv->fcr & UART_FCR_ENABLE_FIFO))
+    return 1;
+  return levels[UART_FCR_R_TRIG_BITS(priv->fcr)];
+}
+
+// four character times at the programmed baud rate
+static uint64_t serial_char_timeout(struct serial_dev_priv *priv)
+{
+  uint64_t divisor = priv->dll | (priv->dlm << 8);
+
+  if (!divisor)
+    divisor = 1;
+  return 4 * SERIAL_CHAR_BITS * divisor * NS_PER_SEC / SERIAL_CLOCK;
+}
+
+// serial_kick wakes the timer thread, a new deadline may be due before the
+// one it sleeps on
+static void serial_kick(serial_dev_t *s)
+{
+  uint64_t one = 1;
+
+  if (write(s->kick_fd, &one, sizeof(one)) < 0)
+    throw_err("Failed to kick the serial thread");
+}
+
 static void serial_update_irq(serial_dev_t *s)
 {
   struct serial_dev_priv *priv = (struct serial_dev_priv *)s->priv;
+  unsigned int rx_len = fifo_len(&priv->rx_buf);
   uint8_t iir = UART_IIR_NO_INT;
 
-  /* If enable receiver data interrupt and receiver data ready */
-  if ((priv->ier & UART_IER_RDI) && (priv->lsr & UART_LSR_DR))
+  priv->lsr &= ~(UART_LSR_DR | UART_LSR_THRE | UART_LSR_TEMT);
+  if (rx_len)
+    priv->lsr |= UART_LSR_DR;
+  if (fifo_is_empty(&priv->tx_buf))
+    priv->lsr |= UART_LSR_THRE | UART_LSR_TEMT;
+
+  /* Receiver data reached the trigger level, or sat below it for a while */
+  if ((priv->ier & UART_IER_RDI) && rx_len >= serial_rx_trigger(priv))
     iir = UART_IIR_RDI;
+  else if ((priv->ier & UART_IER_RDI) && priv->timeout)
+    iir = UART_IIR_RX_TIMEOUT;
 
-  /* If enable transmitter data interrupt and transmitter empty */
-  else if ((priv->ier & UART_IER_THRI) && (priv->lsr & UART_LSR_TEMT))
+  /* If enable transmitter data interrupt and the FIFO drained */
+  else if ((priv->ier & UART_IER_THRI) && priv->thri)
       iir = UART_IIR_THRI;
 
-  priv->iir = iir | 0xc0;
+  priv->iir = iir;
 
+  // the line is edge triggered, only a change makes it to KVM
+  int level = iir != UART_IIR_NO_INT;
+  if (level == s->irq_level)
+    return;
+  s->irq_level = level;
   // TODO: handle return error
-  vm_irq_line(container_of(s, vm_t, serial), SERIAL_IRQ, 
-              iir == UART_IIR_NO_INT ? 0/*inactive */:1/*active*/);
+  vm_irq_line(container_of(s, vm_t, serial), SERIAL_IRQ, level);
 }
 
-static int serial_readable(serial_dev_t *s, int timeout)
+/* The transmitter is infinitely fast, but only runs when the TX FIFO is
+ * full, when the guest touches any other register or when the FIFO has
+ * waited for the character timeout. A burst of THR writes thus reaches the
+ * console, and raises THRI, once per FIFO load. */
+static void serial_tx_flush(serial_dev_t *s)
 {
-  struct pollfd pollfd = (struct pollfd) {
-    .fd = s->infd,
-    .events = POLLIN,
-  };
+  struct serial_dev_priv *priv = (struct serial_dev_priv *)s->priv;
+  struct fifo *tx = &priv->tx_buf;
+
+  if (fifo_is_empty(tx))
+    return;
 
-  return (poll(&pollfd, 1, timeout) > 0) && (pollfd.revents & POLLIN);
+  unsigned int head = tx->head & FIFO_MASK;
+  unsigned int len = fifo_len(tx);
+  if (head + len > FIFO_LEN) {
+    console_write(s->console, tx->data + head, FIFO_LEN - head);
+    len -= FIFO_LEN - head;
+    head = 0;
+  }
+  console_write(s->console, tx->data + head, len);
+  tx->head = tx->tail;
+  priv->thri = true;
 }
 
-#define FREQ_NS ((int) (1.0e6))
-#define NS_PER_SEC ((int)(1.0e9))
+static void serial_tx(serial_dev_t *s, uint8_t c)
+{
+  struct serial_dev_priv *priv = (struct serial_dev_priv *)s->priv;
+  bool was_empty = fifo_is_empty(&priv->tx_buf);
+
+  fifo_put(&priv->tx_buf, c);
+  priv->thri = false;
+  if (fifo_len(&priv->tx_buf) >= serial_fifo_size(priv)) {
+    serial_tx_flush(s);
+  } else if (was_empty) {
+    s->tx_time = serial_now();
+    serial_kick(s);
+  }
+}
 
-static void *serial_thread(serial_dev_t *s)
+// serial_expire runs the timers, it returns the nanoseconds to the next
+// deadline or 0 if there is none
+static uint64_t serial_expire(serial_dev_t *s, uint64_t now)
 {
-  while (!__atomic_load_n(&thread_stop, __ATOMIC_RELAXED)) {
-    if (serial_readable(s, -1)) 
-      pthread_kill((pthread_t)s->main_tid, SIGUSR1);
+  struct serial_dev_priv *priv = (struct serial_dev_priv *)s->priv;
+  uint64_t timeout = serial_char_timeout(priv);
+  uint64_t next = 0;
+
+  if (!fifo_is_empty(&priv->tx_buf)) {
+    if (now - s->tx_time >= timeout)
+      serial_tx_flush(s);
+    else
+      next = s->tx_time + timeout - now;
   }
 
-  return NULL;
+  unsigned int rx_len = fifo_len(&priv->rx_buf);
+  if (rx_len && rx_len < serial_rx_trigger(priv) && !priv->timeout) {
+    if (now - s->rx_time >= timeout)
+      priv->timeout = true;
+    else if (!next || s->rx_time + timeout - now < next)
+      next = s->rx_time + timeout - now;
+  }
+
+  serial_update_irq(s);
+  return next;
 }
 
-void serial_console(serial_dev_t *s)
+// serial_fill moves pending input into the RX FIFO, as much as fits in one
+// read, and raises the interrupt from the calling thread
+static void serial_fill(serial_dev_t *s)
 {
   struct serial_dev_priv *priv = (struct serial_dev_priv *)s->priv;
+  uint8_t buf[SERIAL_FIFO_SIZE];
+  unsigned int room = serial_fifo_size(priv) - fifo_len(&priv->rx_buf);
+
+  if (!room || s->input_eof)
+    return;
+
+  ssize_t n = read(s->infd, buf, room);
+  if (n == 0)
+    s->input_eof = true;
+  for (ssize_t i = 0; i < n; i++)
+    fifo_put(&priv->rx_buf, buf[i]);
+  if (n > 0) {
+    s->rx_time = serial_now();
+    priv->timeout = false;
+  }
+  serial_update_irq(s);
+}
 
-    if (priv->lsr & UART_LSR_DR || !fifo_is_empty(&priv->rx_buf)) 
-      return;
 
-    while (!fifo_is_full(&priv->rx_buf) && serial_readable(s, 0)) {
-      char c;
-      if (read(s->infd, &c, 1) == -1)
-        break;
-      if (!fifo_put(&priv->rx_buf, c))
-        break;
-      priv->lsr |= UART_LSR_DR;
+/* The worker runs the FIFO timers and reads input while the RX FIFO has
+ * room for it. The vcpus never stop for console input, the interrupt goes
+ * straight to KVM from here. */
+static void *serial_thread(serial_dev_t *s)
+{
+  struct serial_dev_priv *priv = (struct serial_dev_priv *)s->priv;
+
+  while (!__atomic_load_n(&thread_stop, __ATOMIC_RELAXED)) {
+    struct pollfd fds[2] = {
+      {.fd = s->kick_fd, .events = POLLIN},
+      {.fd = -1, .events = POLLIN},
+    };
+
+    pthread_mutex_lock(&s->lock);
+    uint64_t next = serial_expire(s, serial_now());
+    if (!s->input_eof && fifo_len(&priv->rx_buf) < serial_fifo_size(priv))
+      fds[1].fd = s->infd;
+    pthread_mutex_unlock(&s->lock);
+
+    struct timespec ts = {
+      .tv_sec = next / NS_PER_SEC,
+      .tv_nsec = next % NS_PER_SEC,
+    };
+    if (ppoll(fds, 2, next ? &ts : NULL, NULL) <= 0)
+      continue;
+    if (fds[0].revents) {
+      uint64_t n;
+      if (read(s->kick_fd, &n, sizeof(n)) < 0)
+        continue;
     }
-    serial_update_irq(s);
+    if (fds[1].revents) {
+      pthread_mutex_lock(&s->lock);
+      serial_fill(s);
+      pthread_mutex_unlock(&s->lock);
+    }
+  }
+
+  return NULL;
 }
 
 static void serial_in(serial_dev_t *s, uint16_t offset, void *data)
@@ -110,22 +267,24 @@ static void serial_in(serial_dev_t *s, uint16_t offset, void *data)
   struct serial_dev_priv *priv = (struct serial_dev_priv*)s->priv;
   pthread_mutex_lock(&s->lock);
 
+  serial_tx_flush(s);
   switch (offset) {
     case UART_RX:
       if (priv->lcr & UART_LCR_DLAB) {
         IO_WRITE8(data, priv->dll);
       } else {
-        if (fifo_is_empty(&priv->rx_buf))
-          break;
-
+        bool was_full =
+            fifo_len(&priv->rx_buf) >= serial_fifo_size(priv);
         uint8_t value;
-        if (fifo_get(&priv->rx_buf, value))
-            IO_WRITE8(data,value);
-
-        if (fifo_is_empty(&priv->rx_buf)) {
-          priv->lsr &= ~UART_LSR_DR;
-          serial_update_irq(s);
-        }
+        if (!fifo_get(&priv->rx_buf, value))
+          break;
+        IO_WRITE8(data, value);
+        s->rx_time = serial_now();
+        priv->timeout = false;
+        // there is room for more input again, or what is left needs a new
+        // character timeout
+        if (was_full || fifo_len(&priv->rx_buf))
+          serial_kick(s);
       }
       break;
     case UART_IER:
@@ -135,7 +294,12 @@ static void serial_in(serial_dev_t *s, uint16_t offset, void *data)
        IO_WRITE8(data, priv->ier);
       break;
     case UART_IIR:
-      IO_WRITE8(data, priv->iir|0xc0); //enable FIFO
+      serial_update_irq(s);
+      IO_WRITE8(data, priv->iir |
+                (priv->fcr & UART_FCR_ENABLE_FIFO ? 0xc0 : 0));
+      // reading IIR acknowledges a THR empty interrupt
+      if (priv->iir == UART_IIR_THRI)
+        priv->thri = false;
       break;
     case UART_LCR:
       IO_WRITE8(data, priv->lcr);
@@ -144,6 +308,7 @@ static void serial_in(serial_dev_t *s, uint16_t offset, void *data)
       IO_WRITE8(data, priv->mcr);
       break;
     case UART_LSR:
+      serial_update_irq(s);
       IO_WRITE8(data, priv->lsr);
       break;
     case UART_MSR:
@@ -155,106 +320,177 @@ static void serial_in(serial_dev_t *s, uint16_t offset, void *data)
     default:
       break;
   }
-  
+  serial_update_irq(s);
+
   pthread_mutex_unlock(&s->lock);
 }
 
 static void serial_out(serial_dev_t *s, uint16_t offset, void *data) {
   struct serial_dev_priv *priv = (struct serial_dev_priv *)s->priv;
+  uint8_t value = IO_READ8(data);
   pthread_mutex_lock(&s->lock);
 
+  if (offset != UART_TX || (priv->lcr & UART_LCR_DLAB))
+    serial_tx_flush(s);
   switch(offset) {
     case UART_TX:
       if (priv->lcr & UART_LCR_DLAB) {
-        priv->dll = IO_READ8(data);
+        priv->dll = value;
       } else {
-        priv->lsr |= (UART_LSR_TEMT | UART_LSR_THRE); //flush tx
-        putchar(((char *)data)[0]);
-        fflush(stdout);
-        serial_update_irq(s);
+        serial_tx(s, value);
       }
       break;
     case UART_IER:
         if (!(priv->lcr & UART_LCR_DLAB)) {
-            priv->ier = IO_READ8(data);
-            serial_update_irq(s);
+            // enabling THRI with the FIFO empty interrupts at once
+            if (!(priv->ier & UART_IER_THRI) && (value & UART_IER_THRI) &&
+                fifo_is_empty(&priv->tx_buf))
+              priv->thri = true;
+            priv->ier = value;
         } else {
-            priv->dlm = IO_READ8(data);
+            priv->dlm = value;
         }
         break;
     case UART_FCR:
-        priv->fcr = IO_READ8(data);
+        // toggling the FIFO enable bit clears both FIFOs
+        if ((value ^ priv->fcr) & UART_FCR_ENABLE_FIFO)
+          value |= UART_FCR_CLEAR_RCVR | UART_FCR_CLEAR_XMIT;
+        if (value & UART_FCR_CLEAR_RCVR) {
+          priv->rx_buf.head = priv->rx_buf.tail;
+          priv->timeout = false;
+        }
+        if (value & UART_FCR_CLEAR_XMIT) {
+          priv->tx_buf.head = priv->tx_buf.tail;
+          priv->thri = true;
+        }
+        priv->fcr = value & (UART_FCR_ENABLE_FIFO | UART_FCR_TRIGGER_MASK);
+        serial_kick(s);
         break;
     case UART_LCR:
-        priv->lcr = IO_READ8(data);
+        priv->lcr = value;
         break;
     case UART_MCR:
-        priv->mcr = IO_READ8(data);
+        priv->mcr = value;
         break;
     case UART_LSR:  // factory test
     case UART_MSR:  // not used
         break;
     case UART_SCR:
-        priv->scr = IO_READ8(data);
+        priv->scr = value;
         break;
     default:
         break;
   }
+  serial_update_irq(s);
 
   pthread_mutex_unlock(&s->lock);
 }
 
-static void handler(int sig, siginfo_t *si, void *uc) {}
-
-int serial_init(serial_dev_t *s)
+// serial_rep_io runs count accesses of size bytes on the same register, as
+// a rep ins/outs or a batch of coalesced THR writes does. What a batch
+// leaves in the TX FIFO goes out at its end.
+static void serial_rep_io(void *owner, void *data, uint8_t is_write,
+                          uint64_t offset, uint8_t size, uint32_t count)
 {
-  struct sigaction sa;
-  sigset_t mask;
-  sa.sa_flags = SA_SIGINFO;
-  sa.sa_sigaction = handler;
+  serial_dev_t *s = (serial_dev_t *)owner;
+  void (*serial_op)(serial_dev_t *, uint16_t, void *) =
+    is_write ? serial_out : serial_in;
+  bool batch = count > 1;
 
-  sigemptyset(&sa.sa_mask);
-  if (sigaction(SIGUSR1, &sa, NULL) == -1)
-    return throw_err("Failed to create signal handler");
+  for (; count--; data += size) {
+    serial_op(s, offset, data);
+  }
 
-  /* Block timer signal temporarity */
-  sigemptyset(&mask);
-  sigaddset(&mask, SIGUSR1);
-  if (sigprocmask(SIG_SETMASK, &mask, NULL) == -1)
-    return throw_err("Failed to block timer signal");
+  if (batch && is_write) {
+    pthread_mutex_lock(&s->lock);
+    serial_tx_flush(s);
+    serial_update_irq(s);
+    pthread_mutex_unlock(&s->lock);
+  }
+}
 
+static void serial_io(void *owner, void *data, uint8_t is_write,
+                      uint64_t offset, uint8_t size)
+{
+  serial_rep_io(owner, data, is_write, offset, size, 1);
+}
+
+int serial_init(serial_dev_t *s, struct bus *io_bus, struct console *console)
+{
+  serial_dev_priv = serial_dev_priv_reset;
   *s = (serial_dev_t) {
     .priv = (void *)&serial_dev_priv,
-    .main_tid = pthread_self(),
     .infd = STDIN_FILENO,
+    .console = console,
+    .irq_level = -1,
   };
+  if ((s->kick_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+    return throw_err("Failed to create the serial eventfd");
+  pthread_mutex_init(&s->lock, NULL);
+  dev_init(&s->dev, COM1_PORT_BASE, COM1_PORT_SIZE, s, serial_io);
+  s->dev.do_rep_io = serial_rep_io;
+  if (bus_register_dev(io_bus, &s->dev) < 0)
+    return -1;
 
   // create a thread which accepts serial input
-  pthread_create(&s->worker_tid, NULL, (void *)serial_thread, (void*)s);
-  /*Unlock the timer signal, so that timer notification can be delivered */
-  if (sigprocmask(SIG_UNBLOCK, &mask, NULL) == -1)
-    return throw_err("Failed to unblock timer singal");
+  if (pthread_create(&s->worker_tid, NULL, (void *)serial_thread, (void*)s))
+    return throw_err("Failed to create the serial thread");
 
   return 0;
 }
 
-void serial_handle(serial_dev_t *s, struct kvm_run *r)
+int serial_save(serial_dev_t *s, struct snapshot *snap)
 {
-  uint32_t count = r->io.count;
-  void *data = (uint8_t *) r + r->io.data_offset;
-  void (*serial_op)(serial_dev_t *, uint16_t, void *) =
-    (r->io.direction == KVM_EXIT_IO_OUT) ? serial_out:serial_in;
+  pthread_mutex_lock(&s->lock);
+  int ret = snapshot_put(snap, SNAP_SERIAL, s->priv,
+                         sizeof(struct serial_dev_priv));
+  pthread_mutex_unlock(&s->lock);
 
-  
-  for (uint16_t offset = r->io.port - COM1_PORT_BASE; count--; 
-    data+=r->io.size) {
-    serial_op(s, offset, data);
-  }
+  return ret;
+}
+
+int serial_restore(serial_dev_t *s, struct snapshot *snap)
+{
+  pthread_mutex_lock(&s->lock);
+  int ret = snapshot_get(snap, SNAP_SERIAL, s->priv,
+                         sizeof(struct serial_dev_priv));
+  s->irq_level = -1;
+  s->rx_time = s->tx_time = serial_now();
+  serial_update_irq(s);
+  pthread_mutex_unlock(&s->lock);
+  serial_kick(s);
+
+  return ret;
+}
+
+// serial_tx_busy tells whether the guest waits on transmission: it asked for
+// the THR empty interrupt, or the TX FIFO still holds characters
+bool serial_tx_busy(serial_dev_t *s)
+{
+  struct serial_dev_priv *priv = (struct serial_dev_priv *)s->priv;
+
+  pthread_mutex_lock(&s->lock);
+  bool busy = (priv->ier & UART_IER_THRI) || !fifo_is_empty(&priv->tx_buf);
+  pthread_mutex_unlock(&s->lock);
+  return busy;
+}
+
+void serial_reset(serial_dev_t *s)
+{
+  pthread_mutex_lock(&s->lock);
+  *(struct serial_dev_priv *)s->priv = serial_dev_priv_reset;
+  s->irq_level = -1;
+  serial_update_irq(s);
+  pthread_mutex_unlock(&s->lock);
 }
 
 void serial_exit(serial_dev_t *s)
 {
   __atomic_store_n(&thread_stop, true, __ATOMIC_RELAXED);
+  serial_kick(s);
   pthread_join(s->worker_tid, NULL);
+  // what the guest left in the TX FIFO
+  serial_tx_flush(s);
+  close(s->kick_fd);
   pthread_mutex_destroy(&s->lock);
 }
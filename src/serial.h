@@ -3,25 +3,38 @@
 
 #include <linux/kvm.h>
 #include <pthread.h>
+#include <stdbool.h>
 #include <stdint.h>
 
+#include "bus.h"
+#include "console.h"
+
 #define COM1_PORT_BASE 0x03f8
 #define COM1_PORT_SIZE 8
 #define COM1_PORT_END (COM1_PORT_BASE + COM1_PORT_SIZE)
 
 typedef struct serial_dev serial_dev_t;
+struct snapshot;
 
 struct serial_dev {
 	void *priv;
 	pthread_mutex_t lock;
 	pthread_t worker_tid;
-	pthread_t main_tid;
 	int infd; // file descriptor for serial input
+	bool input_eof;
+	int kick_fd; // eventfd, wakes the worker for a new FIFO deadline
+	int irq_level; // last level set on the IRQ line, -1 if unknown
+	uint64_t rx_time; // last RX FIFO activity, starts the character timeout
+	uint64_t tx_time; // first byte queued in the TX FIFO
+	struct console *console; // output
+	struct dev dev;
 };
 
-void serial_console(serial_dev_t *s);
-int serial_init(serial_dev_t *s);
-void serial_handle(serial_dev_t *s, struct kvm_run *r);
+int serial_init(serial_dev_t *s, struct bus *io_bus, struct console *console);
+int serial_save(serial_dev_t *s, struct snapshot *snap);
+int serial_restore(serial_dev_t *s, struct snapshot *snap);
+bool serial_tx_busy(serial_dev_t *s);
+void serial_reset(serial_dev_t *s);
 void serial_exit(serial_dev_t *s);
 
 #endif // !SERIAL_H
@@ -0,0 +1,507 @@
+#include <asm/kvm_para.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <linux/kvm.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "snapshot.h"
+#include "vm.h"
+
+struct snapshot_section_hdr {
+  uint32_t id;
+  uint32_t len;
+};
+
+int snapshot_put(struct snapshot *snap, uint32_t id, const void *data,
+                 uint32_t len) {
+  struct snapshot_section_hdr sec = {.id = id, .len = len};
+  size_t need = snap->len + sizeof(sec) + len;
+
+  if (need > snap->cap) {
+    size_t cap = snap->cap ? snap->cap : 64 << 10;
+    while (cap < need)
+      cap <<= 1;
+    uint8_t *buf = realloc(snap->buf, cap);
+    if (!buf)
+      return throw_err("Failed to grow the snapshot buffer");
+    snap->buf = buf;
+    snap->cap = cap;
+  }
+
+  memcpy(snap->buf + snap->len, &sec, sizeof(sec));
+  memcpy(snap->buf + snap->len + sizeof(sec), data, len);
+  snap->len = need;
+  return 0;
+}
+
+// Sections are read back in the order they were written. A different id or
+// size means the snapshot comes from another build or host.
+int snapshot_get(struct snapshot *snap, uint32_t id, void *data, uint32_t len) {
+  struct snapshot_section_hdr sec;
+
+  if (snap->pos + sizeof(sec) > snap->len)
+    goto err;
+  memcpy(&sec, snap->buf + snap->pos, sizeof(sec));
+  if (sec.id != id || sec.len != len ||
+      snap->pos + sizeof(sec) + len > snap->len)
+    goto err;
+
+  memcpy(data, snap->buf + snap->pos + sizeof(sec), len);
+  snap->pos += sizeof(sec) + len;
+  return 0;
+
+err:
+  fprintf(stderr, "Snapshot: section %u (%u bytes) missing or mismatched\n",
+          id, len);
+  return -1;
+}
+
+/* The MSRs that KVM_GET_SREGS and friends do not cover. Each one is read on
+ * its own at save time, the ones the host does not know are left out. */
+static const uint32_t vcpu_msr_index[] = {
+    0x10,       // IA32_TSC
+    0x174,      // IA32_SYSENTER_CS
+    0x175,      // IA32_SYSENTER_ESP
+    0x176,      // IA32_SYSENTER_EIP
+    0x1a0,      // IA32_MISC_ENABLE
+    0x277,      // IA32_PAT
+    0x2ff,      // IA32_MTRR_DEF_TYPE
+    0xc0000081, // STAR
+    0xc0000082, // LSTAR
+    0xc0000083, // CSTAR
+    0xc0000084, // SYSCALL_MASK
+    0xc0000102, // KERNEL_GS_BASE
+    0xc0000103, // TSC_AUX
+    MSR_KVM_WALL_CLOCK_NEW,
+    MSR_KVM_SYSTEM_TIME_NEW,
+    MSR_KVM_ASYNC_PF_EN,
+    MSR_KVM_STEAL_TIME,
+    MSR_KVM_PV_EOI_EN,
+    0x6e0, // IA32_TSC_DEADLINE, after the LAPIC on restore
+};
+
+#define VCPU_NR_MSRS (sizeof(vcpu_msr_index) / sizeof(vcpu_msr_index[0]))
+
+struct vcpu_state {
+  struct kvm_mp_state mp_state;
+  struct kvm_regs regs;
+  struct kvm_sregs sregs;
+  struct kvm_fpu fpu;
+  struct kvm_xcrs xcrs;
+  struct kvm_lapic_state lapic;
+  struct kvm_vcpu_events events;
+  struct kvm_debugregs debugregs;
+  struct {
+    uint32_t nmsrs;
+    uint32_t pad;
+    struct kvm_msr_entry entries[VCPU_NR_MSRS];
+  } msrs;
+};
+
+// XSAVE may be larger than struct kvm_xsave once dynamic features are on
+static int vcpu_xsave_size(vm_t *v) {
+  int size = ioctl(v->vm_fd, KVM_CHECK_EXTENSION, KVM_CAP_XSAVE2);
+  return size > (int)sizeof(struct kvm_xsave) ? size : sizeof(struct kvm_xsave);
+}
+
+static int vcpu_save(vm_t *v, struct vcpu *vcpu, struct snapshot *snap) {
+  struct vcpu_state st;
+  int xsave_size = vcpu_xsave_size(v);
+
+  memset(&st, 0, sizeof(st));
+  if (ioctl(vcpu->fd, KVM_GET_MP_STATE, &st.mp_state) < 0 ||
+      ioctl(vcpu->fd, KVM_GET_REGS, &st.regs) < 0 ||
+      ioctl(vcpu->fd, KVM_GET_SREGS, &st.sregs) < 0 ||
+      ioctl(vcpu->fd, KVM_GET_FPU, &st.fpu) < 0 ||
+      ioctl(vcpu->fd, KVM_GET_XCRS, &st.xcrs) < 0 ||
+      ioctl(vcpu->fd, KVM_GET_LAPIC, &st.lapic) < 0 ||
+      ioctl(vcpu->fd, KVM_GET_VCPU_EVENTS, &st.events) < 0 ||
+      ioctl(vcpu->fd, KVM_GET_DEBUGREGS, &st.debugregs) < 0)
+    return throw_err("Failed to get vcpu state");
+
+  for (unsigned int i = 0; i < VCPU_NR_MSRS; i++) {
+    struct {
+      uint32_t nmsrs;
+      uint32_t pad;
+      struct kvm_msr_entry entry;
+    } msr = {.nmsrs = 1, .entry = {.index = vcpu_msr_index[i]}};
+    if (ioctl(vcpu->fd, KVM_GET_MSRS, &msr) == 1)
+      st.msrs.entries[st.msrs.nmsrs++] = msr.entry;
+  }
+
+  struct kvm_xsave *xsave = calloc(1, xsave_size);
+  if (!xsave)
+    return throw_err("Failed to allocate the XSAVE area");
+  int ret = ioctl(vcpu->fd,
+                  xsave_size > (int)sizeof(struct kvm_xsave) ? KVM_GET_XSAVE2
+                                                             : KVM_GET_XSAVE,
+                  xsave);
+  if (ret < 0)
+    ret = throw_err("Failed to get vcpu XSAVE state");
+  else if (snapshot_put(snap, SNAP_VCPU, &st, sizeof(st)) < 0 ||
+           snapshot_put(snap, SNAP_XSAVE, xsave, xsave_size) < 0)
+    ret = -1;
+  free(xsave);
+
+  return ret;
+}
+
+static int vcpu_restore(vm_t *v, struct vcpu *vcpu, struct snapshot *snap) {
+  struct vcpu_state st;
+  int xsave_size = vcpu_xsave_size(v);
+  struct kvm_xsave *xsave = calloc(1, xsave_size);
+  int ret = 0;
+
+  if (!xsave)
+    return throw_err("Failed to allocate the XSAVE area");
+  if (snapshot_get(snap, SNAP_VCPU, &st, sizeof(st)) < 0 ||
+      snapshot_get(snap, SNAP_XSAVE, xsave, xsave_size) < 0) {
+    free(xsave);
+    return -1;
+  }
+
+  // userspace has to say which of these fields are meaningful
+  st.events.flags |=
+      KVM_VCPUEVENT_VALID_NMI_PENDING | KVM_VCPUEVENT_VALID_SIPI_VECTOR;
+
+  if (ioctl(vcpu->fd, KVM_SET_SREGS, &st.sregs) < 0 ||
+      ioctl(vcpu->fd, KVM_SET_REGS, &st.regs) < 0 ||
+      ioctl(vcpu->fd, KVM_SET_FPU, &st.fpu) < 0 ||
+      ioctl(vcpu->fd, KVM_SET_XCRS, &st.xcrs) < 0 ||
+      ioctl(vcpu->fd, KVM_SET_XSAVE, xsave) < 0 ||
+      ioctl(vcpu->fd, KVM_SET_LAPIC, &st.lapic) < 0 ||
+      ioctl(vcpu->fd, KVM_SET_MSRS, &st.msrs) != (int)st.msrs.nmsrs ||
+      ioctl(vcpu->fd, KVM_SET_VCPU_EVENTS, &st.events) < 0 ||
+      ioctl(vcpu->fd, KVM_SET_DEBUGREGS, &st.debugregs) < 0 ||
+      ioctl(vcpu->fd, KVM_SET_MP_STATE, &st.mp_state) < 0)
+    ret = throw_err("Failed to set vcpu state");
+
+  free(xsave);
+  return ret;
+}
+
+// The in-kernel PIC pair, IOAPIC, PIT and kvmclock
+static int vm_state_save(vm_t *v, struct snapshot *snap) {
+  for (int i = KVM_IRQCHIP_PIC_MASTER; i <= KVM_IRQCHIP_IOAPIC; i++) {
+    struct kvm_irqchip chip = {.chip_id = i};
+    if (ioctl(v->vm_fd, KVM_GET_IRQCHIP, &chip) < 0)
+      return throw_err("Failed to get irqchip state");
+    if (snapshot_put(snap, SNAP_IRQCHIP, &chip, sizeof(chip)) < 0)
+      return -1;
+  }
+
+  struct kvm_pit_state2 pit;
+  if (ioctl(v->vm_fd, KVM_GET_PIT2, &pit) < 0)
+    return throw_err("Failed to get PIT state");
+  if (snapshot_put(snap, SNAP_PIT, &pit, sizeof(pit)) < 0)
+    return -1;
+
+  struct kvm_clock_data clock = {0};
+  if (ioctl(v->vm_fd, KVM_GET_CLOCK, &clock) < 0)
+    return throw_err("Failed to get kvmclock");
+  return snapshot_put(snap, SNAP_CLOCK, &clock, sizeof(clock));
+}
+
+static int vm_state_restore(vm_t *v, struct snapshot *snap) {
+  for (int i = KVM_IRQCHIP_PIC_MASTER; i <= KVM_IRQCHIP_IOAPIC; i++) {
+    struct kvm_irqchip chip;
+    if (snapshot_get(snap, SNAP_IRQCHIP, &chip, sizeof(chip)) < 0)
+      return -1;
+    if (ioctl(v->vm_fd, KVM_SET_IRQCHIP, &chip) < 0)
+      return throw_err("Failed to set irqchip state");
+  }
+
+  struct kvm_pit_state2 pit;
+  if (snapshot_get(snap, SNAP_PIT, &pit, sizeof(pit)) < 0)
+    return -1;
+  if (ioctl(v->vm_fd, KVM_SET_PIT2, &pit) < 0)
+    return throw_err("Failed to set PIT state");
+
+  // the guest clock carries on from where it was saved
+  struct kvm_clock_data clock;
+  if (snapshot_get(snap, SNAP_CLOCK, &clock, sizeof(clock)) < 0)
+    return -1;
+  clock.flags = 0;
+  if (ioctl(v->vm_fd, KVM_SET_CLOCK, &clock) < 0)
+    return throw_err("Failed to set kvmclock");
+
+  return 0;
+}
+
+static bool page_is_zero(const uint8_t *p, size_t size) {
+  const uint64_t *w = (const uint64_t *)p;
+
+  for (size_t i = 0; i < size / sizeof(*w); i++) {
+    if (w[i])
+      return false;
+  }
+  return true;
+}
+
+// Only the runs of non-zero pages are written, the rest stays a file hole,
+// so a freshly booted guest does not cost its full RAM size on disk.
+static int snapshot_write_ram(int fd, vm_t *v, off_t offset) {
+  const size_t page = 4096;
+  uint8_t *mem = v->mem;
+  size_t start = 0;
+
+  while (start < v->ram_size) {
+    while (start < v->ram_size && page_is_zero(mem + start, page))
+      start += page;
+    size_t end = start;
+    while (end < v->ram_size && !page_is_zero(mem + end, page))
+      end += page;
+
+    for (size_t off = start; off < end;) {
+      ssize_t n = pwrite(fd, mem + off, end - off, offset + off);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        return -1;
+      off += n;
+    }
+    start = end;
+  }
+
+  return ftruncate(fd, offset + v->ram_size);
+}
+
+static long elapsed_ms(struct timespec *t0) {
+  struct timespec t1;
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  return (t1.tv_sec - t0->tv_sec) * 1000 +
+         (t1.tv_nsec - t0->tv_nsec) / 1000000;
+}
+
+// The cpu part of a snapshot: in-kernel irqchip, timers and every vcpu. The
+// vcpus must not be running.
+int vm_snapshot_save_cpus(vm_t *v, struct snapshot *snap) {
+  if (vm_state_save(v, snap) < 0)
+    return -1;
+  for (int i = 0; i < v->nr_vcpus; i++) {
+    if (vcpu_save(v, &v->vcpus[i], snap) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+int vm_snapshot_restore_cpus(vm_t *v, struct snapshot *snap) {
+  if (vm_state_restore(v, snap) < 0)
+    return -1;
+  for (int i = 0; i < v->nr_vcpus; i++) {
+    if (vcpu_restore(v, &v->vcpus[i], snap) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+// vm_snapshot_capture pauses the guest and collects the state of its vcpus
+// and devices in snap, guest RAM is left where it is. The guest stays
+// paused, the caller decides what next.
+int vm_snapshot_capture(vm_t *v, struct snapshot *snap) {
+  memset(snap, 0, sizeof(*snap));
+  snap->fd = -1;
+
+  if (vm_pause(v) < 0) {
+    fprintf(stderr, "Snapshot: the guest stopped before it could be paused\n");
+    return -1;
+  }
+
+  if (vm_snapshot_save_cpus(v, snap) < 0)
+    return -1;
+  if (serial_save(&v->serial, snap) < 0 || pci_save(&v->pci, snap) < 0 ||
+      virtio_blk_save(&v->virtio_blk_dev, snap) < 0 ||
+      virtio_console_save(&v->virtio_console_dev, snap) < 0)
+    return -1;
+
+  snap->hdr = (struct snapshot_header){
+      .magic = SNAPSHOT_MAGIC,
+      .version = SNAPSHOT_VERSION,
+      .nr_vcpus = v->nr_vcpus,
+      .ram_size = v->ram_size,
+      .state_size = snap->len,
+  };
+  return 0;
+}
+
+// vm_snapshot_save captures the guest and writes it to path. The file is
+// assembled next to it and renamed, so an existing snapshot is never left
+// half written.
+int vm_snapshot_save(vm_t *v, const char *path) {
+  struct snapshot snap;
+  struct timespec t0;
+  char tmp[4096];
+  int ret = -1;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  if (vm_snapshot_capture(v, &snap) < 0)
+    goto out;
+
+  snap.hdr.state_offset = sizeof(struct snapshot_header);
+  snap.hdr.ram_offset = (snap.hdr.state_offset + snap.len +
+                         SNAPSHOT_RAM_ALIGN - 1) & ~(SNAPSHOT_RAM_ALIGN - 1);
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+  if ((snap.fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+    throw_err("Failed to create the snapshot file");
+    goto out;
+  }
+  if (pwrite(snap.fd, &snap.hdr, sizeof(snap.hdr), 0) != sizeof(snap.hdr) ||
+      pwrite(snap.fd, snap.buf, snap.len, snap.hdr.state_offset) !=
+          (ssize_t)snap.len ||
+      snapshot_write_ram(snap.fd, v, snap.hdr.ram_offset) < 0) {
+    throw_err("Failed to write the snapshot file");
+    unlink(tmp);
+    goto out;
+  }
+  if (rename(tmp, path) < 0) {
+    throw_err("Failed to rename the snapshot file");
+    unlink(tmp);
+    goto out;
+  }
+
+  struct stat st;
+  fstat(snap.fd, &st);
+  printf("Snapshot: saved %d vcpus and %" PRIu64 " MiB of RAM (%lld KiB on "
+         "disk) to %s in %ld ms\n",
+         v->nr_vcpus, v->ram_size >> 20, (long long)st.st_blocks / 2,
+         path, elapsed_ms(&t0));
+  ret = 0;
+
+out:
+  snapshot_close(&snap);
+  return ret;
+}
+
+// snapshot_open reads the header and the state sections. The RAM is not
+// read, vm_init maps it straight from snap->fd at hdr.ram_offset.
+int snapshot_open(struct snapshot *snap, const char *path) {
+  memset(snap, 0, sizeof(*snap));
+  if ((snap->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+    return throw_err("Failed to open the snapshot file");
+
+  if (pread(snap->fd, &snap->hdr, sizeof(snap->hdr), 0) != sizeof(snap->hdr) ||
+      snap->hdr.magic != SNAPSHOT_MAGIC) {
+    fprintf(stderr, "Snapshot: %s is not a snapshot\n", path);
+    goto err;
+  }
+  if (snap->hdr.version != SNAPSHOT_VERSION) {
+    fprintf(stderr, "Snapshot: unsupported version %u\n", snap->hdr.version);
+    goto err;
+  }
+  if (snap->hdr.ram_offset & (SNAPSHOT_RAM_ALIGN - 1)) {
+    fprintf(stderr, "Snapshot: guest RAM is not aligned in the file\n");
+    goto err;
+  }
+
+  snap->len = snap->cap = snap->hdr.state_size;
+  if (!(snap->buf = malloc(snap->len))) {
+    throw_err("Failed to allocate the snapshot buffer");
+    goto err;
+  }
+  if (pread(snap->fd, snap->buf, snap->len, snap->hdr.state_offset) !=
+      (ssize_t)snap->len) {
+    throw_err("Failed to read the snapshot state");
+    goto err;
+  }
+
+  return 0;
+
+err:
+  snapshot_close(snap);
+  return -1;
+}
+
+void snapshot_close(struct snapshot *snap) {
+  free(snap->buf);
+  snap->buf = NULL;
+  snap->len = snap->cap = snap->pos = 0;
+  if (snap->fd >= 0)
+    close(snap->fd);
+  snap->fd = -1;
+}
+
+// vm_snapshot_restore loads the state of a VM created by vm_init from the
+// snapshot header, whose RAM is already mapped from the file.
+int vm_snapshot_restore(vm_t *v, struct snapshot *snap) {
+  struct timespec t0;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  snap->pos = 0;
+  if (vm_snapshot_restore_cpus(v, snap) < 0)
+    return -1;
+  if (serial_restore(&v->serial, snap) < 0 || pci_restore(&v->pci, snap) < 0 ||
+      virtio_blk_restore(&v->virtio_blk_dev, snap) < 0 ||
+      virtio_console_restore(&v->virtio_console_dev, snap) < 0)
+    return -1;
+
+  printf("Snapshot: restored %d vcpus and %" PRIu64 " MiB of RAM in %ld ms\n",
+         v->nr_vcpus, v->ram_size >> 20, elapsed_ms(&t0));
+  return 0;
+}
+
+static int trigger_pipe[2] = {-1, -1};
+static pthread_t trigger_tid;
+static snapshot_action_fn trigger_action;
+static void *trigger_arg;
+
+static void snapshot_signal(int sig) {
+  char c = 0;
+
+  if (write(trigger_pipe[1], &c, 1) < 0)
+    return;
+}
+
+static void *snapshot_thread(void *arg) {
+  vm_t *v = (vm_t *)arg;
+  char c;
+
+  if (read(trigger_pipe[0], &c, 1) == 1 && c == 0) {
+    trigger_action(v, trigger_arg);
+    vm_poweroff(v);
+  }
+  return NULL;
+}
+
+// snapshot_trigger_init runs action on the VM, from a thread of its own, on
+// SIGINT/SIGTERM and then stops the VM
+int snapshot_trigger_init(vm_t *v, snapshot_action_fn action, void *arg) {
+  trigger_action = action;
+  trigger_arg = arg;
+  if (pipe(trigger_pipe) < 0)
+    return throw_err("Failed to create the snapshot pipe");
+  if (pthread_create(&trigger_tid, NULL, snapshot_thread, v))
+    return throw_err("Failed to create the snapshot thread");
+
+  struct sigaction sa = {.sa_handler = snapshot_signal,
+                         .sa_flags = SA_RESTART};
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGINT, &sa, NULL) < 0 || sigaction(SIGTERM, &sa, NULL) < 0)
+    return throw_err("Failed to install the snapshot signal handler");
+
+  return 0;
+}
+
+void snapshot_trigger_exit(void) {
+  char c = 1;
+
+  if (trigger_pipe[1] < 0)
+    return;
+
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  if (write(trigger_pipe[1], &c, 1) == 1)
+    pthread_join(trigger_tid, NULL);
+  close(trigger_pipe[0]);
+  close(trigger_pipe[1]);
+  trigger_pipe[0] = trigger_pipe[1] = -1;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "vm.h"
+
+#define SNAPSHOT_MAGIC 0x50414e534d564bULL // "KVMSNAP"
+#define SNAPSHOT_VERSION 5
+// guest RAM starts on this boundary in the file so it can be mapped directly
+#define SNAPSHOT_RAM_ALIGN (2ULL << 20)
+
+enum snapshot_section {
+  SNAP_IRQCHIP = 1,
+  SNAP_PIT,
+  SNAP_CLOCK,
+  SNAP_VCPU,
+  SNAP_XSAVE,
+  SNAP_SERIAL,
+  SNAP_PCI,
+  SNAP_VIRTIO_BLK,
+  SNAP_VIRTIO_PCI,
+  SNAP_VIRTQ,
+  SNAP_VIRTIO_CONSOLE,
+};
+
+/* On-disk layout: this header, the device/vcpu state as a sequence of
+ * (id, len, data) sections, then the raw guest RAM at ram_offset. All-zero
+ * RAM pages are left as holes. */
+struct snapshot_header {
+  uint64_t magic;
+  uint32_t version;
+  uint32_t nr_vcpus;
+  uint64_t ram_size;
+  uint64_t state_offset;
+  uint64_t state_size;
+  uint64_t ram_offset;
+};
+
+struct snapshot {
+  struct snapshot_header hdr;
+  uint8_t *buf; // state sections
+  size_t len;
+  size_t cap;
+  size_t pos; // read cursor
+  int fd;
+};
+
+int snapshot_put(struct snapshot *snap, uint32_t id, const void *data,
+                 uint32_t len);
+int snapshot_get(struct snapshot *snap, uint32_t id, void *data, uint32_t len);
+
+int snapshot_open(struct snapshot *snap, const char *path);
+void snapshot_close(struct snapshot *snap);
+
+int vm_snapshot_save_cpus(vm_t *v, struct snapshot *snap);
+int vm_snapshot_restore_cpus(vm_t *v, struct snapshot *snap);
+int vm_snapshot_capture(vm_t *v, struct snapshot *snap);
+int vm_snapshot_save(vm_t *v, const char *path);
+int vm_snapshot_restore(vm_t *v, struct snapshot *snap);
+
+typedef int (*snapshot_action_fn)(vm_t *v, void *arg);
+int snapshot_trigger_init(vm_t *v, snapshot_action_fn action, void *arg);
+void snapshot_trigger_exit(void);
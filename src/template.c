@@ -0,0 +1,131 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "snapshot.h"
+#include "template.h"
+
+static long elapsed_ms(struct timespec *t0) {
+  struct timespec t1;
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  return (t1.tv_sec - t0->tv_sec) * 1000 +
+         (t1.tv_nsec - t0->tv_nsec) / 1000000;
+}
+
+// A clone starts as a copy of the template process, minus its threads. The
+// template's KVM objects belong to the parent's mm and cannot be used here,
+// the clone builds a VM of its own around the same RAM and state.
+static int template_run_clone(vm_t *tmpl, struct template *t,
+                              struct snapshot *snap, int id,
+                              struct timespec *t0) {
+  // the handlers of the parent would talk to threads that do not exist here
+  signal(SIGINT, SIG_DFL);
+  signal(SIGTERM, SIG_DFL);
+  signal(SIGUSR2, SIG_IGN);
+
+  for (int i = 0; i < tmpl->nr_vcpus; i++) {
+    munmap(tmpl->vcpus[i].run, tmpl->run_size);
+    close(tmpl->vcpus[i].fd);
+  }
+  close(tmpl->vm_fd);
+  close(tmpl->kvm_fd);
+
+  struct vm_config cfg = t->config;
+  cfg.nr_vcpus = tmpl->nr_vcpus;
+  cfg.mem_size = tmpl->ram_size;
+  cfg.mem_prealloc = -1;
+  cfg.ram_fd = tmpl->ram.fd;
+  cfg.ram_offset = 0;
+  cfg.ram_lazy = false;
+
+  // each clone listens on a socket of its own
+  char console[256];
+  if (cfg.console && !strncmp(cfg.console, "unix:", 5)) {
+    snprintf(console, sizeof(console), "%s.%d", cfg.console, id);
+    cfg.console = console;
+  }
+  char vconsole[VIRTIO_CONSOLE_MAX_PORTS][256];
+  for (int i = 0; i < cfg.nr_vconsoles; i++) {
+    const char *spec = cfg.vconsole[i];
+    if (strncmp(spec, "unix:", 5))
+      continue;
+    int len = strcspn(spec, ",");
+    snprintf(vconsole[i], sizeof(vconsole[i]), "%.*s.%d%s", len, spec, id,
+             spec + len);
+    cfg.vconsole[i] = vconsole[i];
+  }
+
+  vm_t *v = malloc(sizeof(vm_t));
+  if (!v)
+    return throw_err("Failed to allocate the clone VM");
+  if (vm_init(v, &cfg) < 0 || vm_snapshot_restore(v, snap) < 0)
+    return -1;
+  printf("Clone %d: pid %d resumed in %ld ms\n", id, getpid(),
+         elapsed_ms(t0));
+  fflush(stdout);
+
+  int ret = vm_run(v);
+  vm_exit(v);
+  return ret;
+}
+
+// template_clone is the trigger action of the template VM. It captures the
+// paused template and forks the clones, the template then stays paused
+// until all of them have exited: writing to its RAM would show through in
+// every clone page that was not copied yet.
+int template_clone(vm_t *v, void *arg) {
+  struct template *t = (struct template *)arg;
+  struct snapshot snap;
+  struct timespec t0;
+  int ret = 0;
+
+  if (v->ram.fd < 0) {
+    fprintf(stderr, "Template: guest RAM is not backed by a memfd\n");
+    return -1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  if (vm_snapshot_capture(v, &snap) < 0) {
+    snapshot_close(&snap);
+    return -1;
+  }
+  printf("Template: captured in %ld ms, starting %d clones\n",
+         elapsed_ms(&t0), t->nr_clones);
+  fflush(stdout);
+  fflush(stderr);
+
+  int started = 0;
+  for (; started < t->nr_clones; started++) {
+    struct timespec t1;
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    pid_t pid = fork();
+    if (pid < 0) {
+      ret = throw_err("Failed to fork a clone");
+      break;
+    }
+    if (pid == 0)
+      exit(template_run_clone(v, t, &snap, started, &t1) < 0 ? 1 : 0);
+  }
+  snapshot_close(&snap);
+
+  for (int i = 0; i < started; i++) {
+    int status;
+    pid_t pid = wait(&status);
+    if (pid < 0)
+      break;
+    printf("Template: clone pid %d exited with status %d\n", pid,
+           WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+    if (!WIFEXITED(status) || WEXITSTATUS(status))
+      ret = -1;
+  }
+
+  return ret;
+}
@@ -0,0 +1,13 @@
+#pragma once
+
+#include "vm.h"
+
+/* A template VM boots once, then forks clones which resume from its state.
+ * The clones map the template's memfd backed RAM privately, so they share
+ * every page none of them has written to. */
+struct template {
+  struct vm_config config; // how the template was created
+  int nr_clones;
+};
+
+int template_clone(vm_t *v, void *arg);
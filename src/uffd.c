@@ -0,0 +1,259 @@
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <inttypes.h>
+#include <linux/userfaultfd.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "uffd.h"
+
+// a fault fills the aligned block around it, like a small readahead
+#define FAULT_BLOCK (64UL << 10)
+#define PREFETCH_CHUNK (2UL << 20)
+
+static bool page_populated(struct uffd_ram *r, size_t page) {
+  uint64_t w = __atomic_load_n(&r->populated[page / 64], __ATOMIC_ACQUIRE);
+  return w & (1ULL << (page % 64));
+}
+
+static void mark_populated(struct uffd_ram *r, size_t page, size_t n) {
+  for (; n--; page++) {
+    uint64_t bit = 1ULL << (page % 64);
+    if (!(__atomic_fetch_or(&r->populated[page / 64], bit, __ATOMIC_RELEASE) &
+          bit))
+      __atomic_fetch_add(&r->nr_populated, 1, __ATOMIC_RELAXED);
+  }
+}
+
+// uffd_ram_fill populates the missing pages of [first, last). The fault
+// thread and the prefetcher race for the same pages, whoever loses gets
+// EEXIST and moves on.
+static void uffd_ram_fill(struct uffd_ram *r, size_t first, size_t last,
+                          bool zero, int mode) {
+  size_t page = first;
+
+  while (page < last) {
+    if (page_populated(r, page)) {
+      page++;
+      continue;
+    }
+    size_t end = page + 1;
+    while (end < last && !page_populated(r, end))
+      end++;
+
+    uint64_t off = page * r->page_size;
+    uint64_t len = (end - page) * r->page_size;
+    int64_t done;
+    int ret;
+    if (zero && r->zeropage) {
+      struct uffdio_zeropage z = {
+          .range = {.start = (uint64_t)r->host + off, .len = len},
+          .mode = mode,
+      };
+      ret = ioctl(r->uffd, UFFDIO_ZEROPAGE, &z);
+      done = z.zeropage;
+      if (ret < 0 && errno == EINVAL && done <= 0) {
+        // hugetlb has no zero page, copy the zeros from the image instead
+        r->zeropage = false;
+        continue;
+      }
+    } else {
+      struct uffdio_copy c = {
+          .dst = (uint64_t)r->host + off,
+          .src = (uint64_t)r->src + off,
+          .len = len,
+          .mode = mode,
+      };
+      ret = ioctl(r->uffd, UFFDIO_COPY, &c);
+      done = c.copy;
+    }
+
+    size_t n = done > 0 ? done / r->page_size : 0;
+    mark_populated(r, page, n);
+    page += n;
+    if (ret < 0) {
+      if (errno == EEXIST || done == -EEXIST) {
+        mark_populated(r, page, 1);
+        page++;
+      } else if (errno != EAGAIN) {
+        throw_err("Failed to populate guest RAM from the snapshot");
+        return;
+      }
+    }
+  }
+}
+
+static void uffd_ram_fault(struct uffd_ram *r, uint64_t addr) {
+  size_t block = r->page_size > FAULT_BLOCK ? r->page_size : FAULT_BLOCK;
+  uint64_t off = (addr - (uint64_t)r->host) & ~(block - 1);
+  size_t first = off / r->page_size;
+  size_t last = first + block / r->page_size;
+
+  if (last > r->nr_pages)
+    last = r->nr_pages;
+
+  r->faults++;
+  uffd_ram_fill(r, first, last, false, UFFDIO_COPY_MODE_DONTWAKE);
+
+  // also wakes a fault on a page the prefetcher filled in the meantime
+  struct uffdio_range range = {
+      .start = (uint64_t)r->host + first * r->page_size,
+      .len = (last - first) * r->page_size,
+  };
+  ioctl(r->uffd, UFFDIO_WAKE, &range);
+}
+
+static void *uffd_fault_thread(void *arg) {
+  struct uffd_ram *r = (struct uffd_ram *)arg;
+  struct pollfd fds[2] = {
+      {.fd = r->uffd, .events = POLLIN},
+      {.fd = r->stop_fd, .events = POLLIN},
+  };
+  struct uffd_msg msgs[16];
+
+  while (!__atomic_load_n(&r->stop, __ATOMIC_RELAXED)) {
+    if (poll(fds, 2, -1) < 0 || fds[1].revents)
+      continue;
+
+    ssize_t n = read(r->uffd, msgs, sizeof(msgs));
+    for (ssize_t i = 0; i < n / (ssize_t)sizeof(msgs[0]); i++) {
+      if (msgs[i].event == UFFD_EVENT_PAGEFAULT)
+        uffd_ram_fault(r, msgs[i].arg.pagefault.address);
+    }
+  }
+
+  return NULL;
+}
+
+static void *uffd_prefetch_thread(void *arg) {
+  struct uffd_ram *r = (struct uffd_ram *)arg;
+  size_t chunk = r->page_size > PREFETCH_CHUNK ? r->page_size : PREFETCH_CHUNK;
+  size_t pages = chunk / r->page_size;
+
+  for (size_t page = 0; page < r->nr_pages; page += pages) {
+    if (__atomic_load_n(&r->stop, __ATOMIC_RELAXED))
+      return NULL;
+
+    size_t last = page + pages < r->nr_pages ? page + pages : r->nr_pages;
+    // a chunk without data in the file is a hole the snapshot skipped
+    off_t pos = r->offset + page * r->page_size;
+    off_t data = lseek(r->fd, pos, SEEK_DATA);
+    bool zero = data < 0 ? errno == ENXIO : data >= pos + (off_t)chunk;
+
+    uffd_ram_fill(r, page, last, zero, 0);
+  }
+
+  struct timespec t1;
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  long ms = (t1.tv_sec - r->start.tv_sec) * 1000 +
+            (t1.tv_nsec - r->start.tv_nsec) / 1000000;
+  printf("Guest RAM: %zu MiB restored in the background in %ld ms, %" PRIu64
+         " faults served on demand\n",
+         r->size >> 20, ms, __atomic_load_n(&r->faults, __ATOMIC_RELAXED));
+
+  // everything is in place, later faults are none of the snapshot's business
+  if (__atomic_load_n(&r->nr_populated, __ATOMIC_ACQUIRE) == r->nr_pages) {
+    struct uffdio_range range = {.start = (uint64_t)r->host, .len = r->size};
+    if (!ioctl(r->uffd, UFFDIO_UNREGISTER, &range))
+      r->registered = false;
+  }
+
+  return NULL;
+}
+
+// uffd_ram_init registers mem with userfaultfd and starts serving it from
+// the RAM image at offset in fd. It must run before anything touches the
+// guest RAM, the vcpus can start as soon as it returns.
+int uffd_ram_init(struct uffd_ram *r, struct guest_mem *mem, size_t image_size,
+                  int fd, off_t offset) {
+  memset(r, 0, sizeof(*r));
+  r->uffd = r->fd = r->stop_fd = -1;
+  r->host = mem->host;
+  r->size = mem->size;
+  r->page_size = mem->page_size;
+  r->offset = offset;
+  r->nr_pages = r->size / r->page_size;
+  r->zeropage = true;
+  clock_gettime(CLOCK_MONOTONIC, &r->start);
+
+  r->uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+  if (r->uffd < 0)
+    return throw_err("Failed to create userfaultfd");
+
+  struct uffdio_api api = {.api = UFFD_API};
+  if (ioctl(r->uffd, UFFDIO_API, &api) < 0)
+    return throw_err("Failed to negotiate the userfaultfd API");
+
+  struct uffdio_register reg = {
+      .range = {.start = (uint64_t)r->host, .len = r->size},
+      .mode = UFFDIO_REGISTER_MODE_MISSING,
+  };
+  if (ioctl(r->uffd, UFFDIO_REGISTER, &reg) < 0)
+    return throw_err("Failed to register guest RAM with userfaultfd");
+  r->registered = true;
+  if (!(reg.ioctls & (1ULL << _UFFDIO_COPY))) {
+    fprintf(stderr, "Guest RAM: userfaultfd cannot copy into this backend\n");
+    return -1;
+  }
+
+  // the RAM may be rounded up to the backing page size, past the image
+  r->src = mmap(NULL, r->size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (r->src == MAP_FAILED ||
+      mmap(r->src, image_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd,
+           offset) == MAP_FAILED) {
+    r->src = NULL;
+    return throw_err("Failed to map the snapshot RAM image");
+  }
+
+  if ((r->fd = dup(fd)) < 0 || (r->stop_fd = eventfd(0, EFD_CLOEXEC)) < 0)
+    return throw_err("Failed to set up lazy restore");
+
+  r->populated = calloc((r->nr_pages + 63) / 64, sizeof(uint64_t));
+  if (!r->populated)
+    return throw_err("Failed to allocate the populated page bitmap");
+
+  if (pthread_create(&r->fault_tid, NULL, uffd_fault_thread, r))
+    return throw_err("Failed to create the userfaultfd thread");
+  if (pthread_create(&r->prefetch_tid, NULL, uffd_prefetch_thread, r))
+    return throw_err("Failed to create the prefetch thread");
+
+  printf("Guest RAM: restoring %zu MiB lazily through userfaultfd\n",
+         r->size >> 20);
+  return 0;
+}
+
+void uffd_ram_exit(struct uffd_ram *r) {
+  uint64_t n = 1;
+
+  if (r->uffd < 0)
+    return;
+
+  __atomic_store_n(&r->stop, true, __ATOMIC_RELAXED);
+  if (r->prefetch_tid)
+    pthread_join(r->prefetch_tid, NULL);
+  if (r->fault_tid && write(r->stop_fd, &n, sizeof(n)) == sizeof(n))
+    pthread_join(r->fault_tid, NULL);
+
+  if (r->registered) {
+    struct uffdio_range range = {.start = (uint64_t)r->host, .len = r->size};
+    ioctl(r->uffd, UFFDIO_UNREGISTER, &range);
+  }
+  if (r->src)
+    munmap(r->src, r->size);
+  free(r->populated);
+  close(r->uffd);
+  if (r->fd >= 0)
+    close(r->fd);
+  if (r->stop_fd >= 0)
+    close(r->stop_fd);
+  r->uffd = -1;
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "mem.h"
+
+/* Guest RAM restored lazily from a snapshot: missing pages are filled by a
+ * userfaultfd handler when first touched, while a prefetcher streams the
+ * whole image in the background. */
+struct uffd_ram {
+  int uffd;
+  int fd;        // the snapshot, to find holes in the RAM image
+  int stop_fd;   // eventfd waking up the fault thread on exit
+  uint8_t *host; // guest RAM, registered with uffd
+  uint8_t *src;  // the RAM image mapped read-only, zeros past its end
+  size_t size;
+  size_t page_size;
+  off_t offset; // RAM image offset in the snapshot
+  size_t nr_pages;
+  uint64_t *populated; // one bit per page
+  size_t nr_populated;
+  uint64_t faults;
+  bool zeropage; // UFFDIO_ZEROPAGE works on this backend
+  bool registered;
+  volatile bool stop;
+  pthread_t fault_tid;
+  pthread_t prefetch_tid;
+  struct timespec start;
+};
+
+int uffd_ram_init(struct uffd_ram *r, struct guest_mem *mem, size_t image_size,
+                  int fd, off_t offset);
+void uffd_ram_exit(struct uffd_ram *r);
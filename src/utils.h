@@ -18,6 +18,7 @@ struct fifo {
 
 #define fifo_is_empty(fifo) ((fifo)->head == (fifo)->tail)
 #define fifo_is_full(fifo) ((fifo)->tail - (fifo)->head > FIFO_MASK)
+#define fifo_len(fifo) ((fifo)->tail - (fifo)->head)
 
 // Add a new value to  the queue
 #define fifo_put(fifo, value)                               \
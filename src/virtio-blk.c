@@ -0,0 +1,553 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/kvm.h>
+#include <linux/virtio_blk.h>
+#include <linux/virtio_ring.h>
+#include <poll.h>
+#include <sched.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "diskimg.h"
+#include "err.h"
+#include "snapshot.h"
+#include "utils.h"
+#include "virtio-blk.h"
+#include "virtio-pci.h"
+#include "virtq.h"
+#include "vm.h"
+
+static struct virtio_blk_queue *virtio_blk_queue(struct virtq *vq) {
+  struct virtio_blk_dev *dev = (struct virtio_blk_dev *)vq->dev;
+
+  return &dev->queues[vq - dev->vq];
+}
+
+static void virtio_blk_kick(struct virtio_blk_queue *q) {
+  uint64_t n = 1;
+
+  if (write(q->ioeventfd, &n, sizeof(n)) < 0)
+    throw_err("Failed to kick the virtio-blk queue");
+}
+
+static void virtio_blk_signal(struct virtio_blk_dev *dev) {
+  uint64_t n = 1;
+
+  __atomic_or_fetch(&dev->virtio_pci_dev.config.isr_cap.isr_status,
+                    VIRTIO_PCI_ISR_QUEUE, __ATOMIC_RELAXED);
+  if (write(dev->irqfd, &n, sizeof(n)) < 0)
+    throw_err("Failed to write the irqfd");
+}
+
+static bool virtio_blk_handle_queue(struct virtio_blk_queue *q);
+
+// virtio_blk_drain returns how many times fd was signalled
+static uint64_t virtio_blk_drain(int fd) {
+  uint64_t n = 0;
+
+  if (fd >= 0 && read(fd, &n, sizeof(n)) < 0) {
+    if (errno != EAGAIN)
+      throw_err("Failed to read a virtio-blk eventfd");
+    n = 0;
+  }
+  return n;
+}
+
+/* virtio_blk_rearm turns the guest kicks back on once the worker has taken
+ * the requests it can. It returns false if more came in meanwhile. A full
+ * queue is woken up by the completions, not by kicks. */
+static bool virtio_blk_rearm(struct virtio_blk_queue *q) {
+  if (!q->nr_free)
+    return true;
+  return !virtq_enable_kicks(q->vq) || q->dev->paused;
+}
+
+// The worker sleeps until the guest kicks the queue or the disk completes
+// a request
+static void *virtio_blk_thread(void *arg) {
+  struct virtio_blk_queue *q = (struct virtio_blk_queue *)arg;
+  struct virtio_blk_dev *dev = q->dev;
+  struct pollfd fds[2] = {
+      {.fd = q->ioeventfd, .events = POLLIN},
+      {.fd = q->ring.event_fd, .events = POLLIN},
+  };
+
+  while (!__atomic_load_n(&dev->stop, __ATOMIC_RELAXED)) {
+    if (poll(fds, 2, -1) < 0 && errno != EINTR)
+      throw_err("Failed to poll the virtio-blk queue");
+    q->kicks += virtio_blk_drain(q->ioeventfd);
+    virtio_blk_drain(q->ring.event_fd);
+
+    pthread_mutex_lock(&q->lock);
+    if (!q->vq->info.enable) {
+      pthread_mutex_unlock(&q->lock);
+      continue;
+    }
+    // the guest need not kick while the worker takes its requests
+    bool used = false;
+    virtq_disable_kicks(q->vq);
+    do
+      used |= virtio_blk_handle_queue(q);
+    while (!virtio_blk_rearm(q));
+    if (used && virtq_need_signal(q->vq)) {
+      virtio_blk_signal(dev);
+      q->irqs++;
+    }
+    pthread_mutex_unlock(&q->lock);
+  }
+  return NULL;
+}
+
+// virtio_blk_wait_idle waits for the requests of the queue still on the disk
+static void virtio_blk_wait_idle(struct virtio_blk_queue *q) {
+  while (q->inflight)
+    pthread_cond_wait(&q->idle, &q->lock);
+}
+
+// Called with the virtio-pci lock held, the queue lock waits for the worker
+// to be done with the ring
+static void virtio_blk_enable_vq(struct virtq *vq) {
+  struct virtio_blk_dev *dev = (struct virtio_blk_dev *)vq->dev;
+  struct virtio_blk_queue *q = virtio_blk_queue(vq);
+  vm_t *v = container_of(dev, vm_t, virtio_blk_dev);
+
+  if (vq->info.enable)
+    return;
+
+  pthread_mutex_lock(&q->lock);
+  if (virtq_map(vq) == 0)
+    vq->info.enable = true;
+  pthread_mutex_unlock(&q->lock);
+  if (!vq->info.enable) {
+    fprintf(stderr, "virtio-blk: queue %ld has no valid rings\n",
+            vq - dev->vq);
+    return;
+  }
+
+  // the driver writes the 16-bit index of the queue it kicks
+  dev->notify_addr = virtio_pci_get_notify_addr(&dev->virtio_pci_dev, vq);
+  vm_ioeventfd_register(v, q->ioeventfd, dev->notify_addr, sizeof(uint16_t),
+                        vq - dev->vq, KVM_IOEVENTFD_FLAG_DATAMATCH);
+}
+
+static void virtio_blk_disable_vq(struct virtq *vq) {
+  struct virtio_blk_dev *dev = (struct virtio_blk_dev *)vq->dev;
+  struct virtio_blk_queue *q = virtio_blk_queue(vq);
+  vm_t *v = container_of(dev, vm_t, virtio_blk_dev);
+
+  if (!vq->info.enable)
+    return;
+
+  // requests still on the disk complete into the rings before they go
+  pthread_mutex_lock(&q->lock);
+  virtio_blk_wait_idle(q);
+  vq->info.enable = false;
+  pthread_mutex_unlock(&q->lock);
+  vm_ioeventfd_register(v, q->ioeventfd, dev->notify_addr, sizeof(uint16_t),
+                        vq - dev->vq,
+                        KVM_IOEVENTFD_FLAG_DATAMATCH |
+                            KVM_IOEVENTFD_FLAG_DEASSIGN);
+}
+
+// virtio_blk_map translates a guest buffer, it has to be in one piece of RAM
+static void *virtio_blk_map(vm_t *v, uint64_t addr, uint32_t len) {
+  uint8_t *start = vm_guest_to_host(v, (void *)addr);
+  uint8_t *end = vm_guest_to_host(v, (void *)(addr + len - 1));
+
+  if (!len || !start || end != start + len - 1)
+    return NULL;
+  return start;
+}
+
+static void virtio_blk_complete(struct virtio_blk_queue *q,
+                                struct virtio_blk_req *req, uint8_t status) {
+  uint32_t len = 0;
+
+  if (req->status) {
+    *req->status = status;
+    len = 1;
+    if (req->type == VIRTIO_BLK_T_IN && status == VIRTIO_BLK_S_OK)
+      len += req->data_len;
+  }
+  virtq_push_used(q->vq, req->id, len, req->num);
+  q->free[q->nr_free++] = req - q->reqs;
+}
+
+/* virtio_blk_parse takes the descriptor chain of a request: the header, the
+ * data buffers and the status byte. It returns the status the request
+ * fails with, or VIRTIO_BLK_S_OK if it is to be started. */
+static uint8_t virtio_blk_parse(struct virtio_blk_queue *q,
+                                struct virtq_buf *buf,
+                                struct virtio_blk_req *req) {
+  vm_t *v = container_of(q->dev, vm_t, virtio_blk_dev);
+  struct virtq_desc descs[VIRTIO_BLK_SEG_MAX + 2];
+  struct virtq_desc desc;
+  struct virtio_blk_outhdr *hdr = NULL;
+  int nr = 0;
+  bool bad = false;
+
+  // the whole chain is taken off the ring, even a malformed one
+  while (virtq_buf_next(q->vq, buf, &desc)) {
+    if (nr < VIRTIO_BLK_SEG_MAX + 2)
+      descs[nr++] = desc;
+    else
+      bad = true;
+  }
+  req->id = buf->id;
+  req->num = buf->num;
+  bad |= buf->bad;
+
+  req->type = VIRTIO_BLK_T_GET_ID; // until the header is read
+  req->iovcnt = 0;
+  req->data_len = 0;
+  req->status = NULL;
+  if (nr < 2)
+    return VIRTIO_BLK_S_IOERR;
+  if (descs[nr - 1].flags & VRING_DESC_F_WRITE)
+    req->status = virtio_blk_map(v, descs[nr - 1].addr, 1);
+  if (descs[0].len >= sizeof(*hdr))
+    hdr = virtio_blk_map(v, descs[0].addr, sizeof(*hdr));
+  if (!hdr || !req->status)
+    return VIRTIO_BLK_S_IOERR;
+
+  req->type = hdr->type;
+  req->sector = hdr->sector;
+  if (req->type != VIRTIO_BLK_T_IN && req->type != VIRTIO_BLK_T_OUT)
+    return VIRTIO_BLK_S_UNSUPP;
+
+  // buffers that follow each other in host memory are merged
+  bool write = req->type == VIRTIO_BLK_T_IN;
+  for (int i = 1; i < nr - 1; i++) {
+    uint8_t *data = virtio_blk_map(v, descs[i].addr, descs[i].len);
+    struct iovec *prev = req->iovcnt ? &req->iov[req->iovcnt - 1] : NULL;
+
+    bad |= !data || !!(descs[i].flags & VRING_DESC_F_WRITE) != write;
+    if (prev && (uint8_t *)prev->iov_base + prev->iov_len == data)
+      prev->iov_len += descs[i].len;
+    else
+      req->iov[req->iovcnt++] = (struct iovec){data, descs[i].len};
+    req->data_len += descs[i].len;
+  }
+  if (bad || !req->iovcnt || req->sector > q->dev->config.capacity ||
+      (req->sector << 9) + req->data_len > q->dev->diskimg->size)
+    return VIRTIO_BLK_S_IOERR;
+  return VIRTIO_BLK_S_OK;
+}
+
+// virtio_blk_finish completes requests that were on the disk
+static void virtio_blk_finish(struct virtio_blk_queue *q,
+                              struct diskimg_completion *done, int n) {
+  for (int i = 0; i < n; i++) {
+    struct virtio_blk_req *req = &q->reqs[done[i].tag];
+    virtio_blk_complete(q, req,
+                        done[i].res == (int64_t)req->data_len
+                            ? VIRTIO_BLK_S_OK
+                            : VIRTIO_BLK_S_IOERR);
+    q->inflight--;
+  }
+}
+
+static bool virtio_blk_reap(struct virtio_blk_queue *q) {
+  struct diskimg_completion done[VIRTQ_SIZE];
+  bool used = false;
+  int n;
+
+  do {
+    n = diskimg_ring_reap(&q->ring, done, VIRTQ_SIZE);
+    virtio_blk_finish(q, done, n);
+    used |= n > 0;
+  } while (n == VIRTQ_SIZE);
+  return used;
+}
+
+#define VIRTIO_BLK_SUBMIT_TRIES 3
+
+/* virtio_blk_submit starts the queued requests. A kernel short of resources
+ * is tried again once requests on the disk completed, or a few times if none
+ * are. What it does not take fails: the guest is not left waiting for it. */
+static bool virtio_blk_submit(struct virtio_blk_queue *q) {
+  struct diskimg_completion done[VIRTQ_SIZE];
+  bool used = false;
+  int tries = 0;
+
+  while (q->ring.queued && diskimg_ring_submit(&q->ring) < 0) {
+    int err = errno;
+
+    if (err == EAGAIN || err == EBUSY) {
+      // inflight counts the queued requests too
+      if (q->inflight > q->ring.queued && diskimg_ring_wait(&q->ring) == 0) {
+        used |= virtio_blk_reap(q);
+        continue;
+      }
+      if (++tries < VIRTIO_BLK_SUBMIT_TRIES) {
+        sched_yield();
+        continue;
+      }
+    }
+    fprintf(stderr, "virtio-blk: failed to submit %u requests: %s\n",
+            q->ring.queued, strerror(err));
+    virtio_blk_finish(q, done, diskimg_ring_cancel(&q->ring, done));
+    used = true;
+  }
+  return used;
+}
+
+/* virtio_blk_handle_queue completes what the disk is done with, then starts
+ * the requests in the ring with one submission. It tells whether any
+ * request completed. Called by the worker of the queue with its lock held. */
+static bool virtio_blk_handle_queue(struct virtio_blk_queue *q) {
+  struct virtio_blk_dev *dev = q->dev;
+  struct virtq *vq = q->vq;
+  bool used = virtio_blk_reap(q);
+
+  // a request holds a slot from the ring until it completes
+  while (!dev->paused && vq->info.enable && q->nr_free) {
+    struct virtq_buf buf;
+    if (!virtq_get_buf(vq, &buf))
+      break;
+
+    uint16_t slot = q->free[--q->nr_free];
+    struct virtio_blk_req *req = &q->reqs[slot];
+    uint8_t status = virtio_blk_parse(q, &buf, req);
+    if (status != VIRTIO_BLK_S_OK) {
+      virtio_blk_complete(q, req, status);
+      used = true;
+      continue;
+    }
+
+    struct diskimg_completion sync;
+    int ret = diskimg_ring_queue(&q->ring, dev->diskimg,
+                                 req->type == VIRTIO_BLK_T_OUT, req->iov,
+                                 req->iovcnt, req->sector << 9, slot, &sync);
+    if (ret > 0) {
+      q->inflight++;
+      continue;
+    }
+    virtio_blk_complete(q, req,
+                        ret == 0 && sync.res == (int64_t)req->data_len
+                            ? VIRTIO_BLK_S_OK
+                            : VIRTIO_BLK_S_IOERR);
+    used = true;
+  }
+
+  used |= virtio_blk_submit(q);
+  if (!q->inflight)
+    pthread_cond_broadcast(&q->idle);
+  return used;
+}
+
+// A kick that missed the ioeventfd, an access of another size, is passed on
+// to the worker of the queue
+static void virtio_blk_complete_request(struct virtq *vq) {
+  virtio_blk_kick(virtio_blk_queue(vq));
+}
+
+// used buffers are signalled by the workers
+static void virtio_blk_notify_used(struct virtq *vq) {}
+
+static struct virtq_ops ops = {
+    .enable_vq = virtio_blk_enable_vq,
+    .disable_vq = virtio_blk_disable_vq,
+    .complete_request = virtio_blk_complete_request,
+    .notify_used = virtio_blk_notify_used,
+};
+
+static int virtio_blk_setup(struct virtio_blk_dev *dev,
+                            struct diskimg *diskimg, int num_queues,
+                            const int *cpus, int nr_cpus) {
+  vm_t *v = container_of(dev, vm_t, virtio_blk_dev);
+
+  dev->enable = true;
+  /* FIXME: irq_num should be different to other devs */
+  dev->irq_num = 15;
+  dev->diskimg = diskimg;
+  dev->num_queues = num_queues;
+  dev->config.capacity = diskimg->size >> 9;
+  dev->config.num_queues = num_queues;
+  dev->config.seg_max = VIRTIO_BLK_SEG_MAX;
+  dev->config.size_max = VIRTIO_BLK_SIZE_MAX;
+  // with O_DIRECT smaller I/O would have to be read-modify-written
+  dev->config.blk_size = diskimg->direct ? diskimg->io_align : 512;
+  dev->irqfd = eventfd(0, EFD_CLOEXEC);
+  if (dev->irqfd < 0)
+    return throw_err("Failed to create the virtio-blk irqfd");
+  vm_irqfd_register(v, dev->irqfd, dev->irq_num, 0);
+  for (int i = 0; i < num_queues; i++) {
+    struct virtio_blk_queue *q = &dev->queues[i];
+
+    virtq_init(&dev->vq[i], v, dev, &ops);
+    q->dev = dev;
+    q->vq = &dev->vq[i];
+    q->cpu = nr_cpus ? cpus[i % nr_cpus] : -1;
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->idle, NULL);
+    q->ioeventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (q->ioeventfd < 0)
+      return throw_err("Failed to create the virtio-blk ioeventfd");
+    for (int j = 0; j < VIRTQ_SIZE; j++)
+      q->free[q->nr_free++] = j;
+    if (diskimg_ring_init(&q->ring, diskimg, VIRTQ_SIZE) < 0)
+      return throw_err("Failed to allocate the virtio-blk bounce buffers");
+    if (q->ring.fd < 0 && !i)
+      fprintf(stderr, "virtio-blk: no io_uring, the disk is accessed "
+                      "synchronously\n");
+  }
+  return 0;
+}
+
+static int virtio_blk_start_queue(struct virtio_blk_queue *q) {
+  if (pthread_create(&q->thread, NULL, virtio_blk_thread, q))
+    return throw_err("Failed to create the virtio-blk thread");
+  if (q->cpu >= 0) {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(q->cpu, &set);
+    if (pthread_setaffinity_np(q->thread, sizeof(set), &set))
+      fprintf(stderr, "virtio-blk: cannot pin queue %ld to CPU %d\n",
+              q->vq - q->dev->vq, q->cpu);
+  }
+  return 0;
+}
+
+int virtio_blk_init_pci(struct virtio_blk_dev *virtio_blk_dev,
+                        struct diskimg *diskimg, struct pci *pci,
+                        struct bus *io_bus, struct bus *mmio_bus,
+                        int num_queues, const int *cpus, int nr_cpus) {
+  struct virtio_pci_dev *dev = &virtio_blk_dev->virtio_pci_dev;
+  /* Initialize the device based on PCI */
+  if (virtio_blk_setup(virtio_blk_dev, diskimg, num_queues, cpus, nr_cpus) < 0)
+    return -1;
+  virtio_pci_init(dev, pci, io_bus, mmio_bus);
+  virtio_pci_set_dev_cfg(dev, &virtio_blk_dev->config,
+                         sizeof(virtio_blk_dev->config));
+  virtio_pci_set_pci_hdr(dev, VIRTIO_PCI_DEVICE_ID_BLK, VIRTIO_BLK_PCI_CLASS,
+                         virtio_blk_dev->irq_num);
+  virtio_pci_set_virtq(dev, virtio_blk_dev->vq, num_queues);
+  // without them a Linux guest sends one data buffer per request, with
+  // indirect tables a request takes one descriptor of the ring
+  virtio_pci_add_feature(dev, (1ULL << VIRTIO_BLK_F_SEG_MAX) |
+                                  (1ULL << VIRTIO_BLK_F_SIZE_MAX) |
+                                  (1ULL << VIRTIO_RING_F_INDIRECT_DESC));
+  if (num_queues > 1)
+    virtio_pci_add_feature(dev, 1ULL << VIRTIO_BLK_F_MQ);
+  if (diskimg->direct)
+    virtio_pci_add_feature(dev, 1ULL << VIRTIO_BLK_F_BLK_SIZE);
+  virtio_pci_enable(dev);
+  for (int i = 0; i < num_queues; i++) {
+    if (virtio_blk_start_queue(&virtio_blk_dev->queues[i]) < 0)
+      return -1;
+  }
+  return 0;
+}
+
+// Requests are started under the lock of their queue, once the flag is set
+// under all of them none is until virtio_blk_resume. Those on the disk are
+// waited for.
+static void virtio_blk_set_paused(struct virtio_blk_dev *dev, bool paused) {
+  for (int i = 0; i < dev->num_queues; i++)
+    pthread_mutex_lock(&dev->queues[i].lock);
+  dev->paused = paused;
+  for (int i = dev->num_queues - 1; i >= 0; i--)
+    pthread_mutex_unlock(&dev->queues[i].lock);
+}
+
+void virtio_blk_pause(struct virtio_blk_dev *dev) {
+  if (!dev->enable)
+    return;
+  virtio_blk_set_paused(dev, true);
+  for (int i = 0; i < dev->num_queues; i++) {
+    pthread_mutex_lock(&dev->queues[i].lock);
+    virtio_blk_wait_idle(&dev->queues[i]);
+    pthread_mutex_unlock(&dev->queues[i].lock);
+  }
+}
+
+// Kicks received while paused were dropped, check the rings once instead
+void virtio_blk_resume(struct virtio_blk_dev *dev) {
+  if (!dev->enable)
+    return;
+  virtio_blk_set_paused(dev, false);
+  for (int i = 0; i < dev->num_queues; i++)
+    virtio_blk_kick(&dev->queues[i]);
+}
+
+struct virtio_blk_state {
+  uint8_t enable;
+  uint8_t num_queues;
+};
+
+int virtio_blk_save(struct virtio_blk_dev *dev, struct snapshot *snap) {
+  struct virtio_blk_state st = {
+      .enable = dev->enable,
+      .num_queues = dev->num_queues,
+  };
+
+  if (snapshot_put(snap, SNAP_VIRTIO_BLK, &st, sizeof(st)) < 0)
+    return -1;
+
+  return st.enable ? virtio_pci_save(&dev->virtio_pci_dev, snap) : 0;
+}
+
+// The disk content is not part of the snapshot, the same image must be
+// attached on restore and must not have changed in between.
+int virtio_blk_restore(struct virtio_blk_dev *dev, struct snapshot *snap) {
+  struct virtio_blk_state st;
+
+  if (snapshot_get(snap, SNAP_VIRTIO_BLK, &st, sizeof(st)) < 0)
+    return -1;
+  if (st.enable != dev->enable) {
+    fprintf(stderr, "Snapshot: the guest was saved %s a disk attached\n",
+            st.enable ? "with" : "without");
+    return -1;
+  }
+  if (!st.enable)
+    return 0;
+  if (st.num_queues != dev->num_queues) {
+    fprintf(stderr, "Snapshot: the guest was saved with %d disk queues\n",
+            st.num_queues);
+    return -1;
+  }
+
+  if (virtio_pci_restore(&dev->virtio_pci_dev, snap) < 0)
+    return -1;
+
+  // pick up requests the guest queued after the last handled kick
+  virtio_blk_resume(dev);
+  return 0;
+}
+
+// virtio_blk_reset is called on reboot, with the vcpus stopped
+void virtio_blk_reset(struct virtio_blk_dev *dev) {
+  if (!dev->enable)
+    return;
+  virtio_pci_hard_reset(&dev->virtio_pci_dev);
+  virtio_blk_set_paused(dev, false);
+}
+
+void virtio_blk_init(struct virtio_blk_dev *dev) {
+  memset(dev, 0x00, sizeof(struct virtio_blk_dev));
+}
+
+void virtio_blk_exit(struct virtio_blk_dev *dev) {
+  if (!dev->enable)
+    return;
+  __atomic_store_n(&dev->stop, true, __ATOMIC_RELAXED);
+  for (int i = 0; i < dev->num_queues; i++) {
+    struct virtio_blk_queue *q = &dev->queues[i];
+    uint64_t n = 1;
+    // wake up the worker blocked on the ioeventfd
+    if (q->thread && write(q->ioeventfd, &n, sizeof(n)) == sizeof(n))
+      pthread_join(q->thread, NULL);
+    diskimg_ring_exit(&q->ring);
+    close(q->ioeventfd);
+  }
+  diskimg_exit(dev->diskimg);
+  virtio_pci_exit(&dev->virtio_pci_dev);
+  close(dev->irqfd);
+}
@@ -4,39 +4,78 @@
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <sys/uio.h>
 
 #include "diskimg.h"
 #include "pci.h"
 #include "virtio-pci.h"
 #include "virtq.h"
 
-#define VIRTIO_BLK_VIRTQ_NUM 1
+#define VIRTIO_BLK_MAX_QUEUES 16
 #define VIRTIO_BLK_PCI_CLASS 0x018000
 
+// data buffers in a request, the header and status take the rest of a ring
+#define VIRTIO_BLK_SEG_MAX (VIRTQ_SIZE - 2)
+#define VIRTIO_BLK_SIZE_MAX (1 << 20) // bytes in one data buffer
+
+// A request from the time it is taken off the ring until it completes
 struct virtio_blk_req {
+  uint16_t id;  // buffer id, handed back in the used element
+  uint16_t num; // descriptors in the chain
   uint32_t type;
-  uint32_t reserved;
   uint64_t sector;
-  uint8_t *data;
-  uint16_t data_size;
+  struct iovec iov[VIRTIO_BLK_SEG_MAX]; // guest memory
+  int iovcnt;
+  size_t data_len;
   uint8_t *status;
 };
 
+struct virtio_blk_dev;
+
+/* A request queue and the thread serving it. The guest kicks every queue at
+ * the same notify address, KVM tells them apart by the queue index written
+ * and signals the ioeventfd of that queue only. */
+struct virtio_blk_queue {
+  struct virtio_blk_dev *dev;
+  struct virtq *vq;
+  int ioeventfd;
+  pthread_mutex_t lock; // the ring, held by the worker while it drains it
+  pthread_t thread;
+  int cpu; // host CPU the worker is pinned to, -1 for none
+  struct diskimg_ring ring;
+  struct virtio_blk_req reqs[VIRTQ_SIZE];
+  uint16_t free[VIRTQ_SIZE]; // unused reqs
+  int nr_free;
+  int inflight;        // requests on the disk
+  pthread_cond_t idle; // inflight dropped to 0
+  // written by the worker only, for --exit-stats
+  uint64_t kicks; // guest notifications through the ioeventfd
+  uint64_t irqs;  // interrupts raised through the irqfd
+};
+
 struct virtio_blk_dev {
   struct virtio_pci_dev virtio_pci_dev;
   struct virtio_blk_config config;
-  struct virtq vq[VIRTIO_BLK_VIRTQ_NUM];
-  int irqfd;
-  int ioeventfd;
+  struct virtq vq[VIRTIO_BLK_MAX_QUEUES];
+  struct virtio_blk_queue queues[VIRTIO_BLK_MAX_QUEUES];
+  int num_queues;
+  int irqfd; // shared by the queues, the device has a single INTx line
+  uint64_t notify_addr; // where the ioeventfds are registered
   int irq_num;
-  pthread_t vq_avail_thread;
-  pthread_t worker_thread;
   struct diskimg *diskimg;
   bool enable;
+  bool stop;
+  bool paused; // requests wait in the rings until virtio_blk_resume
 };
 
 void virtio_blk_init(struct virtio_blk_dev *virtio_blk_dev);
 void virtio_blk_exit(struct virtio_blk_dev *dev);
-void virtio_blk_init_pci(struct virtio_blk_dev *dev, struct diskimg *diskimg,
-                         struct pci *pci, struct bus *io_bus,
-                         struct bus *mmio_bus);
+void virtio_blk_pause(struct virtio_blk_dev *dev);
+void virtio_blk_resume(struct virtio_blk_dev *dev);
+void virtio_blk_reset(struct virtio_blk_dev *dev);
+int virtio_blk_save(struct virtio_blk_dev *dev, struct snapshot *snap);
+int virtio_blk_restore(struct virtio_blk_dev *dev, struct snapshot *snap);
+int virtio_blk_init_pci(struct virtio_blk_dev *dev, struct diskimg *diskimg,
+                        struct pci *pci, struct bus *io_bus,
+                        struct bus *mmio_bus, int num_queues, const int *cpus,
+                        int nr_cpus);
@@ -0,0 +1,848 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/kvm.h>
+#include <linux/virtio_console.h>
+#include <linux/virtio_ring.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "err.h"
+#include "snapshot.h"
+#include "utils.h"
+#include "virtio-console.h"
+#include "virtio-pci.h"
+#include "virtq.h"
+#include "vm.h"
+
+// Queue layout with VIRTIO_CONSOLE_F_MULTIPORT: port 0 uses queues 0 and 1,
+// the control queues follow, then two queues for every further port
+#define VIRTIO_CONSOLE_CTRL_RX 2
+#define VIRTIO_CONSOLE_CTRL_TX 3
+#define VIRTIO_CONSOLE_POLL_FDS (1 + 2 * VIRTIO_CONSOLE_MAX_PORTS)
+
+// A buffer taken off a queue, as the host sees it
+struct virtio_console_buf {
+  uint16_t id;
+  uint16_t num; // descriptors
+  struct iovec iov[VIRTIO_CONSOLE_MAX_SEGS];
+  int iovcnt;
+  size_t len;
+  // where the buffer was in the ring, to give it back
+  uint16_t avail_idx;
+  bool wrap_count;
+};
+
+static int virtio_console_rx_vq(uint32_t id) { return id ? (id + 1) * 2 : 0; }
+
+static bool virtio_console_multiport(struct virtio_console_dev *dev) {
+  return dev->virtio_pci_dev.guest_feature &
+         (1ULL << VIRTIO_CONSOLE_F_MULTIPORT);
+}
+
+// Port 0 is the console, hvc0 in a Linux guest
+static bool virtio_console_is_console(struct virtio_console_port *port) {
+  return port->id == 0;
+}
+
+static void virtio_console_kick(struct virtio_console_dev *dev) {
+  uint64_t n = 1;
+
+  if (write(dev->ioeventfd, &n, sizeof(n)) < 0)
+    throw_err("Failed to kick the virtio-console thread");
+}
+
+// virtio_console_map translates a guest buffer, it has to be in one piece of
+// RAM
+static void *virtio_console_map(vm_t *v, uint64_t addr, uint32_t len) {
+  uint8_t *start = vm_guest_to_host(v, (void *)addr);
+  uint8_t *end = vm_guest_to_host(v, (void *)(addr + len - 1));
+
+  if (!start || end != start + len - 1)
+    return NULL;
+  return start;
+}
+
+// virtio_console_get_buf takes the next available buffer off vq. A buffer
+// outside of RAM, in the wrong direction or with too many descriptors is
+// handed back used and empty, the next one is tried.
+static bool virtio_console_get_buf(struct virtio_console_dev *dev,
+                                   struct virtq *vq,
+                                   struct virtio_console_buf *buf,
+                                   bool writable, uint32_t *used) {
+  vm_t *v = container_of(dev, vm_t, virtio_console_dev);
+  struct virtq_desc desc;
+  struct virtq_buf vbuf;
+
+  for (;;) {
+    buf->avail_idx = vq->next_avail_idx;
+    buf->wrap_count = vq->used_wrap_count;
+    if (!virtq_get_buf(vq, &vbuf))
+      return false;
+
+    bool bad = false;
+    buf->iovcnt = 0;
+    buf->len = 0;
+    while (virtq_buf_next(vq, &vbuf, &desc)) {
+      bool is_write = desc.flags & VRING_DESC_F_WRITE;
+      void *addr;
+
+      if (!desc.len)
+        continue;
+      addr = virtio_console_map(v, desc.addr, desc.len);
+      if (!addr || is_write != writable ||
+          buf->iovcnt == VIRTIO_CONSOLE_MAX_SEGS) {
+        bad = true;
+        continue;
+      }
+      buf->iov[buf->iovcnt++] = (struct iovec){addr, desc.len};
+      buf->len += desc.len;
+    }
+    buf->id = vbuf.id;
+    buf->num = vbuf.num;
+    if (!(bad || vbuf.bad))
+      return true;
+
+    virtq_push_used(vq, buf->id, 0, buf->num);
+    *used |= 1U << (vq - dev->vq);
+  }
+}
+
+// virtio_console_put_buf hands a buffer back to the ring untouched, it is
+// taken again on the next attempt
+static void virtio_console_put_buf(struct virtq *vq,
+                                   struct virtio_console_buf *buf) {
+  vq->next_avail_idx = buf->avail_idx;
+  vq->used_wrap_count = buf->wrap_count;
+}
+
+static void virtio_console_push_used(struct virtio_console_dev *dev,
+                                     struct virtq *vq,
+                                     struct virtio_console_buf *buf,
+                                     uint32_t len, uint32_t *used) {
+  virtq_push_used(vq, buf->id, len, buf->num);
+  *used |= 1U << (vq - dev->vq);
+}
+
+static size_t virtio_console_copy_to(struct virtio_console_buf *buf,
+                                     size_t off, const void *data,
+                                     size_t len) {
+  size_t done = 0;
+
+  for (int i = 0; i < buf->iovcnt && done < len; i++) {
+    if (off >= buf->iov[i].iov_len) {
+      off -= buf->iov[i].iov_len;
+      continue;
+    }
+    size_t n = buf->iov[i].iov_len - off;
+    if (n > len - done)
+      n = len - done;
+    memcpy((uint8_t *)buf->iov[i].iov_base + off, (uint8_t *)data + done, n);
+    done += n;
+    off = 0;
+  }
+  return done;
+}
+
+static size_t virtio_console_copy_from(struct virtio_console_buf *buf,
+                                       void *data, size_t len) {
+  size_t done = 0;
+
+  for (int i = 0; i < buf->iovcnt && done < len; i++) {
+    size_t n = buf->iov[i].iov_len;
+    if (n > len - done)
+      n = len - done;
+    memcpy((uint8_t *)data + done, buf->iov[i].iov_base, n);
+    done += n;
+  }
+  return done;
+}
+
+static void virtio_console_notify(struct virtio_console_dev *dev,
+                                  uint32_t used) {
+  bool irq = false;
+
+  for (int i = 0; i < VIRTIO_CONSOLE_VIRTQ_NUM; i++) {
+    if ((used & (1U << i)) && virtq_need_signal(&dev->vq[i]))
+      irq = true;
+  }
+  if (!irq)
+    return;
+
+  uint64_t n = 1;
+  dev->virtio_pci_dev.config.isr_cap.isr_status |= VIRTIO_PCI_ISR_QUEUE;
+  if (write(dev->irqfd, &n, sizeof(n)) < 0)
+    throw_err("Failed to write the irqfd");
+}
+
+// Control messages wait here until the driver posts a buffer for them
+static void virtio_console_ctrl_send(struct virtio_console_dev *dev,
+                                     uint32_t id, uint16_t event,
+                                     uint16_t value) {
+  if (!virtio_console_multiport(dev))
+    return;
+  if (dev->ctrl_tail - dev->ctrl_head == VIRTIO_CONSOLE_CTRL_PENDING) {
+    fprintf(stderr, "virtio-console: control queue full, event %u lost\n",
+            event);
+    return;
+  }
+  dev->ctrl[dev->ctrl_tail++ % VIRTIO_CONSOLE_CTRL_PENDING] =
+      (struct virtio_console_control){.id = id, .event = event, .value = value};
+}
+
+static void virtio_console_ctrl_flush(struct virtio_console_dev *dev,
+                                      uint32_t *used) {
+  struct virtq *vq = &dev->vq[VIRTIO_CONSOLE_CTRL_RX];
+  struct virtio_console_buf buf;
+
+  if (!vq->info.enable)
+    return;
+  while (dev->ctrl_head != dev->ctrl_tail &&
+         virtio_console_get_buf(dev, vq, &buf, true, used)) {
+    struct virtio_console_control *ctrl =
+        &dev->ctrl[dev->ctrl_head++ % VIRTIO_CONSOLE_CTRL_PENDING];
+    size_t len = virtio_console_copy_to(&buf, 0, ctrl, sizeof(*ctrl));
+
+    // the name follows the message, without a terminator
+    if (ctrl->event == VIRTIO_CONSOLE_PORT_NAME) {
+      const char *name = dev->ports[ctrl->id].name;
+      len += virtio_console_copy_to(&buf, len, name, strlen(name));
+    }
+    virtio_console_push_used(dev, vq, &buf, len, used);
+  }
+}
+
+static void virtio_console_ctrl_recv(struct virtio_console_dev *dev,
+                                     struct virtio_console_control *ctrl) {
+  struct virtio_console_port *port =
+      ctrl->id < (uint32_t)dev->nr_ports ? &dev->ports[ctrl->id] : NULL;
+
+  switch (ctrl->event) {
+  case VIRTIO_CONSOLE_DEVICE_READY:
+    if (ctrl->value != 1)
+      break;
+    for (int i = 0; i < dev->nr_ports; i++)
+      virtio_console_ctrl_send(dev, i, VIRTIO_CONSOLE_PORT_ADD, 0);
+    break;
+  case VIRTIO_CONSOLE_PORT_READY:
+    if (!port || ctrl->value != 1)
+      break;
+    port->guest_ready = true;
+    if (virtio_console_is_console(port))
+      virtio_console_ctrl_send(dev, port->id, VIRTIO_CONSOLE_CONSOLE_PORT, 1);
+    if (port->name)
+      virtio_console_ctrl_send(dev, port->id, VIRTIO_CONSOLE_PORT_NAME, 1);
+    if (port->fd >= 0)
+      virtio_console_ctrl_send(dev, port->id, VIRTIO_CONSOLE_PORT_OPEN, 1);
+    break;
+  case VIRTIO_CONSOLE_PORT_OPEN:
+    if (port)
+      port->guest_open = ctrl->value;
+    break;
+  default:
+    break;
+  }
+}
+
+static void virtio_console_ctrl_handle(struct virtio_console_dev *dev,
+                                       uint32_t *used) {
+  struct virtq *vq = &dev->vq[VIRTIO_CONSOLE_CTRL_TX];
+  struct virtio_console_buf buf;
+
+  if (!vq->info.enable)
+    return;
+  while (virtio_console_get_buf(dev, vq, &buf, false, used)) {
+    struct virtio_console_control ctrl;
+    if (virtio_console_copy_from(&buf, &ctrl, sizeof(ctrl)) == sizeof(ctrl))
+      virtio_console_ctrl_recv(dev, &ctrl);
+    virtio_console_push_used(dev, vq, &buf, 0, used);
+  }
+}
+
+static void virtio_console_disconnect(struct virtio_console_dev *dev,
+                                      struct virtio_console_port *port) {
+  close(port->fd);
+  port->fd = -1;
+  port->tx_blocked = false;
+  port->rx_ready = false;
+  port->tx_done = 0;
+  if (port->guest_ready)
+    virtio_console_ctrl_send(dev, port->id, VIRTIO_CONSOLE_PORT_OPEN, 0);
+}
+
+static void virtio_console_accept(struct virtio_console_dev *dev,
+                                  struct virtio_console_port *port) {
+  int fd = accept4(port->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+  if (fd < 0)
+    return;
+  if (port->fd >= 0) {
+    close(fd);
+    return;
+  }
+  port->fd = fd;
+  if (port->guest_ready)
+    virtio_console_ctrl_send(dev, port->id, VIRTIO_CONSOLE_PORT_OPEN, 1);
+}
+
+// virtio_console_write writes what is left of buf to the backend, it returns
+// the bytes written or -1 if the backend cannot take any right now
+static ssize_t virtio_console_write(struct virtio_console_dev *dev,
+                                    struct virtio_console_port *port,
+                                    struct virtio_console_buf *buf) {
+  struct iovec iov[VIRTIO_CONSOLE_MAX_SEGS];
+  size_t skip = port->tx_done;
+  int iovcnt = 0;
+
+  // nobody is listening, the output is lost
+  if (port->fd < 0)
+    return buf->len - port->tx_done;
+
+  for (int i = 0; i < buf->iovcnt; i++) {
+    if (skip >= buf->iov[i].iov_len) {
+      skip -= buf->iov[i].iov_len;
+      continue;
+    }
+    iov[iovcnt++] = (struct iovec){(uint8_t *)buf->iov[i].iov_base + skip,
+                                   buf->iov[i].iov_len - skip};
+    skip = 0;
+  }
+  if (!iovcnt)
+    return 0;
+
+  ssize_t n;
+  if (port->backend == VIRTIO_CONSOLE_UNIX) {
+    // a client hanging up is no SIGPIPE
+    struct msghdr msg = {.msg_iov = iov, .msg_iovlen = iovcnt};
+    n = sendmsg(port->fd, &msg, MSG_NOSIGNAL);
+  } else {
+    n = writev(port->fd, iov, iovcnt);
+  }
+  if (n >= 0)
+    return n;
+  if (errno == EAGAIN || errno == EINTR)
+    return -1;
+
+  // the reader went away, its output is lost
+  if (port->backend == VIRTIO_CONSOLE_UNIX)
+    virtio_console_disconnect(dev, port);
+  return buf->len - port->tx_done;
+}
+
+/* Guest output goes to the backend a whole buffer at a time. A full backend
+ * leaves the buffer in the ring until it takes more, so a slow reader slows
+ * the writer in the guest down, except on the console: a Linux guest spins
+ * until its console output is consumed, that output is dropped instead. */
+static void virtio_console_tx(struct virtio_console_dev *dev,
+                              struct virtio_console_port *port,
+                              uint32_t *used) {
+  struct virtq *vq = port->tx;
+  struct virtio_console_buf buf;
+
+  if (!vq->info.enable || port->tx_blocked)
+    return;
+  while (virtio_console_get_buf(dev, vq, &buf, false, used)) {
+    ssize_t n = virtio_console_write(dev, port, &buf);
+
+    if (n >= 0)
+      port->tx_done += n;
+    if (port->tx_done < buf.len && !virtio_console_is_console(port)) {
+      virtio_console_put_buf(vq, &buf);
+      port->tx_blocked = true;
+      return;
+    }
+    port->tx_done = 0;
+    virtio_console_push_used(dev, vq, &buf, 0, used);
+  }
+}
+
+static void virtio_console_rx(struct virtio_console_dev *dev,
+                              struct virtio_console_port *port,
+                              uint32_t *used) {
+  struct virtq *vq = port->rx;
+  struct virtio_console_buf buf;
+
+  if (!vq->info.enable)
+    return;
+  while (port->rx_ready && port->fd >= 0 &&
+         virtio_console_get_buf(dev, vq, &buf, true, used)) {
+    if (!buf.len) {
+      virtio_console_push_used(dev, vq, &buf, 0, used);
+      continue;
+    }
+
+    ssize_t n = readv(port->fd, buf.iov, buf.iovcnt);
+    if (n <= 0) {
+      virtio_console_put_buf(vq, &buf);
+      port->rx_ready = false;
+      if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+        if (port->backend == VIRTIO_CONSOLE_UNIX)
+          virtio_console_disconnect(dev, port);
+      }
+      return;
+    }
+    virtio_console_push_used(dev, vq, &buf, n, used);
+    // a short read drained the backend
+    if ((size_t)n < buf.len)
+      port->rx_ready = false;
+  }
+}
+
+static int virtio_console_active_ports(struct virtio_console_dev *dev) {
+  return virtio_console_multiport(dev) ? dev->nr_ports : 1;
+}
+
+// Called with the virtio-pci lock held
+// virtio_console_rearm_vq asks for the next kick on vq, it tells whether a
+// buffer came in meanwhile that the worker would take right now
+static bool virtio_console_rearm_vq(struct virtq *vq, bool takes) {
+  if (!vq->info.enable)
+    return false;
+  return virtq_enable_kicks(vq) && takes;
+}
+
+/* With VIRTIO_RING_F_EVENT_IDX on a split ring the driver only kicks when it
+ * passes avail_event, which has to follow the buffers taken. Buffers left in
+ * a queue that waits for its backend are picked up by the poll instead. */
+static bool virtio_console_rearm(struct virtio_console_dev *dev) {
+  bool more = false;
+
+  more |= virtio_console_rearm_vq(&dev->vq[VIRTIO_CONSOLE_CTRL_TX], true);
+  more |= virtio_console_rearm_vq(&dev->vq[VIRTIO_CONSOLE_CTRL_RX],
+                                  dev->ctrl_head != dev->ctrl_tail);
+  for (int i = 0; i < virtio_console_active_ports(dev); i++) {
+    struct virtio_console_port *port = &dev->ports[i];
+
+    more |= virtio_console_rearm_vq(port->tx, !port->tx_blocked);
+    more |= virtio_console_rearm_vq(port->rx,
+                                    port->rx_ready && port->fd >= 0);
+  }
+  return more;
+}
+
+static void virtio_console_process(struct virtio_console_dev *dev) {
+  uint32_t used = 0;
+
+  do {
+    virtio_console_ctrl_handle(dev, &used);
+    for (int i = 0; i < virtio_console_active_ports(dev); i++) {
+      virtio_console_tx(dev, &dev->ports[i], &used);
+      virtio_console_rx(dev, &dev->ports[i], &used);
+    }
+    virtio_console_ctrl_flush(dev, &used);
+  } while (virtio_console_rearm(dev));
+  virtio_console_notify(dev, used);
+}
+
+static int virtio_console_pollfds(struct virtio_console_dev *dev,
+                                  struct pollfd *fds,
+                                  struct virtio_console_port **owners) {
+  int nfds = 0;
+
+  fds[nfds++] = (struct pollfd){.fd = dev->ioeventfd, .events = POLLIN};
+  if (dev->paused)
+    return nfds;
+
+  for (int i = 0; i < dev->nr_ports; i++) {
+    struct virtio_console_port *port = &dev->ports[i];
+    short events = 0;
+
+    if (port->listen_fd >= 0 && port->fd < 0) {
+      owners[nfds] = port;
+      fds[nfds++] = (struct pollfd){.fd = port->listen_fd, .events = POLLIN};
+    }
+    if (port->fd < 0)
+      continue;
+    // input is only read when there is a buffer to put it in
+    if (port->backend != VIRTIO_CONSOLE_FILE && !port->rx_ready &&
+        port->rx->info.enable && virtq_has_avail(port->rx))
+      events |= POLLIN;
+    if (port->tx_blocked)
+      events |= POLLOUT;
+    if (events) {
+      owners[nfds] = port;
+      fds[nfds++] = (struct pollfd){.fd = port->fd, .events = events};
+    }
+  }
+  return nfds;
+}
+
+static void *virtio_console_thread(void *arg) {
+  struct virtio_console_dev *dev = (struct virtio_console_dev *)arg;
+  struct pollfd fds[VIRTIO_CONSOLE_POLL_FDS];
+  struct virtio_console_port *owners[VIRTIO_CONSOLE_POLL_FDS];
+
+  pthread_mutex_lock(&dev->virtio_pci_dev.lock);
+  while (!dev->stop) {
+    if (!dev->paused)
+      virtio_console_process(dev);
+    int nfds = virtio_console_pollfds(dev, fds, owners);
+    pthread_mutex_unlock(&dev->virtio_pci_dev.lock);
+
+    int ret = poll(fds, nfds, -1);
+    if (ret < 0 && errno != EINTR)
+      throw_err("Failed to poll the virtio-console backends");
+    uint64_t n;
+    if (ret > 0 && fds[0].revents &&
+        read(dev->ioeventfd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+      throw_err("Failed to read the virtio-console eventfd");
+
+    pthread_mutex_lock(&dev->virtio_pci_dev.lock);
+    for (int i = 1; ret > 0 && i < nfds; i++) {
+      struct virtio_console_port *port = owners[i];
+      if (!fds[i].revents)
+        continue;
+      if (fds[i].fd == port->listen_fd) {
+        virtio_console_accept(dev, port);
+        continue;
+      }
+      if (fds[i].revents & (POLLOUT | POLLERR | POLLHUP))
+        port->tx_blocked = false;
+      if (fds[i].revents & (POLLIN | POLLERR | POLLHUP))
+        port->rx_ready = true;
+    }
+  }
+  pthread_mutex_unlock(&dev->virtio_pci_dev.lock);
+
+  return NULL;
+}
+
+static void virtio_console_enable_vq(struct virtq *vq) {
+  struct virtio_console_dev *dev = (struct virtio_console_dev *)vq->dev;
+  vm_t *v = container_of(dev, vm_t, virtio_console_dev);
+
+  if (vq->info.enable)
+    return;
+
+  if (virtq_map(vq) < 0) {
+    fprintf(stderr, "virtio-console: queue %ld has no valid rings\n",
+            vq - dev->vq);
+    return;
+  }
+  vq->info.enable = true;
+
+  // All queues notify at the same address, the worker looks at all of them
+  // on every kick. Any access size matches, a Linux driver writes 16 bits.
+  if (!dev->nr_enabled++) {
+    dev->notify_addr = virtio_pci_get_notify_addr(&dev->virtio_pci_dev, vq);
+    vm_ioeventfd_register(v, dev->ioeventfd, dev->notify_addr, 0, 0, 0);
+  }
+  virtio_console_kick(dev);
+}
+
+static void virtio_console_disable_vq(struct virtq *vq) {
+  struct virtio_console_dev *dev = (struct virtio_console_dev *)vq->dev;
+  vm_t *v = container_of(dev, vm_t, virtio_console_dev);
+  int idx = vq - dev->vq;
+
+  if (!vq->info.enable)
+    return;
+
+  vq->info.enable = false;
+  if (!--dev->nr_enabled)
+    vm_ioeventfd_register(v, dev->ioeventfd, dev->notify_addr, 0, 0,
+                          KVM_IOEVENTFD_FLAG_DEASSIGN);
+
+  // the driver starts over, so does the port protocol
+  if (idx == VIRTIO_CONSOLE_CTRL_RX) {
+    dev->ctrl_head = dev->ctrl_tail = 0;
+    for (int i = 0; i < dev->nr_ports; i++)
+      dev->ports[i].guest_ready = dev->ports[i].guest_open = false;
+  }
+  for (int i = 0; i < dev->nr_ports; i++) {
+    if (dev->ports[i].tx == vq) {
+      dev->ports[i].tx_done = 0;
+      dev->ports[i].tx_blocked = false;
+    }
+  }
+}
+
+// Kicks reach the worker through the ioeventfd. One that took the slow
+// path through the notify register is passed on.
+static void virtio_console_complete_request(struct virtq *vq) {
+  virtio_console_kick((struct virtio_console_dev *)vq->dev);
+}
+
+// used buffers are signalled by the worker, once per pass
+static void virtio_console_notify_used(struct virtq *vq) {}
+
+static struct virtq_ops ops = {
+    .enable_vq = virtio_console_enable_vq,
+    .disable_vq = virtio_console_disable_vq,
+    .complete_request = virtio_console_complete_request,
+    .notify_used = virtio_console_notify_used,
+};
+
+static int virtio_console_open_unix(struct virtio_console_port *port) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+
+  if (strlen(port->path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "virtio-console: socket path too long: %s\n", port->path);
+    return -1;
+  }
+  strcpy(addr.sun_path, port->path);
+
+  port->listen_fd =
+      socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (port->listen_fd < 0)
+    return throw_err("Failed to create the virtio-console socket");
+  unlink(port->path);
+  if (bind(port->listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(port->listen_fd, 1) < 0)
+    return throw_err("Failed to listen on the virtio-console socket");
+
+  printf("virtio-console: port %u waiting for a connection on %s\n", port->id,
+         port->path);
+  return 0;
+}
+
+static int virtio_console_open_pty(struct virtio_console_port *port) {
+  struct termios tio;
+
+  port->fd = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+  if (port->fd < 0 || grantpt(port->fd) < 0 || unlockpt(port->fd) < 0)
+    return throw_err("Failed to open the virtio-console pty");
+  port->path = strdup(ptsname(port->fd));
+  port->pty_slave_fd = open(port->path, O_RDWR | O_NOCTTY | O_CLOEXEC);
+  if (port->pty_slave_fd < 0)
+    return throw_err("Failed to open the virtio-console pty");
+
+  // raw, the guest does its own line discipline
+  if (tcgetattr(port->pty_slave_fd, &tio) == 0) {
+    cfmakeraw(&tio);
+    tcsetattr(port->pty_slave_fd, TCSANOW, &tio);
+  }
+
+  printf("virtio-console: port %u on %s\n", port->id, port->path);
+  return 0;
+}
+
+// virtio_console_add_port opens a port for spec: file:PATH, unix:PATH or
+// pty, optionally followed by ,name=NAME
+int virtio_console_add_port(struct virtio_console_dev *dev, const char *spec) {
+  if (dev->nr_ports == VIRTIO_CONSOLE_MAX_PORTS) {
+    fprintf(stderr, "virtio-console: at most %d ports\n",
+            VIRTIO_CONSOLE_MAX_PORTS);
+    return -1;
+  }
+
+  struct virtio_console_port *port = &dev->ports[dev->nr_ports];
+  *port = (struct virtio_console_port){
+      .id = dev->nr_ports,
+      .fd = -1,
+      .listen_fd = -1,
+      .pty_slave_fd = -1,
+      .rx = &dev->vq[virtio_console_rx_vq(dev->nr_ports)],
+      .tx = &dev->vq[virtio_console_rx_vq(dev->nr_ports) + 1],
+  };
+  dev->nr_ports++;
+
+  char *backend = strdup(spec);
+  char *name = strstr(backend, ",name=");
+  if (name) {
+    *name = '\0';
+    port->name = strdup(name + strlen(",name="));
+  }
+
+  int ret;
+  if (!strncmp(backend, "file:", 5)) {
+    port->backend = VIRTIO_CONSOLE_FILE;
+    port->path = strdup(backend + 5);
+    port->fd = open(port->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    ret = port->fd < 0 ? throw_err("Failed to open the virtio-console file") : 0;
+  } else if (!strncmp(backend, "unix:", 5)) {
+    port->backend = VIRTIO_CONSOLE_UNIX;
+    port->path = strdup(backend + 5);
+    ret = virtio_console_open_unix(port);
+  } else if (!strcmp(backend, "pty")) {
+    port->backend = VIRTIO_CONSOLE_PTY;
+    ret = virtio_console_open_pty(port);
+  } else {
+    fprintf(stderr, "virtio-console: unknown backend %s\n", backend);
+    ret = -1;
+  }
+  free(backend);
+
+  return ret;
+}
+
+int virtio_console_init_pci(struct virtio_console_dev *virtio_console_dev,
+                            struct pci *pci, struct bus *io_bus,
+                            struct bus *mmio_bus) {
+  struct virtio_pci_dev *dev = &virtio_console_dev->virtio_pci_dev;
+  vm_t *v = container_of(virtio_console_dev, vm_t, virtio_console_dev);
+  int nr_queues = (virtio_console_dev->nr_ports + 1) * 2;
+
+  virtio_console_dev->enable = true;
+  virtio_console_dev->config.max_nr_ports = virtio_console_dev->nr_ports;
+  virtio_console_dev->ioeventfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  virtio_console_dev->irqfd = eventfd(0, EFD_CLOEXEC);
+  if (virtio_console_dev->ioeventfd < 0 || virtio_console_dev->irqfd < 0)
+    return throw_err("Failed to create the virtio-console eventfds");
+  vm_irqfd_register(v, virtio_console_dev->irqfd, VIRTIO_CONSOLE_IRQ, 0);
+  for (int i = 0; i < nr_queues; i++)
+    virtq_init(&virtio_console_dev->vq[i], v, virtio_console_dev, &ops);
+
+  virtio_pci_init(dev, pci, io_bus, mmio_bus);
+  virtio_pci_set_dev_cfg(dev, &virtio_console_dev->config,
+                         sizeof(virtio_console_dev->config));
+  virtio_pci_set_pci_hdr(dev, VIRTIO_PCI_DEVICE_ID_CONSOLE,
+                         VIRTIO_CONSOLE_PCI_CLASS, VIRTIO_CONSOLE_IRQ);
+  virtio_pci_set_virtq(dev, virtio_console_dev->vq, nr_queues);
+  virtio_pci_add_feature(dev, (1ULL << VIRTIO_CONSOLE_F_MULTIPORT) |
+                                  (1ULL << VIRTIO_RING_F_INDIRECT_DESC));
+  virtio_pci_enable(dev);
+
+  if (pthread_create(&virtio_console_dev->worker_thread, NULL,
+                     virtio_console_thread, virtio_console_dev))
+    return throw_err("Failed to create the virtio-console thread");
+  return 0;
+}
+
+// The worker only touches the rings under the virtio-pci lock, once the
+// flag is set it leaves them alone until virtio_console_resume
+void virtio_console_pause(struct virtio_console_dev *dev) {
+  if (!dev->enable)
+    return;
+  pthread_mutex_lock(&dev->virtio_pci_dev.lock);
+  dev->paused = true;
+  pthread_mutex_unlock(&dev->virtio_pci_dev.lock);
+}
+
+void virtio_console_resume(struct virtio_console_dev *dev) {
+  if (!dev->enable)
+    return;
+  pthread_mutex_lock(&dev->virtio_pci_dev.lock);
+  dev->paused = false;
+  pthread_mutex_unlock(&dev->virtio_pci_dev.lock);
+  virtio_console_kick(dev);
+}
+
+// virtio_console_reset is called on reboot, with the vcpus stopped
+void virtio_console_reset(struct virtio_console_dev *dev) {
+  if (!dev->enable)
+    return;
+  virtio_pci_hard_reset(&dev->virtio_pci_dev);
+  pthread_mutex_lock(&dev->virtio_pci_dev.lock);
+  dev->paused = false;
+  pthread_mutex_unlock(&dev->virtio_pci_dev.lock);
+}
+
+struct virtio_console_state {
+  uint8_t enable;
+  uint8_t nr_ports;
+  uint8_t guest_ready[VIRTIO_CONSOLE_MAX_PORTS];
+  uint8_t guest_open[VIRTIO_CONSOLE_MAX_PORTS];
+  uint32_t tx_done[VIRTIO_CONSOLE_MAX_PORTS];
+  uint32_t ctrl_head;
+  uint32_t ctrl_tail;
+  struct virtio_console_control ctrl[VIRTIO_CONSOLE_CTRL_PENDING];
+};
+
+int virtio_console_save(struct virtio_console_dev *dev, struct snapshot *snap) {
+  struct virtio_console_state st = {
+      .enable = dev->enable,
+      .nr_ports = dev->nr_ports,
+      .ctrl_head = dev->ctrl_head,
+      .ctrl_tail = dev->ctrl_tail,
+  };
+
+  pthread_mutex_lock(&dev->virtio_pci_dev.lock);
+  for (int i = 0; i < dev->nr_ports; i++) {
+    st.guest_ready[i] = dev->ports[i].guest_ready;
+    st.guest_open[i] = dev->ports[i].guest_open;
+    st.tx_done[i] = dev->ports[i].tx_done;
+  }
+  memcpy(st.ctrl, dev->ctrl, sizeof(st.ctrl));
+  pthread_mutex_unlock(&dev->virtio_pci_dev.lock);
+
+  if (snapshot_put(snap, SNAP_VIRTIO_CONSOLE, &st, sizeof(st)) < 0)
+    return -1;
+
+  return st.enable ? virtio_pci_save(&dev->virtio_pci_dev, snap) : 0;
+}
+
+// The backends are those of the restoring process: the guest is told which
+// ports have a reader now.
+int virtio_console_restore(struct virtio_console_dev *dev,
+                           struct snapshot *snap) {
+  struct virtio_console_state st;
+
+  if (snapshot_get(snap, SNAP_VIRTIO_CONSOLE, &st, sizeof(st)) < 0)
+    return -1;
+  if (st.enable != dev->enable || st.nr_ports != dev->nr_ports) {
+    fprintf(stderr, "Snapshot: the guest was saved with %d virtio-console "
+            "ports\n", st.enable ? st.nr_ports : 0);
+    return -1;
+  }
+  if (!st.enable)
+    return 0;
+
+  // the port state goes first, the worker sees the queues once enabled
+  pthread_mutex_lock(&dev->virtio_pci_dev.lock);
+  for (int i = 0; i < dev->nr_ports; i++) {
+    dev->ports[i].guest_ready = st.guest_ready[i];
+    dev->ports[i].guest_open = st.guest_open[i];
+    dev->ports[i].tx_done = st.tx_done[i];
+  }
+  memcpy(dev->ctrl, st.ctrl, sizeof(dev->ctrl));
+  dev->ctrl_head = st.ctrl_head;
+  dev->ctrl_tail = st.ctrl_tail;
+  pthread_mutex_unlock(&dev->virtio_pci_dev.lock);
+
+  if (virtio_pci_restore(&dev->virtio_pci_dev, snap) < 0)
+    return -1;
+
+  pthread_mutex_lock(&dev->virtio_pci_dev.lock);
+  for (int i = 0; i < dev->nr_ports; i++) {
+    struct virtio_console_port *port = &dev->ports[i];
+    if (port->guest_ready && !virtio_console_is_console(port))
+      virtio_console_ctrl_send(dev, port->id, VIRTIO_CONSOLE_PORT_OPEN,
+                               port->fd >= 0);
+  }
+  pthread_mutex_unlock(&dev->virtio_pci_dev.lock);
+  virtio_console_resume(dev);
+  return 0;
+}
+
+void virtio_console_init(struct virtio_console_dev *dev) {
+  memset(dev, 0x00, sizeof(struct virtio_console_dev));
+}
+
+void virtio_console_exit(struct virtio_console_dev *dev) {
+  if (dev->worker_thread) {
+    pthread_mutex_lock(&dev->virtio_pci_dev.lock);
+    dev->stop = true;
+    pthread_mutex_unlock(&dev->virtio_pci_dev.lock);
+    virtio_console_kick(dev);
+    pthread_join(dev->worker_thread, NULL);
+  }
+
+  for (int i = 0; i < dev->nr_ports; i++) {
+    struct virtio_console_port *port = &dev->ports[i];
+    if (port->fd >= 0)
+      close(port->fd);
+    if (port->pty_slave_fd >= 0)
+      close(port->pty_slave_fd);
+    if (port->listen_fd >= 0) {
+      close(port->listen_fd);
+      unlink(port->path);
+    }
+    free(port->path);
+    free(port->name);
+  }
+  if (dev->enable) {
+    close(dev->irqfd);
+    close(dev->ioeventfd);
+  }
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <linux/virtio_console.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "pci.h"
+#include "virtio-pci.h"
+#include "virtq.h"
+
+#define VIRTIO_CONSOLE_PCI_CLASS 0x078000
+#define VIRTIO_CONSOLE_IRQ 14
+#define VIRTIO_CONSOLE_MAX_PORTS 8
+// receive and transmit queue of every port, plus the control queues
+#define VIRTIO_CONSOLE_VIRTQ_NUM ((VIRTIO_CONSOLE_MAX_PORTS + 1) * 2)
+#define VIRTIO_CONSOLE_MAX_SEGS 64 // descriptors in one buffer
+#define VIRTIO_CONSOLE_CTRL_PENDING 64
+
+enum virtio_console_backend {
+  VIRTIO_CONSOLE_FILE, // output only
+  VIRTIO_CONSOLE_UNIX, // listening socket, one client at a time
+  VIRTIO_CONSOLE_PTY,
+};
+
+struct virtio_console_port {
+  uint32_t id;
+  enum virtio_console_backend backend;
+  char *path;
+  char *name; // shows up as /dev/virtio-ports/<name> in a Linux guest
+  int fd;     // -1 while no unix client is connected
+  int listen_fd;
+  int pty_slave_fd; // held open, the master would hang up without a reader
+  bool guest_ready;
+  bool guest_open;
+  bool tx_blocked; // the backend is full, wait for POLLOUT
+  bool rx_ready;   // the backend has input, read it into the receive queue
+  uint32_t tx_done; // bytes of the first transmit buffer already written
+  struct virtq *rx;
+  struct virtq *tx;
+};
+
+/* A virtio console with up to VIRTIO_CONSOLE_MAX_PORTS ports. One worker
+ * thread moves whole guest buffers between the queues and the backends: it
+ * wakes on the queue notify ioeventfd and on the backend file descriptors,
+ * so the vcpus never handle console data. */
+struct virtio_console_dev {
+  struct virtio_pci_dev virtio_pci_dev;
+  struct virtio_console_config config;
+  struct virtq vq[VIRTIO_CONSOLE_VIRTQ_NUM];
+  struct virtio_console_port ports[VIRTIO_CONSOLE_MAX_PORTS];
+  int nr_ports;
+  // control messages waiting for a buffer on the control receive queue
+  struct virtio_console_control ctrl[VIRTIO_CONSOLE_CTRL_PENDING];
+  unsigned int ctrl_head;
+  unsigned int ctrl_tail;
+  int irqfd;
+  int ioeventfd;
+  uint64_t notify_addr;
+  int nr_enabled; // the ioeventfd is registered while a queue is enabled
+  pthread_t worker_thread;
+  bool stop;
+  bool enable;
+  bool paused;
+};
+
+void virtio_console_init(struct virtio_console_dev *dev);
+int virtio_console_add_port(struct virtio_console_dev *dev, const char *spec);
+int virtio_console_init_pci(struct virtio_console_dev *dev, struct pci *pci,
+                            struct bus *io_bus, struct bus *mmio_bus);
+void virtio_console_pause(struct virtio_console_dev *dev);
+void virtio_console_resume(struct virtio_console_dev *dev);
+void virtio_console_reset(struct virtio_console_dev *dev);
+int virtio_console_save(struct virtio_console_dev *dev, struct snapshot *snap);
+int virtio_console_restore(struct virtio_console_dev *dev,
+                           struct snapshot *snap);
+void virtio_console_exit(struct virtio_console_dev *dev);
@@ -9,6 +9,7 @@
 #include <unistd.h>
 
 #include "pci.h"
+#include "snapshot.h"
 #include "utils.h"
 #include "virtio-pci.h"
 #include "virtq.h"
@@ -36,18 +37,28 @@ static void virtio_pci_write_guest_feature(struct virtio_pci_dev *dev) {
 
   switch (select) {
   case 0:
-    dev->guest_feature |= feature;
+    dev->guest_feature = (dev->guest_feature & ~0xffffffffULL) | feature;
     break;
   case 1:
-    dev->guest_feature |= (uint64_t)feature << 32;
+    dev->guest_feature =
+        (dev->guest_feature & 0xffffffffULL) | (uint64_t)feature << 32;
     break;
   default:
     break;
   }
 }
 
+// A driver writing 0 to device_status resets the device: queues go away and
+// the feature negotiation starts over.
 static void virtio_pci_reset(struct virtio_pci_dev *dev) {
-  // TODO: virtio pci reset
+  uint16_t num_queues = dev->config.common_cfg.num_queues;
+
+  for (int i = 0; i < num_queues; i++)
+    virtq_reset(&dev->vq[i]);
+  memset(&dev->config.common_cfg, 0, sizeof(dev->config.common_cfg));
+  dev->config.common_cfg.num_queues = num_queues;
+  dev->config.isr_cap.isr_status = 0;
+  dev->guest_feature = 0;
 }
 
 static void virtio_pci_write_status(struct virtio_pci_dev *dev) {
@@ -72,12 +83,16 @@ static void virtio_pci_selec_virtq(struct virtio_pci_dev *dev) {
 
 static void virtio_pci_enable_virtq(struct virtio_pci_dev *dev) {
   uint16_t select = dev->config.common_cfg.queue_select;
-  virtq_enable(&dev->vq[select]);
+  if (select < dev->config.common_cfg.num_queues) {
+    virtq_set_features(&dev->vq[select], dev->guest_feature);
+    virtq_enable(&dev->vq[select]);
+  }
 }
 
 static void virtio_pci_disable_virtq(struct virtio_pci_dev *dev) {
   uint16_t select = dev->config.common_cfg.queue_select;
-  virtq_disable(&dev->vq[select]);
+  if (select < dev->config.common_cfg.num_queues)
+    virtq_disable(&dev->vq[select]);
 }
 
 static void virtio_pci_space_write(struct virtio_pci_dev *dev, void *data,
@@ -88,7 +103,8 @@ static void virtio_pci_space_write(struct virtio_pci_dev *dev, void *data,
     case VIRTIO_PCI_COMMON_DFSELECT:
       virtio_pci_select_device_feature(dev);
       break;
-    case VIRTIO_PCI_COMMON_GFSELECT:
+    // the selected half is taken when the driver writes it
+    case VIRTIO_PCI_COMMON_GF:
       virtio_pci_write_guest_feature(dev);
       break;
     case VIRTIO_PCI_COMMON_STATUS:
@@ -99,7 +115,7 @@ static void virtio_pci_space_write(struct virtio_pci_dev *dev, void *data,
       break;
     case VIRTIO_PCI_COMMON_Q_ENABLE:
       if (dev->config.common_cfg.queue_enable)
-        virtio_pci_enable(dev);
+        virtio_pci_enable_virtq(dev);
       else
         virtio_pci_disable_virtq(dev);
       break;
@@ -111,7 +127,8 @@ static void virtio_pci_space_write(struct virtio_pci_dev *dev, void *data,
         if (select < dev->config.common_cfg.num_queues)
           memcpy((void *)&dev->vq[select].info + info_offset, data, size);
       } else if (offset == offsetof(struct virtio_pci_config, notify_data)) {
-        virtq_handle_avail(&dev->vq[dev->config.notify_data.vqn]);
+        if (dev->config.notify_data.vqn < dev->config.common_cfg.num_queues)
+          virtq_handle_avail(&dev->vq[dev->config.notify_data.vqn]);
       }
       break;
     }
@@ -123,13 +140,28 @@ static void virtio_pci_space_write(struct virtio_pci_dev *dev, void *data,
   memcpy((void *)dev->config.dev_cfg + dev_offset, data, size);
 }
 
+// A queue the driver broke is left alone, the device needs a reset
+static void virtio_pci_read_status(struct virtio_pci_dev *dev) {
+  for (int i = 0; i < dev->config.common_cfg.num_queues; i++) {
+    if (__atomic_load_n(&dev->vq[i].broken, __ATOMIC_RELAXED))
+      dev->config.common_cfg.device_status |= VIRTIO_CONFIG_S_NEEDS_RESET;
+  }
+}
+
 static void virtio_pci_space_read(struct virtio_pci_dev *dev, void *data,
                                   uint64_t offset, uint8_t size) {
   if (offset < offsetof(struct virtio_pci_config, dev_cfg)) {
-    memcpy(data, (void *)&dev->config + offset, size);
+    if (offset == VIRTIO_PCI_COMMON_STATUS)
+      virtio_pci_read_status(dev);
+    // device workers set ISR bits without the lock, reading clears them
     if (offset == offsetof(struct virtio_pci_config, isr_cap)) {
-      dev->config.isr_cap.isr_status = 0;
+      uint32_t isr =
+          __atomic_exchange_n(&dev->config.isr_cap.isr_status, 0,
+                              __ATOMIC_RELAXED);
+      memcpy(data, &isr, size < sizeof(isr) ? size : sizeof(isr));
+      return;
     }
+    memcpy(data, (void *)&dev->config + offset, size);
   } else {
     /* dev config read */
     uint64_t dev_offset = offset - offsetof(struct virtio_pci_config, dev_cfg);
@@ -141,10 +173,12 @@ static void virtio_pci_space_io(void *owner, void *data, uint8_t is_write,
                                 uint64_t offset, uint8_t size) {
   struct virtio_pci_dev *virtio_pci_dev =
       container_of(owner, struct virtio_pci_dev, pci_dev);
+  pthread_mutex_lock(&virtio_pci_dev->lock);
   if (is_write)
     virtio_pci_space_write(virtio_pci_dev, data, offset, size);
   else
     virtio_pci_space_read(virtio_pci_dev, data, offset, size);
+  pthread_mutex_unlock(&virtio_pci_dev->lock);
 }
 
 static void virtio_pci_set_cap(struct virtio_pci_dev *dev, uint8_t next) {
@@ -216,6 +250,10 @@ void virtio_pci_add_feature(struct virtio_pci_dev *dev, uint64_t feature) {
   dev->device_feature |= feature;
 }
 
+void virtio_pci_del_feature(struct virtio_pci_dev *dev, uint64_t feature) {
+  dev->device_feature &= ~feature;
+}
+
 void virtio_pci_set_pci_hdr(struct virtio_pci_dev *dev, uint16_t device_id,
                             uint32_t class, uint8_t irq_line) {
   PCI_HDR_WRITE(dev->pci_dev.hdr, PCI_DEVICE_ID, device_id, 16);
@@ -229,17 +267,20 @@ void virtio_pci_init(struct virtio_pci_dev *dev, struct pci *pci,
   uint8_t cap_list = 0x40;
 
   memset(dev, 0x00, sizeof(struct virtio_pci_dev));
+  pthread_mutex_init(&dev->lock, NULL);
   pci_dev_init(&dev->pci_dev, pci, io_bus, mmio_bus);
   PCI_HDR_WRITE(dev->pci_dev.hdr, PCI_VENDOR_ID, VIRTIO_PCI_VENDOR_ID, 16);
   PCI_HDR_WRITE(dev->pci_dev.hdr, PCI_CAPABILITY_LIST, cap_list, 8);
   PCI_HDR_WRITE(dev->pci_dev.hdr, PCI_HEADER_TYPE, PCI_HEADER_TYPE_NORMAL, 8);
   PCI_HDR_WRITE(dev->pci_dev.hdr, PCI_INTERRUPT_LINE, 1, 8);
+  PCI_HDR_WRITE(dev->pci_dev.hdr, PCI_INTERRUPT_PIN, 1, 8); // INTA#
   pci_set_status(&dev->pci_dev, PCI_STATUS_CAP_LIST | PCI_STATUS_INTERRUPT);
   pci_set_bar(&dev->pci_dev, 0, 0x100, PCI_BASE_ADDRESS_SPACE_MEMORY,
               virtio_pci_space_io);
   virtio_pci_set_cap(dev, cap_list);
-  dev->device_feature |=
-      (1ULL << VIRTIO_F_RING_PACKED) | (1ULL << VIRTIO_F_VERSION_1);
+  dev->device_feature |= (1ULL << VIRTIO_F_RING_PACKED) |
+                         (1ULL << VIRTIO_F_VERSION_1) |
+                         (1ULL << VIRTIO_RING_F_EVENT_IDX);
 }
 
 void virtio_pci_enable(struct virtio_pci_dev *dev)
@@ -247,5 +288,70 @@ void virtio_pci_enable(struct virtio_pci_dev *dev)
   pci_dev_register(&dev->pci_dev);
 }
 
+struct virtio_pci_state {
+  uint8_t cfg_space[PCI_CFG_SPACE_SIZE];
+  struct virtio_pci_common_cfg common_cfg;
+  struct virtio_pci_isr_cap isr_cap;
+  struct virtio_pci_notify_data notify_data;
+  uint64_t device_feature;
+  uint64_t guest_feature;
+};
+
+int virtio_pci_save(struct virtio_pci_dev *dev, struct snapshot *snap)
+{
+  struct virtio_pci_state st;
+  int ret;
+
+  pthread_mutex_lock(&dev->lock);
+  memcpy(st.cfg_space, dev->pci_dev.cfg_space, PCI_CFG_SPACE_SIZE);
+  st.common_cfg = dev->config.common_cfg;
+  st.isr_cap = dev->config.isr_cap;
+  st.notify_data = dev->config.notify_data;
+  st.device_feature = dev->device_feature;
+  st.guest_feature = dev->guest_feature;
+  ret = snapshot_put(snap, SNAP_VIRTIO_PCI, &st, sizeof(st));
+  for (int i = 0; !ret && i < dev->config.common_cfg.num_queues; i++)
+    ret = virtq_save(&dev->vq[i], snap);
+  pthread_mutex_unlock(&dev->lock);
+
+  return ret;
+}
+
+int virtio_pci_restore(struct virtio_pci_dev *dev, struct snapshot *snap)
+{
+  struct virtio_pci_state st;
+  int ret;
+
+  if (snapshot_get(snap, SNAP_VIRTIO_PCI, &st, sizeof(st)) < 0)
+    return -1;
+
+  pthread_mutex_lock(&dev->lock);
+  dev->config.common_cfg = st.common_cfg;
+  dev->config.isr_cap = st.isr_cap;
+  dev->config.notify_data = st.notify_data;
+  dev->device_feature = st.device_feature;
+  dev->guest_feature = st.guest_feature;
+  // BARs first, re-enabling a queue registers its notify address
+  pci_dev_restore(&dev->pci_dev, st.cfg_space);
+  ret = 0;
+  for (int i = 0; !ret && i < dev->config.common_cfg.num_queues; i++) {
+    virtq_set_features(&dev->vq[i], dev->guest_feature);
+    ret = virtq_restore(&dev->vq[i], snap);
+  }
+  pthread_mutex_unlock(&dev->lock);
+
+  return ret;
+}
+
+// virtio_pci_hard_reset is a reset of the machine, the PCI function is
+// reset along with the virtio device.
+void virtio_pci_hard_reset(struct virtio_pci_dev *dev)
+{
+  pthread_mutex_lock(&dev->lock);
+  virtio_pci_reset(dev);
+  pci_dev_reset(&dev->pci_dev);
+  pthread_mutex_unlock(&dev->lock);
+}
+
 void virtio_pci_exit()
 {}
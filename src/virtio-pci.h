@@ -1,6 +1,7 @@
 #pragma once
 
 #include <linux/virtio_pci.h>
+#include <pthread.h>
 #include <stdint.h>
 
 #include "pci.h"
@@ -8,6 +9,7 @@
 
 #define VIRTIO_PCI_VENDOR_ID 0x1AF4
 #define VIRTIO_PCI_DEVICE_ID_BLK 0x1042
+#define VIRTIO_PCI_DEVICE_ID_CONSOLE 0x1043
 #define VIRTIO_PCI_CAP_NUM 5
 #define VIRTIO_PCI_ISR_QUEUE 1
 
@@ -28,6 +30,7 @@ struct virtio_pci_config{
 };
 
 struct virtio_pci_dev {
+  pthread_mutex_t lock; // common/device config accesses from several vcpus
   struct pci_dev pci_dev;
   struct virtio_pci_config config;
   uint64_t device_feature;
@@ -50,9 +53,13 @@ void virtio_pci_set_virtq(struct virtio_pci_dev *dev,
 			  struct virtq *vq,
 			  uint16_t num_queues);
 void virtio_pci_add_feature(struct virtio_pci_dev *dev, uint64_t feature);
+void virtio_pci_del_feature(struct virtio_pci_dev *dev, uint64_t feature);
 void virtio_pci_enable(struct virtio_pci_dev *dev);
 void virtio_pci_init(struct virtio_pci_dev *dev,
 		      struct pci *pci,
 		      struct bus *io_bus,
 		      struct bus *mmio_bus);
+int virtio_pci_save(struct virtio_pci_dev *dev, struct snapshot *snap);
+int virtio_pci_restore(struct virtio_pci_dev *dev, struct snapshot *snap);
+void virtio_pci_hard_reset(struct virtio_pci_dev *dev);
 void virtio_pci_exit();
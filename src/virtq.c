@@ -1,42 +1,128 @@
+#include <linux/virtio_config.h>
 #include <linux/virtio_ring.h>
 #include <stdint.h>
 #include <sys/ioctl.h>
 #include <unistd.h>
 
+#include "snapshot.h"
 #include "virtq.h"
 
+static const struct virtq_layout virtq_packed;
+static const struct virtq_layout virtq_split;
+
 void virtq_complete_request(struct virtq *vq) { vq->ops->complete_request(vq); }
 
 void virtq_notify_used(struct virtq *vq) { vq->ops->notify_used(vq); }
 
 void virtq_enable(struct virtq *vq) { vq->ops->enable_vq(vq); }
 
-void virtq_disable(struct virtq *vq) {}
+void virtq_disable(struct virtq *vq) {
+  if (vq->ops->disable_vq)
+    vq->ops->disable_vq(vq);
+}
 
-#define VIRTQ_SIZE 128
-void virtq_init(struct virtq *vq, void *dev, struct virtq_ops *ops) {
-  vq->info.size = VIRTQ_SIZE;
-  vq->info.notify_off = 0;
-  vq->info.enable = 0;
+// virtq_reset brings the queue back to the state the driver first found it in
+void virtq_reset(struct virtq *vq) {
+  virtq_disable(vq);
+  vq->info = (struct virtq_info){.size = VIRTQ_SIZE};
+  vq->layout = &virtq_packed;
+  vq->desc_ring = NULL;
+  vq->device_event = NULL;
+  vq->guest_event = NULL;
+  vq->desc_table = NULL;
+  vq->avail = NULL;
+  vq->used = NULL;
   vq->next_avail_idx = 0;
   vq->used_wrap_count = 1;
+  vq->used_idx = 0;
+  vq->used_wrap = 1;
+  vq->event_idx = false;
+  vq->signalled_valid = false;
+  vq->broken = false;
+}
+
+void virtq_init(struct virtq *vq, struct vm *vm, void *dev,
+                struct virtq_ops *ops) {
   vq->ops = ops;
+  vq->vm = vm;
   vq->dev = dev;
+  vq->info.enable = 0;
+  virtq_reset(vq);
 }
 
-bool virtq_check_next(struct vring_packed_desc *desc) {
-  return desc->flags & VRING_DESC_F_NEXT;
+// virtq_set_features picks the ring layout the driver accepted, before the
+// queue is enabled
+void virtq_set_features(struct virtq *vq, uint64_t features) {
+  vq->layout = features & (1ULL << VIRTIO_F_RING_PACKED) ? &virtq_packed
+                                                          : &virtq_split;
+  vq->event_idx = features & (1ULL << VIRTIO_RING_F_EVENT_IDX);
 }
 
-struct vring_packed_desc *virtq_get_avail(struct virtq *vq) {
+// virtq_map_area translates a guest area, it has to be in one piece of RAM
+static void *virtq_map_area(struct virtq *vq, uint64_t addr, uint64_t len) {
+  uint8_t *start = vm_guest_to_host(vq->vm, (void *)addr);
+  uint8_t *end = vm_guest_to_host(vq->vm, (void *)(addr + len - 1));
+
+  if (!len || !start || end != start + len - 1)
+    return NULL;
+  return start;
+}
+
+// virtq_map finds the rings in guest memory when the driver enables the
+// queue, it fails if they are not in RAM or the size is not valid
+int virtq_map(struct virtq *vq) {
+  if (!vq->info.size || vq->info.size > VIRTQ_SIZE)
+    return -1;
+  return vq->layout->map(vq);
+}
+
+/* virtq_set_table makes buf walk the indirect table at addr. The table has
+ * to be in one piece of RAM, and its descriptor may not be chained. Both
+ * layouts have 16-byte descriptors. */
+static void virtq_set_table(struct virtq *vq, struct virtq_buf *buf,
+                            uint64_t addr, uint32_t len, uint16_t flags) {
+  buf->table = NULL;
+  buf->next = 0;
+  if (len % sizeof(struct vring_desc) ||
+      len / sizeof(struct vring_desc) > VIRTQ_INDIRECT_MAX ||
+      flags & VRING_DESC_F_NEXT ||
+      !(buf->table = virtq_map_area(vq, addr, len))) {
+    buf->more = false;
+    buf->bad = true;
+    return;
+  }
+  buf->table_len = len / sizeof(struct vring_desc);
+}
+
+/* Packed layout: one ring of descriptors the driver marks available and the
+ * device overwrites with used elements, tracked by wrap counters. */
+
+static int virtq_packed_map(struct virtq *vq) {
+  vq->desc_ring = virtq_map_area(vq, vq->info.desc_addr,
+                                 vq->info.size * sizeof(*vq->desc_ring));
+  vq->guest_event =
+      virtq_map_area(vq, vq->info.driver_addr, sizeof(*vq->guest_event));
+  vq->device_event =
+      virtq_map_area(vq, vq->info.device_addr, sizeof(*vq->device_event));
+  return vq->desc_ring && vq->guest_event && vq->device_event ? 0 : -1;
+}
+
+// virtq_packed_has_avail tells whether the driver made a buffer available,
+// without taking it
+static bool virtq_packed_has_avail(struct virtq *vq) {
   struct vring_packed_desc *desc = &vq->desc_ring[vq->next_avail_idx];
-  uint16_t flags = desc->flags;
+  uint16_t flags = __atomic_load_n(&desc->flags, __ATOMIC_ACQUIRE);
   bool avail = flags & (1ULL << VRING_PACKED_DESC_F_AVAIL);
   bool used = flags & (1ULL << VRING_PACKED_DESC_F_USED);
 
-  if (avail != vq->used_wrap_count || used == vq->used_wrap_count) {
+  return avail == vq->used_wrap_count && used != vq->used_wrap_count;
+}
+
+static struct vring_packed_desc *virtq_packed_get_avail(struct virtq *vq) {
+  struct vring_packed_desc *desc = &vq->desc_ring[vq->next_avail_idx];
+
+  if (!virtq_packed_has_avail(vq))
     return NULL;
-  }
 
   vq->next_avail_idx++;
 
@@ -48,11 +134,335 @@ struct vring_packed_desc *virtq_get_avail(struct virtq *vq) {
   return desc;
 }
 
+/* virtq_packed_get_buf takes the next available buffer off the ring. A ring
+ * descriptor with VRING_DESC_F_INDIRECT stands for the whole buffer, its
+ * descriptors are in a table in guest memory. */
+static bool virtq_packed_get_buf(struct virtq *vq, struct virtq_buf *buf) {
+  struct vring_packed_desc *desc = virtq_packed_get_avail(vq);
+
+  if (!desc)
+    return false;
+
+  *buf = (struct virtq_buf){
+      .next = desc - vq->desc_ring, .more = true, .id = desc->id, .num = 1};
+  uint16_t flags = desc->flags;
+  if (flags & VRING_DESC_F_INDIRECT)
+    virtq_set_table(vq, buf, desc->addr, desc->len, flags);
+  return true;
+}
+
+/* The descriptors of a table follow each other. Chained ring descriptors are
+ * taken off the ring as they are reached, so the device walks the whole
+ * buffer even if it fails it. */
+static bool virtq_packed_buf_next(struct virtq *vq, struct virtq_buf *buf,
+                                  struct virtq_desc *desc) {
+  struct vring_packed_desc *d;
+
+  if (!buf->more)
+    return false;
+
+  if (buf->table) {
+    d = (struct vring_packed_desc *)buf->table + buf->next;
+    buf->more = ++buf->next < buf->table_len;
+    *desc = (struct virtq_desc){d->addr, d->len, d->flags};
+    // a table in a table is not allowed
+    if (desc->flags & VRING_DESC_F_INDIRECT) {
+      buf->more = false;
+      buf->bad = true;
+      return false;
+    }
+    return true;
+  }
+
+  d = &vq->desc_ring[buf->next];
+  *desc = (struct virtq_desc){d->addr, d->len, d->flags};
+  buf->bad |= !!(desc->flags & VRING_DESC_F_INDIRECT);
+  buf->id = d->id;
+  buf->more = false;
+  if (desc->flags & VRING_DESC_F_NEXT) {
+    if ((d = virtq_packed_get_avail(vq))) {
+      buf->next = d - vq->desc_ring;
+      buf->more = true;
+      buf->num++;
+    } else {
+      buf->bad = true;
+    }
+  }
+  return true;
+}
+
+/* virtq_packed_push_used returns the buffer id, num descriptors long, to the
+ * driver. Used elements go one after the other from used_idx, in completion
+ * order, each taking the room of its num descriptors. The flags are written
+ * last: they hand the element over. */
+static void virtq_packed_push_used(struct virtq *vq, uint16_t id, uint32_t len,
+                                   uint16_t num) {
+  struct vring_packed_desc *desc = &vq->desc_ring[vq->used_idx];
+  uint16_t flags = vq->used_wrap ? (1 << VRING_PACKED_DESC_F_AVAIL) |
+                                       (1 << VRING_PACKED_DESC_F_USED)
+                                 : 0;
+
+  desc->id = id;
+  desc->len = len;
+  __atomic_store_n(&desc->flags, flags, __ATOMIC_RELEASE);
+
+  vq->used_idx += num;
+  if (vq->used_idx >= vq->info.size) {
+    vq->used_idx -= vq->info.size;
+    vq->used_wrap ^= 1;
+  }
+}
+
+// virtq_packed_disable_kicks tells the driver not to notify the device,
+// which is taking the available buffers anyway
+static void virtq_packed_disable_kicks(struct virtq *vq) {
+  __atomic_store_n(&vq->device_event->flags, VRING_PACKED_EVENT_FLAG_DISABLE,
+                   __ATOMIC_RELAXED);
+}
+
+/* virtq_packed_enable_kicks asks the driver to notify the device again. It
+ * tells whether a buffer was made available before the driver could see
+ * that, the device has to take it without waiting for a kick. */
+static bool virtq_packed_enable_kicks(struct virtq *vq) {
+  __atomic_store_n(&vq->device_event->flags, VRING_PACKED_EVENT_FLAG_ENABLE,
+                   __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  return virtq_packed_has_avail(vq);
+}
+
+/* virtq_packed_need_signal tells whether the used elements pushed since its
+ * last call are to be signalled. The driver asks for all of them, for none,
+ * or with VIRTIO_RING_F_EVENT_IDX for the one written at its event offset. */
+static bool virtq_packed_need_signal(struct virtq *vq) {
+  int start = vq->signalled_idx;
+  bool valid = vq->signalled_valid;
+
+  if (valid && vq->signalled_wrap != vq->used_wrap)
+    start -= vq->info.size;
+  vq->signalled_idx = vq->used_idx;
+  vq->signalled_wrap = vq->used_wrap;
+  vq->signalled_valid = true;
+
+  // the used elements have to be visible before the event is read
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  uint16_t flags = __atomic_load_n(&vq->guest_event->flags, __ATOMIC_RELAXED);
+  if (flags == VRING_PACKED_EVENT_FLAG_DISABLE)
+    return false;
+  if (flags != VRING_PACKED_EVENT_FLAG_DESC || !vq->event_idx || !valid)
+    return true;
+
+  // offsets of the last wrap are counted below 0
+  uint16_t off_wrap =
+      __atomic_load_n(&vq->guest_event->off_wrap, __ATOMIC_RELAXED);
+  int event = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+  if (!(off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) != !vq->used_wrap)
+    event -= vq->info.size;
+  return event >= start && event < vq->used_idx;
+}
+
+static const struct virtq_layout virtq_packed = {
+    .map = virtq_packed_map,
+    .has_avail = virtq_packed_has_avail,
+    .get_buf = virtq_packed_get_buf,
+    .buf_next = virtq_packed_buf_next,
+    .push_used = virtq_packed_push_used,
+    .disable_kicks = virtq_packed_disable_kicks,
+    .enable_kicks = virtq_packed_enable_kicks,
+    .need_signal = virtq_packed_need_signal,
+};
+
+/* Split layout: a descriptor table, the available ring of chain heads from
+ * the driver and the used ring from the device. Their indexes run free, the
+ * size is a power of 2. With VIRTIO_RING_F_EVENT_IDX the used_event and
+ * avail_event indexes follow the rings. */
+
+static uint16_t *virtq_split_used_event(struct virtq *vq) {
+  return &vq->avail->ring[vq->info.size];
+}
+
+static uint16_t *virtq_split_avail_event(struct virtq *vq) {
+  return (uint16_t *)&vq->used->ring[vq->info.size];
+}
+
+static int virtq_split_map(struct virtq *vq) {
+  uint16_t size = vq->info.size;
+
+  if (size & (size - 1))
+    return -1;
+  vq->desc_table = virtq_map_area(vq, vq->info.desc_addr,
+                                  size * sizeof(*vq->desc_table));
+  vq->avail =
+      virtq_map_area(vq, vq->info.driver_addr,
+                     sizeof(*vq->avail) + (size + 1) * sizeof(uint16_t));
+  vq->used = virtq_map_area(vq, vq->info.device_addr,
+                            sizeof(*vq->used) +
+                                size * sizeof(struct vring_used_elem) +
+                                sizeof(uint16_t));
+  return vq->desc_table && vq->avail && vq->used ? 0 : -1;
+}
+
+// More than a ring of new buffers cannot be: the driver broke the index, and
+// the slots past the ring would be stale
+static bool virtq_split_has_avail(struct virtq *vq) {
+  uint16_t idx = __atomic_load_n(&vq->avail->idx, __ATOMIC_ACQUIRE);
+
+  if ((uint16_t)(idx - vq->next_avail_idx) > vq->info.size)
+    __atomic_store_n(&vq->broken, true, __ATOMIC_RELAXED);
+  return idx != vq->next_avail_idx &&
+         !__atomic_load_n(&vq->broken, __ATOMIC_RELAXED);
+}
+
+// The available ring holds the head of the chain, which is the buffer id
+static bool virtq_split_get_buf(struct virtq *vq, struct virtq_buf *buf) {
+  if (!virtq_split_has_avail(vq))
+    return false;
+
+  uint16_t head = vq->avail->ring[vq->next_avail_idx++ & (vq->info.size - 1)];
+  *buf = (struct virtq_buf){.next = head, .more = true, .id = head, .num = 1};
+  if (head >= vq->info.size) {
+    buf->more = false;
+    buf->bad = true;
+    return true;
+  }
+
+  struct vring_desc *desc = &vq->desc_table[head];
+  uint16_t flags = desc->flags;
+  if (flags & VRING_DESC_F_INDIRECT)
+    virtq_set_table(vq, buf, desc->addr, desc->len, flags);
+  return true;
+}
+
+// Descriptors link to the next one by index, in the table or in the ring.
+// A chain longer than them loops.
+static bool virtq_split_buf_next(struct virtq *vq, struct virtq_buf *buf,
+                                 struct virtq_desc *desc) {
+  struct vring_desc *descs = buf->table ? buf->table : vq->desc_table;
+  uint32_t limit = buf->table ? buf->table_len : vq->info.size;
+
+  if (!buf->more)
+    return false;
+  if (buf->next >= limit || buf->count++ == limit) {
+    buf->more = false;
+    buf->bad = true;
+    return false;
+  }
+
+  struct vring_desc *d = &descs[buf->next];
+  *desc = (struct virtq_desc){d->addr, d->len, d->flags};
+  buf->more = desc->flags & VRING_DESC_F_NEXT;
+  buf->next = d->next;
+  // the head of the buffer was the only place for VRING_DESC_F_INDIRECT
+  if (desc->flags & VRING_DESC_F_INDIRECT) {
+    buf->more = false;
+    buf->bad = true;
+    return false;
+  }
+  return true;
+}
+
+// The index is written last: it hands the element over
+static void virtq_split_push_used(struct virtq *vq, uint16_t id, uint32_t len,
+                                  uint16_t num) {
+  struct vring_used_elem *elem =
+      &vq->used->ring[vq->used_idx & (vq->info.size - 1)];
+
+  elem->id = id;
+  elem->len = len;
+  __atomic_store_n(&vq->used->idx, ++vq->used_idx, __ATOMIC_RELEASE);
+}
+
+// With VIRTIO_RING_F_EVENT_IDX the driver ignores the flag, avail_event is
+// left behind and it kicks no more
+static void virtq_split_disable_kicks(struct virtq *vq) {
+  __atomic_store_n(&vq->used->flags, VRING_USED_F_NO_NOTIFY, __ATOMIC_RELAXED);
+}
+
+static bool virtq_split_enable_kicks(struct virtq *vq) {
+  __atomic_store_n(&vq->used->flags, 0, __ATOMIC_RELAXED);
+  if (vq->event_idx)
+    __atomic_store_n(virtq_split_avail_event(vq), vq->next_avail_idx,
+                     __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  return virtq_split_has_avail(vq);
+}
+
+static bool virtq_split_need_signal(struct virtq *vq) {
+  uint16_t old = vq->signalled_idx;
+  bool valid = vq->signalled_valid;
+
+  vq->signalled_idx = vq->used_idx;
+  vq->signalled_valid = true;
+
+  // the used index has to be visible before the event is read
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (!vq->event_idx)
+    return !(__atomic_load_n(&vq->avail->flags, __ATOMIC_RELAXED) &
+             VRING_AVAIL_F_NO_INTERRUPT);
+  return !valid ||
+         vring_need_event(
+             __atomic_load_n(virtq_split_used_event(vq), __ATOMIC_RELAXED),
+             vq->used_idx, old);
+}
+
+static const struct virtq_layout virtq_split = {
+    .map = virtq_split_map,
+    .has_avail = virtq_split_has_avail,
+    .get_buf = virtq_split_get_buf,
+    .buf_next = virtq_split_buf_next,
+    .push_used = virtq_split_push_used,
+    .disable_kicks = virtq_split_disable_kicks,
+    .enable_kicks = virtq_split_enable_kicks,
+    .need_signal = virtq_split_need_signal,
+};
+
+// Used buffers are signalled by the device, which asks virtq_need_signal
+// from notify_used
 void virtq_handle_avail(struct virtq *vq) {
   if (!vq->info.enable)
     return;
 
   virtq_complete_request(vq);
-  if (vq->guest_event->flags == VRING_PACKED_EVENT_FLAG_ENABLE)
-    virtq_notify_used(vq);
+  virtq_notify_used(vq);
+}
+
+struct virtq_state {
+  struct virtq_info info;
+  uint16_t next_avail_idx;
+  uint16_t used_wrap_count;
+  uint16_t used_idx;
+  uint16_t used_wrap;
+};
+
+int virtq_save(struct virtq *vq, struct snapshot *snap) {
+  struct virtq_state st = {
+      .info = vq->info,
+      .next_avail_idx = vq->next_avail_idx,
+      .used_wrap_count = vq->used_wrap_count,
+      .used_idx = vq->used_idx,
+      .used_wrap = vq->used_wrap,
+  };
+
+  return snapshot_put(snap, SNAP_VIRTQ, &st, sizeof(st));
+}
+
+// The ring addresses are in the saved info, an enabled queue is enabled
+// again so the device maps its rings and rearms its notifications. The
+// layout was set from the restored features.
+int virtq_restore(struct virtq *vq, struct snapshot *snap) {
+  struct virtq_state st;
+
+  if (snapshot_get(snap, SNAP_VIRTQ, &st, sizeof(st)) < 0)
+    return -1;
+
+  vq->info = st.info;
+  vq->info.enable = 0;
+  vq->next_avail_idx = st.next_avail_idx;
+  vq->used_wrap_count = st.used_wrap_count;
+  vq->used_idx = st.used_idx;
+  vq->used_wrap = st.used_wrap;
+  vq->signalled_valid = false;
+  if (st.info.enable)
+    virtq_enable(vq);
+
+  return 0;
 }
@@ -4,11 +4,18 @@
 #include <stdbool.h>
 #include <stdint.h>
 
+#define VIRTQ_SIZE 128 // the most descriptors a driver may put in a ring
+// the most descriptors in an indirect table
+#define VIRTQ_INDIRECT_MAX 1024
+
 struct virtq;
+struct snapshot;
+struct vm;
 
 struct virtq_ops {
 	void (*complete_request)(struct virtq *vq);
 	void (*enable_vq)(struct virtq *vq);
+	void (*disable_vq)(struct virtq *vq);
 	void (*notify_used)(struct virtq *vq);
 };
 
@@ -18,28 +25,119 @@ struct virtq_info {
 	uint16_t enable;
 	uint16_t notify_off;
 	uint64_t desc_addr;
-	uint64_t device_addr;
-	uint64_t driver_addr;
+	uint64_t driver_addr;	// driver area: available ring or driver events
+	uint64_t device_addr;	// device area: used ring or device events
 }__attribute__((packed));
 
-/* packed virtqueue */
+/* A descriptor as the device sees it, copied out of the ring so the driver
+ * cannot change it under the device */
+struct virtq_desc {
+	uint64_t addr;
+	uint32_t len;
+	uint16_t flags;	// VRING_DESC_F_*
+};
+
+/* A buffer taken off the ring. Its descriptors are chained in the ring or
+ * in an indirect table, virtq_buf_next walks them the same way. */
+struct virtq_buf {
+	void *table;		// indirect table, NULL while in the ring
+	uint32_t table_len;
+	uint32_t next;		// index of the next descriptor, in the table or ring
+	uint32_t count;		// descriptors walked, a split chain may not loop
+	bool more;		// next belongs to the buffer
+	uint16_t id;		// buffer id, known once the chain is walked
+	uint16_t num;		// ring descriptors the buffer takes
+	bool bad;		// malformed, the device fails it
+};
+
+/* The ring layout negotiated with the driver, packed or split. Every queue
+ * operation goes through it, so neither layout tests for the other. */
+struct virtq_layout {
+	int (*map)(struct virtq *vq);
+	bool (*has_avail)(struct virtq *vq);
+	bool (*get_buf)(struct virtq *vq, struct virtq_buf *buf);
+	bool (*buf_next)(struct virtq *vq, struct virtq_buf *buf,
+			 struct virtq_desc *desc);
+	void (*push_used)(struct virtq *vq, uint16_t id, uint32_t len,
+			  uint16_t num);
+	void (*disable_kicks)(struct virtq *vq);
+	bool (*enable_kicks)(struct virtq *vq);
+	bool (*need_signal)(struct virtq *vq);
+};
+
 struct virtq {
+	const struct virtq_layout *layout;
+	// packed layout
 	struct vring_packed_desc *desc_ring;			// descriptor ring
 	struct vring_packed_desc_event *device_event;		// used ring (device area)
 	struct vring_packed_desc_event *guest_event;		// available ring (driver area)
+	// split layout
+	struct vring_desc *desc_table;
+	struct vring_avail *avail;	// driver area
+	struct vring_used *used;	// device area
 	struct virtq_info info;
+	struct vm *vm;		// the rings and indirect tables are in its memory
 	void *dev;
-	uint16_t next_avail_idx;
-	bool used_wrap_count;
+	uint16_t next_avail_idx;	// split: free running, not wrapped
+	bool used_wrap_count;	// packed: wrap counter of next_avail_idx
+	uint16_t used_idx;	// where the next used element goes
+	bool used_wrap;		// wrap counter of used_idx
+	bool event_idx;		// VIRTIO_RING_F_EVENT_IDX was negotiated
+	// used_idx when virtq_need_signal last looked, invalid after a restore
+	uint16_t signalled_idx;
+	bool signalled_wrap;
+	bool signalled_valid;
+	bool broken;	// the driver broke the ring, no buffer is taken until a reset
 	struct virtq_ops *ops;
 };
 
-struct vring_packed_desc *virtq_get_avail(struct virtq *vq);
-bool virtq_check_next(struct vring_packed_desc *desc);
+static inline bool virtq_has_avail(struct virtq *vq)
+{
+	return vq->layout->has_avail(vq);
+}
+
+static inline bool virtq_get_buf(struct virtq *vq, struct virtq_buf *buf)
+{
+	return vq->layout->get_buf(vq, buf);
+}
+
+// virtq_buf_next copies out the next descriptor of buf, false past the last
+static inline bool virtq_buf_next(struct virtq *vq, struct virtq_buf *buf,
+				  struct virtq_desc *desc)
+{
+	return vq->layout->buf_next(vq, buf, desc);
+}
+
+static inline void virtq_push_used(struct virtq *vq, uint16_t id,
+				   uint32_t len, uint16_t num)
+{
+	vq->layout->push_used(vq, id, len, num);
+}
+
+static inline void virtq_disable_kicks(struct virtq *vq)
+{
+	vq->layout->disable_kicks(vq);
+}
+
+static inline bool virtq_enable_kicks(struct virtq *vq)
+{
+	return vq->layout->enable_kicks(vq);
+}
+
+static inline bool virtq_need_signal(struct virtq *vq)
+{
+	return vq->layout->need_signal(vq);
+}
+
+void virtq_set_features(struct virtq *vq, uint64_t features);
+int virtq_map(struct virtq *vq);
 void virtq_enable(struct virtq *vq);
 void virtq_disable(struct virtq *vq);
+void virtq_reset(struct virtq *vq);
 void virtq_complete_request(struct virtq *vq);
 void virtq_notify_used(struct virtq *vq);
-void virtq_deassert_irq(struct virtq *vq);
 void virtq_handle_avail(struct virtq *vq);
-void virtq_init(struct virtq *vq, void *dev, struct virtq_ops *ops);
+void virtq_init(struct virtq *vq, struct vm *vm, void *dev,
+		struct virtq_ops *ops);
+int virtq_save(struct virtq *vq, struct snapshot *snap);
+int virtq_restore(struct virtq *vq, struct snapshot *snap);
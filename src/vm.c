@@ -6,7 +6,11 @@
 #include <linux/kvm_para.h>
 
 #include <asm/e820.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <linux/serial_reg.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -16,18 +20,24 @@
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "acpi.h"
 #include "err.h"
+#include "exit-stats.h"
+#include "mptable.h"
 #include "vm.h"
 #include "pci.h"
 #include "serial.h"
+#include "snapshot.h"
 
-// Registers initialization
-static int vm_init_regs(vm_t *g) {
+// Registers initialization, only the bootstrap processor needs it. The
+// application processors stay in wait-for-SIPI until the guest wakes them up.
+static int vm_init_regs(struct vcpu *vcpu) {
   struct kvm_sregs sregs;
 
-  if (ioctl(g->vcpu_fd, KVM_GET_SREGS, &sregs) < 0)
+  if (ioctl(vcpu->fd, KVM_GET_SREGS, &sregs) < 0)
     return throw_err("Failed to get registers");
 
 // all segment selector are the same
@@ -39,50 +49,285 @@ static int vm_init_regs(vm_t *g) {
   sregs.ss.db = 1;
   sregs.cr0 |= 1; /* enable protected mode */
 
-  if (ioctl(g->vcpu_fd, KVM_SET_SREGS, &sregs) < 0)
+  if (ioctl(vcpu->fd, KVM_SET_SREGS, &sregs) < 0)
     return throw_err("Failed to set special registers");
 
   struct kvm_regs regs;
-  if (ioctl(g->vcpu_fd, KVM_GET_REGS, &regs) < 0)
+  if (ioctl(vcpu->fd, KVM_GET_REGS, &regs) < 0)
     return throw_err("Failed to get registers");
 
   regs.rflags = 2;
   // similar to qemu?
   regs.rip = 0x100000, regs.rsi = 0x10000;
-  if (ioctl(g->vcpu_fd, KVM_SET_REGS, &regs) < 0)
+  if (ioctl(vcpu->fd, KVM_SET_REGS, &regs) < 0)
     return throw_err("Failed to set registers");
 
   return 0;
 }
 
 #define N_ENTRIES 100
-static void vm_init_cpu_id(vm_t *g) {
+static int vm_init_cpu_id(vm_t *g, struct vcpu *vcpu) {
   struct {
     uint32_t nent;
     uint32_t padding;
     struct kvm_cpuid_entry2 entries[N_ENTRIES];
   } kvm_cpuid = {.nent = N_ENTRIES};
-  ioctl(g->kvm_fd, KVM_GET_SUPPORTED_CPUID, &kvm_cpuid);
+  if (ioctl(g->kvm_fd, KVM_GET_SUPPORTED_CPUID, &kvm_cpuid) < 0)
+    return throw_err("Failed to get supported CPUID");
 
-  for (unsigned int i = 0; i < N_ENTRIES; i++) {
+  for (unsigned int i = 0; i < kvm_cpuid.nent; i++) {
     struct kvm_cpuid_entry2 *entry = &kvm_cpuid.entries[i];
-    if (entry->function == KVM_CPUID_SIGNATURE) {
+    switch (entry->function) {
+    case KVM_CPUID_SIGNATURE:
       entry->eax = KVM_CPUID_FEATURES;
       entry->ebx = 0x4b4d564b; // KVMK
       entry->ecx = 0x564b4d56; // VMKV
       entry->edx = 0x4d;       // M
+      break;
+    case 0x1:
+      // initial APIC ID lives in EBX[31:24], the guest matches it against MP table
+      entry->ebx = (entry->ebx & 0x00ffffff) | (vcpu->id << 24);
+      break;
+    case 0xb:
+    case 0x1f:
+      // x2APIC ID of the current logical processor
+      entry->edx = vcpu->id;
+      break;
+    }
+  }
+
+  if (ioctl(vcpu->fd, KVM_SET_CPUID2, &kvm_cpuid) < 0)
+    return throw_err("Failed to set CPUID");
+
+  return 0;
+}
+
+static int vm_init_vcpu(vm_t *v, int id) {
+  struct vcpu *vcpu = &v->vcpus[id];
+
+  vcpu->id = id;
+  vcpu->vm = v;
+  vcpu->tid = 0;
+  vcpu->stats = NULL;
+  if ((vcpu->fd = ioctl(v->vm_fd, KVM_CREATE_VCPU, id)) < 0)
+    return throw_err("Failed to create vcpu");
+
+  vcpu->run = mmap(0, v->run_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                   vcpu->fd, 0);
+  if (vcpu->run == MAP_FAILED)
+    return throw_err("Failed to mmap kvm_run");
+
+  if (vm_init_cpu_id(v, vcpu) < 0)
+    return -1;
+
+  if (id == 0 && vm_init_regs(vcpu) < 0)
+    return -1;
+
+  return 0;
+}
+
+// While the guest prints, the ring is polled this often, until it stayed
+// empty for COALESCED_IDLE_POLLS polls in a row and the UART has no
+// transmission in flight. Then it is only drained every COALESCED_IDLE_NS.
+#define COALESCED_POLL_NS (1000 * 1000)
+#define COALESCED_IDLE_POLLS 20
+#define COALESCED_IDLE_NS (20 * 1000 * 1000)
+
+/* The coalesced ring also fills while the guest does not exit (e.g. it spins
+ * or halts after printing), and KVM tells nobody about it. The flush thread
+ * polls it after a vcpu found output in it, and for as long as the guest
+ * waits on the UART to transmit. Otherwise a slow tick still drains it, so
+ * output and the THRE interrupt are late by COALESCED_IDLE_NS at most. */
+static void *vm_coalesced_thread(void *arg) {
+  vm_t *v = (vm_t *)arg;
+  struct timespec delay = {.tv_nsec = COALESCED_POLL_NS};
+  int idle = 0;
+
+  __atomic_store_n(&v->coalesced_active, true, __ATOMIC_RELAXED);
+  while (!__atomic_load_n(&v->stop, __ATOMIC_ACQUIRE)) {
+    if (!__atomic_load_n(&v->coalesced_active, __ATOMIC_ACQUIRE)) {
+      struct timespec tick;
+      clock_gettime(CLOCK_MONOTONIC, &tick);
+      tick.tv_nsec += COALESCED_IDLE_NS;
+      if (tick.tv_nsec >= 1000000000) {
+        tick.tv_sec++;
+        tick.tv_nsec -= 1000000000;
+      }
+      pthread_mutex_lock(&v->coalesced_lock);
+      while (!v->coalesced_active &&
+             !__atomic_load_n(&v->stop, __ATOMIC_ACQUIRE) &&
+             pthread_cond_timedwait(&v->coalesced_cond, &v->coalesced_lock,
+                                    &tick) != ETIMEDOUT)
+        ;
+      pthread_mutex_unlock(&v->coalesced_lock);
+      idle = 0;
+      if (vm_flush_coalesced(v))
+        __atomic_store_n(&v->coalesced_active, true, __ATOMIC_RELEASE);
+      continue;
     }
+    nanosleep(&delay, NULL);
+    if (vm_flush_coalesced(v))
+      idle = 0;
+    else if (++idle >= COALESCED_IDLE_POLLS && !serial_tx_busy(&v->serial))
+      __atomic_store_n(&v->coalesced_active, false, __ATOMIC_RELEASE);
+  }
+
+  return NULL;
+}
+
+// vm_coalesced_wake makes the flush thread poll the ring again, or notice
+// the stop
+static void vm_coalesced_wake(vm_t *v) {
+  if (!v->coalesced_ring ||
+      __atomic_load_n(&v->coalesced_active, __ATOMIC_ACQUIRE))
+    return;
+
+  pthread_mutex_lock(&v->coalesced_lock);
+  __atomic_store_n(&v->coalesced_active, true, __ATOMIC_RELEASE);
+  pthread_cond_signal(&v->coalesced_cond);
+  pthread_mutex_unlock(&v->coalesced_lock);
+}
+
+// Guest writes to the COM1 transmit holding register are appended to the
+// coalesced ring instead of exiting. Reads of the same port (RBR) and every
+// other UART register still exit, and the ring is drained before any exit is
+// handled, so LSR/IIR/LCR accesses observe all earlier THR writes in order.
+static int vm_init_coalesced(vm_t *v) {
+  v->coalesced_ring = NULL;
+  v->coalesced_active = false;
+  pthread_mutex_init(&v->coalesced_lock, NULL);
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&v->coalesced_cond, &attr);
+  pthread_condattr_destroy(&attr);
+
+  int page_off = ioctl(v->kvm_fd, KVM_CHECK_EXTENSION, KVM_CAP_COALESCED_MMIO);
+  if (page_off <= 0 ||
+      ioctl(v->kvm_fd, KVM_CHECK_EXTENSION, KVM_CAP_COALESCED_PIO) <= 0)
+    return 0;
+
+  long page_size = sysconf(_SC_PAGESIZE);
+  v->coalesced_ring = (void *)((uint8_t *)v->vcpus[0].run + page_off * page_size);
+  v->coalesced_max = (page_size - sizeof(struct kvm_coalesced_mmio_ring)) /
+                     sizeof(struct kvm_coalesced_mmio);
+
+  if (vm_coalesced_register(v, COM1_PORT_BASE + UART_TX, 1, true) < 0) {
+    v->coalesced_ring = NULL;
+    return 0;
+  }
+
+  if (pthread_create(&v->coalesced_tid, NULL, vm_coalesced_thread, v))
+    return throw_err("Failed to create coalesced flush thread");
+
+  return 0;
+}
+
+static int vm_set_mem_slot(vm_t *v, int slot, uint64_t gpa, uint64_t size,
+                           void *host) {
+  struct kvm_userspace_memory_region region = {
+      .slot = slot,
+      .flags = 0,
+      .guest_phys_addr = gpa,
+      .memory_size = size,
+      .userspace_addr = (__u64)host,
+  };
+
+  if (ioctl(v->vm_fd, KVM_SET_USER_MEMORY_REGION, &region) < 0)
+    return throw_err("Failed to setup user memory region");
+
+  return 0;
+}
+
+// Guest RAM is one host mapping split in two memslots around the MMIO hole.
+// The low slot ends at 3G, which keeps the high slot host address aligned
+// for any huge page size the backend may use.
+static int vm_init_mem(vm_t *v, struct vm_config *cfg) {
+  if (cfg->mem_size < (16ULL << 20) || cfg->mem_size & ((1ULL << 20) - 1)) {
+    fprintf(stderr, "Guest RAM must be a multiple of 1 MiB, at least 16 MiB\n");
+    return -1;
+  }
+
+  v->ram_size = cfg->mem_size;
+  v->low_size = v->ram_size < MMIO_HOLE_START ? v->ram_size : MMIO_HOLE_START;
+  v->high_size = v->ram_size - v->low_size;
+
+  // Create memory for the VM, mem_alloc aligns it to the backing page size.
+  // A restored guest maps its RAM from the snapshot, copy on write, or has
+  // it filled in on demand.
+  v->lazy_ram.uffd = -1;
+  if (cfg->ram_fd >= 0 && !cfg->ram_lazy) {
+    if (mem_map_file(&v->ram, v->ram_size, cfg->ram_fd, cfg->ram_offset) < 0)
+      return -1;
+  } else if (mem_alloc(&v->ram, v->ram_size, cfg->mem_backend) < 0) {
+    return -1;
+  }
+  v->mem = v->ram.host;
+
+  if (cfg->ram_fd >= 0 && cfg->ram_lazy) {
+    if (uffd_ram_init(&v->lazy_ram, &v->ram, v->ram_size, cfg->ram_fd,
+                      cfg->ram_offset) < 0)
+      return -1;
+  } else if (cfg->mem_prealloc >= 0 &&
+             mem_prealloc(&v->ram, cfg->mem_prealloc) < 0) {
+    return -1;
   }
 
-  ioctl(g->vcpu_fd, KVM_SET_CPUID2, &kvm_cpuid);
+  if (vm_set_mem_slot(v, MEM_SLOT_LOW, 0, v->low_size, v->mem) < 0)
+    return -1;
+
+  if (v->high_size &&
+      vm_set_mem_slot(v, MEM_SLOT_HIGH, MMIO_HOLE_END, v->high_size,
+                      (uint8_t *)v->mem + v->low_size) < 0)
+    return -1;
+
+  return 0;
+}
+
+// System control port B: only the refresh bit, that Linux polls to calibrate
+// against the PIT
+static void vm_port61_io(void *owner, void *data, uint8_t is_write,
+                         uint64_t offset, uint8_t size) {
+  if (!is_write)
+    *(uint8_t *)data = 0x20;
 }
 
-int vm_init(vm_t *v) {
+// SIGUSR1 only has to make KVM_RUN return, for vm_kick_vcpus
+static void vm_kick_signal(int sig) {}
+
+int vm_init(vm_t *v, struct vm_config *cfg) {
   printf("Initializing VM\n");
 
   if ((v->kvm_fd = open("/dev/kvm", O_RDWR)) < 0)
     return throw_err("Failed to open /dev/kvm");
 
+  int max_vcpus = ioctl(v->kvm_fd, KVM_CHECK_EXTENSION, KVM_CAP_MAX_VCPUS);
+  if (max_vcpus <= 0)
+    max_vcpus = ioctl(v->kvm_fd, KVM_CHECK_EXTENSION, KVM_CAP_NR_VCPUS);
+  if (cfg->nr_vcpus < 1 || cfg->nr_vcpus > VM_MAX_VCPUS ||
+      cfg->nr_vcpus > max_vcpus) {
+    fprintf(stderr, "Unsupported number of vcpus: %d\n", cfg->nr_vcpus);
+    return -1;
+  }
+  v->nr_vcpus = cfg->nr_vcpus;
+  v->stop = false;
+  v->pause = false;
+  v->parked = 0;
+  pthread_mutex_init(&v->pause_lock, NULL);
+  pthread_cond_init(&v->pause_cond, NULL);
+  v->reboot = !cfg->no_reboot;
+  v->reboot_pending = false;
+  v->nr_reboots = 0;
+  v->reset_state = NULL;
+  v->kernel_fd = v->initrd_fd = -1;
+
+  struct sigaction sa = {.sa_handler = vm_kick_signal};
+  if (sigaction(SIGUSR1, &sa, NULL) < 0)
+    return throw_err("Failed to install the SIGUSR1 handler");
+
+  if ((v->run_size = ioctl(v->kvm_fd, KVM_GET_VCPU_MMAP_SIZE, 0)) < 0)
+    return throw_err("Failed to get the size of kvm_run");
+
   if ((v->vm_fd = ioctl(v->kvm_fd, KVM_CREATE_VM, 0)) < 0)
     return throw_err("Failed to create VM");
 
@@ -102,56 +347,116 @@ int vm_init(vm_t *v) {
   if (ioctl(v->vm_fd, KVM_CREATE_PIT2, &pit) < 0)
     return throw_err("Failed to create i8254 interval timer");
 
-  // Create memory for the VM
-  v->mem = mmap(NULL, RAM_SIZE, PROT_WRITE | PROT_READ,
-                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-  if (!v->mem)
-    return throw_err("Failed to mmap vm memory");
+  if (vm_init_mem(v, cfg) < 0)
+    return -1;
 
-  struct kvm_userspace_memory_region region = {
-      .slot = 0,
-      .flags = 0,
-      .guest_phys_addr = 0,
-      .memory_size = RAM_SIZE,
-      .userspace_addr = (__u64)v->mem,
-  };
+  for (int i = 0; i < v->nr_vcpus; i++) {
+    if (vm_init_vcpu(v, i) < 0)
+      return -1;
+  }
 
-  // Because the memory is smaller than 4G, it won't overlap with the MMIO
-  if (ioctl(v->vm_fd, KVM_SET_USER_MEMORY_REGION, &region) < 0)
-    return throw_err("Failed to setup user memory region");
+  bus_init_pio(&v->io_bus);
+  bus_init(&v->mmio_bus);
+  pci_init(&v->pci, &v->io_bus, &v->mmio_bus);
+  dev_init(&v->port61_dev, 0x61, 1, v, vm_port61_io);
+  if (bus_register_dev(&v->io_bus, &v->port61_dev) < 0)
+    return -1;
+  acpi_pm_init(&v->acpi_pm, &v->io_bus);
+  if (console_init(&v->console, cfg->console, cfg->console_policy) < 0)
+    return -1;
+  if (serial_init(&v->serial, &v->io_bus, &v->console))
+    return throw_err("Failed to init UART device");
 
-  if ((v->vcpu_fd = ioctl(v->vm_fd, KVM_CREATE_VCPU, 0)) < 0)
-    return throw_err("Failed to create vcpu");
+  if (vm_init_coalesced(v) < 0)
+    return -1;
+
+  virtio_blk_init(&v->virtio_blk_dev);
+  if (cfg->disk) {
+    if (diskimg_init(&v->diskimg, cfg->disk, cfg->disk_direct) < 0)
+      return throw_err("Failed to open disk image");
+    int queues = cfg->disk_queues ? cfg->disk_queues : v->nr_vcpus;
+    if (queues > VIRTIO_BLK_MAX_QUEUES)
+      queues = VIRTIO_BLK_MAX_QUEUES;
+    if (virtio_blk_init_pci(&v->virtio_blk_dev, &v->diskimg, &v->pci,
+                            &v->io_bus, &v->mmio_bus, queues, cfg->disk_cpus,
+                            cfg->nr_disk_cpus) < 0)
+      return -1;
+  }
 
-  vm_init_regs(v);
-  vm_init_cpu_id(v);
-  if (serial_init(&v->serial))
-    return throw_err("Failed to init UART device");
+  virtio_console_init(&v->virtio_console_dev);
+  for (int i = 0; i < cfg->nr_vconsoles; i++) {
+    if (virtio_console_add_port(&v->virtio_console_dev, cfg->vconsole[i]) < 0)
+      return -1;
+  }
+  if (cfg->nr_vconsoles &&
+      virtio_console_init_pci(&v->virtio_console_dev, &v->pci, &v->io_bus,
+                              &v->mmio_bus) < 0)
+    return -1;
+  // a driver which knows both layouts would take the packed one
+  if (cfg->split_ring) {
+    virtio_pci_del_feature(&v->virtio_blk_dev.virtio_pci_dev,
+                           1ULL << VIRTIO_F_RING_PACKED);
+    virtio_pci_del_feature(&v->virtio_console_dev.virtio_pci_dev,
+                           1ULL << VIRTIO_F_RING_PACKED);
+  }
+
+  // what a reboot brings the vcpus and the irqchip back to
+  if (v->reboot) {
+    v->reset_state = calloc(1, sizeof(struct snapshot));
+    if (!v->reset_state)
+      return throw_err("Failed to allocate the reset state");
+    v->reset_state->fd = -1;
+    if (vm_snapshot_save_cpus(v, v->reset_state) < 0)
+      return -1;
+  }
 
   return 0;
 }
 
-int vm_load_image(vm_t *g, const char *image_path) {
-  int fd = open(image_path, O_RDONLY);
-  if (fd < 0)
-    return 1;
+#define LOAD_CHUNK (64 << 20)
+
+// vm_read_file reads a file range straight into guest memory. Guest RAM is
+// still untouched at this point, so one copy out of the page cache is all
+// it takes: no staging mapping, no zeroing of what is overwritten anyway.
+static int vm_read_file(int fd, void *dst, size_t size, off_t offset) {
+  while (size) {
+    ssize_t n = pread(fd, dst, size < LOAD_CHUNK ? size : LOAD_CHUNK, offset);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return -1;
+    dst = (uint8_t *)dst + n;
+    offset += n;
+    size -= n;
+  }
+
+  return 0;
+}
 
+// The kernel and initrd files stay open after they are loaded, a reboot
+// loads them again from there (and from the page cache).
+static int vm_load_kernel(vm_t *g) {
+  int fd = g->kernel_fd;
   struct stat st;
   fstat(fd, &st);
   size_t datasz = st.st_size;
-  void *data = mmap(0, datasz, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
-  close(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 
   struct boot_params *boot =
       (struct boot_params *)((uint8_t *)g->mem + 0x10000);
   void *cmdline = ((uint8_t *)g->mem) + 0x20000;
   void *kernel = ((uint8_t *)g->mem) + 0x100000;
 
+  size_t hdrsz = datasz < sizeof(struct boot_params) ? datasz
+                                                      : sizeof(struct boot_params);
   memset(boot, 0, sizeof(struct boot_params));
-  memmove(boot, data, sizeof(struct boot_params));
+  if (vm_read_file(fd, boot, hdrsz, 0) < 0)
+    return throw_err("Failed to read kernel setup header");
 
   size_t setup_sectors = boot->hdr.setup_sects;
   size_t setupsz = (setup_sectors + 1) * 512; // ech sector is 512 bytes
+  if (setupsz > datasz || 0x100000 + datasz - setupsz > g->low_size)
+    return throw_err("Invalid kernel image size");
 
   boot->hdr.vid_mode = 0xFFFF; // VGA
   boot->hdr.type_of_loader = 0xFF;
@@ -161,23 +466,20 @@ int vm_load_image(vm_t *g, const char *image_path) {
   boot->hdr.cmd_line_ptr = 0x20000;
   memset(cmdline, 0, boot->hdr.cmdline_size);
   memcpy(cmdline, KERNEL_OPTS, sizeof(KERNEL_OPTS));
-  memmove(kernel, (char *)data + setupsz, datasz - setupsz);
+  // the DSDT has a host bridge per root bus, but with acpi=off Linux only
+  // probes the buses past 0 when told to
+  int nr_buses = pci_nr_buses(&g->pci);
+  if (nr_buses > 1)
+    sprintf((char *)cmdline + sizeof(KERNEL_OPTS) - 1, " pci=lastbus=%d",
+            nr_buses - 1);
+
+  // the protected mode kernel goes straight from the file to 1M
+  if (vm_read_file(fd, kernel, datasz - setupsz, setupsz) < 0)
+    return throw_err("Failed to read kernel image");
 
   // Setup E820 memory table to send the memory address information to initrd
 
   unsigned int idx = 0;
-  /*boot->e820_table[idx] = (struct boot_e820_entry){
-      .addr = 0x0,
-      .size = ISA_START_ADDRESS - 1,
-      .type = E820_RAM,
-  };
-
-  boot->e820_table[idx++] = (struct boot_e820_entry){
-      .addr = ISA_END_ADDRESS,
-      .size = RAM_SIZE - ISA_END_ADDRESS,
-      .type = E820_RAM,
-  };*/
-
   boot->e820_table[idx++] = (struct boot_e820_entry) {
     .addr = 0x0,
     .size = 0x9fc00,
@@ -190,34 +492,57 @@ int vm_load_image(vm_t *g, const char *image_path) {
     .type = E820_RESERVED,
   };
 
+  // BIOS area: the ACPI tables and the MP table
   boot->e820_table[idx++] = (struct boot_e820_entry) {
-    .addr = 0xf0000,
-    .size = 0xffff,
+    .addr = ACPI_START,
+    .size = ISA_END_ADDRESS - ACPI_START,
     .type = E820_RESERVED,
   };
   
   boot->e820_table[idx++] = (struct boot_e820_entry) {
-    .addr = 0x100000,
-    .size = RAM_SIZE - ISA_END_ADDRESS,
+    .addr = ISA_END_ADDRESS,
+    .size = g->low_size - ISA_END_ADDRESS,
     .type = E820_RAM,
   };
+
+  // [MMIO_HOLE_START, 4G) is left out so the guest allocates PCI BARs there,
+  // but for the ECAM window. Linux only trusts an MCFG area it finds reserved.
+  boot->e820_table[idx++] = (struct boot_e820_entry) {
+    .addr = PCI_ECAM_BASE,
+    .size = PCI_ECAM_SIZE,
+    .type = E820_RESERVED,
+  };
+
+  if (g->high_size) {
+    boot->e820_table[idx++] = (struct boot_e820_entry) {
+      .addr = MMIO_HOLE_END,
+      .size = g->high_size,
+      .type = E820_RAM,
+    };
+  }
   
-  boot->e820_entries = idx; // number of idx, (at this point it should be 2)
+  boot->e820_entries = idx;
   
-  munmap(data, datasz);
+  // The MP table tells the guest about the application processors
+  mptable_setup(g->mem, g->nr_vcpus);
+  acpi_setup(g->mem, &g->pci, MMIO_HOLE_START, PCI_ECAM_BASE);
+
   return 0;
 }
 
-int vm_load_initrd(vm_t *v, const char *initrd_path) {
-  int fd = open(initrd_path, O_RDONLY);
-  if (fd < 0)
+int vm_load_image(vm_t *g, const char *image_path) {
+  if ((g->kernel_fd = open(image_path, O_RDONLY | O_CLOEXEC)) < 0)
     return 1;
 
+  return vm_load_kernel(g);
+}
+
+static int vm_load_ramdisk(vm_t *v) {
+  int fd = v->initrd_fd;
   struct stat st;
   fstat(fd, &st);
   size_t datasz = st.st_size;
-  void *data = mmap(0, datasz, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
-  close(fd);
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
 
   struct boot_params *boot = (struct boot_params*)((uint8_t*)v->mem + 0x10000);
   unsigned long addr = boot->hdr.initrd_addr_max & ~0xfffff;
@@ -230,23 +555,28 @@ int vm_load_initrd(vm_t *v, const char *initrd_path) {
   for (;;) {
     if (addr < 0x100000)
         return throw_err("Not enough memroy for initrd");
-    else if (addr < (RAM_SIZE - datasz))
+    else if (datasz <= v->low_size && addr < (v->low_size - datasz))
         break;
     addr -= 0x100000;
   }
 
   void *initrd = ((uint8_t *)v->mem) + addr;
-  memset(initrd, 0, datasz);
-  memmove(initrd, data, datasz);
+  if (vm_read_file(fd, initrd, datasz, 0) < 0)
+    return throw_err("Failed to read initrd");
 
   boot->hdr.ramdisk_image = addr;
   boot->hdr.ramdisk_size = datasz;
 
-  munmap(data, datasz);
-
   return 0;
 }
 
+int vm_load_initrd(vm_t *v, const char *initrd_path) {
+  if ((v->initrd_fd = open(initrd_path, O_RDONLY | O_CLOEXEC)) < 0)
+    return 1;
+
+  return vm_load_ramdisk(v);
+}
+
 int vm_irq_line(vm_t *v, int irq, int level)
 {
   struct kvm_irq_level irq_level = {
@@ -261,51 +591,259 @@ int vm_irq_line(vm_t *v, int irq, int level)
   return 0;
 }
 
+// vm_guest_to_host translates a guest physical address into the host mapping,
+// it returns NULL for addresses which are not backed by RAM.
+void *vm_guest_to_host(vm_t *v, void *guest) {
+  uint64_t gpa = (uint64_t)guest;
+
+  if (gpa < v->low_size)
+    return (uint8_t *)v->mem + gpa;
+
+  if (gpa >= MMIO_HOLE_END && gpa - MMIO_HOLE_END < v->high_size)
+    return (uint8_t *)v->mem + v->low_size + (gpa - MMIO_HOLE_END);
+
+  return NULL;
+}
+
 void vm_exit(vm_t *v) {
+  if (v->coalesced_ring) {
+    __atomic_store_n(&v->stop, true, __ATOMIC_RELEASE);
+    vm_coalesced_wake(v);
+    if (v->coalesced_tid)
+      pthread_join(v->coalesced_tid, NULL);
+    vm_flush_coalesced(v);
+  }
+  exit_stats_exit(v);
+  virtio_blk_exit(&v->virtio_blk_dev);
+  virtio_console_exit(&v->virtio_console_dev);
   serial_exit(&v->serial);
+  console_exit(&v->console);
+  for (int i = 0; i < v->nr_vcpus; i++) {
+    munmap(v->vcpus[i].run, v->run_size);
+    close(v->vcpus[i].fd);
+  }
   close(v->kvm_fd);
   close(v->vm_fd);
-  close(v->vcpu_fd);
-  munmap(v->mem, RAM_SIZE);
+  if (v->kernel_fd >= 0)
+    close(v->kernel_fd);
+  if (v->initrd_fd >= 0)
+    close(v->initrd_fd);
+  if (v->reset_state) {
+    snapshot_close(v->reset_state);
+    free(v->reset_state);
+  }
+  bus_exit(&v->io_bus);
+  bus_exit(&v->mmio_bus);
+  uffd_ram_exit(&v->lazy_ram);
+  mem_free(&v->ram);
+}
+
+static void vm_handle_pio(vm_t *v, uint16_t port, void *data, uint8_t size,
+                          uint32_t count, bool is_write)
+{
+  bus_handle_pio(&v->io_bus, port, data, size, count, is_write);
 }
 
 void vm_handle_io(vm_t *v, struct kvm_run *run)
 {
-  uint64_t addr = run->io.port;
   void *data = (void *)run + run->io.data_offset;
   bool is_write = run->io.direction == KVM_EXIT_IO_OUT;
 
-  if (run->io.port == 0x61 && !is_write) {
-    uint8_t *u8_data = (uint8_t*)data;
-    *u8_data = 0x20;
-  }
+  vm_handle_pio(v, run->io.port, data, run->io.size, run->io.count, is_write);
+}
+
+void vm_handle_mmio(vm_t *v, struct kvm_run *run) {
+  bus_handle_io(&v->mmio_bus, run->mmio.data, run->mmio.is_write, run->mmio.phys_addr, run->mmio.len);
+}
+
+void vm_irqfd_register(vm_t *v, int fd, int gsi, int flags) {
+  struct kvm_irqfd irqfd = {
+      .fd = fd,
+      .gsi = gsi,
+      .flags = flags,
+  };
+
+  if (ioctl(v->vm_fd, KVM_IRQFD, &irqfd) < 0)
+    throw_err("Failed to set the status of IRQFD");
+}
+
+void vm_ioeventfd_register(vm_t *v, int fd, unsigned long long addr, int len,
+                           uint64_t datamatch, int flags) {
+  struct kvm_ioeventfd ioeventfd = {
+      .datamatch = datamatch,
+      .fd = fd,
+      .addr = addr,
+      .len = len,
+      .flags = flags,
+  };
+
+  if (ioctl(v->vm_fd, KVM_IOEVENTFD, &ioeventfd) < 0)
+    throw_err("Failed to set the status of IOEVENTFD");
+}
+
+int vm_coalesced_register(vm_t *v, uint64_t addr, uint32_t size, bool pio) {
+  struct kvm_coalesced_mmio_zone zone = {
+      .addr = addr,
+      .size = size,
+      .pio = pio,
+  };
+
+  if (ioctl(v->vm_fd, KVM_REGISTER_COALESCED_MMIO, &zone) < 0)
+    return throw_err("Failed to register coalesced zone");
+
+  return 0;
+}
+
+#define COALESCED_BATCH 256
+
+// vm_flush_coalesced replays the buffered writes in guest order. Consecutive
+// byte writes to the same port are handed over as one batch, the way a
+// rep outsb would be. It tells whether the ring held any.
+bool vm_flush_coalesced(vm_t *v) {
+  struct kvm_coalesced_mmio_ring *ring = v->coalesced_ring;
+  uint8_t batch[COALESCED_BATCH];
+
+  if (!ring ||
+      __atomic_load_n(&ring->first, __ATOMIC_RELAXED) ==
+          __atomic_load_n(&ring->last, __ATOMIC_ACQUIRE))
+    return false;
+
+  pthread_mutex_lock(&v->coalesced_lock);
+  while (ring->first != __atomic_load_n(&ring->last, __ATOMIC_ACQUIRE)) {
+    struct kvm_coalesced_mmio *m = &ring->coalesced_mmio[ring->first];
+
+    if (!m->pio) {
+      bus_handle_io(&v->mmio_bus, m->data, 1, m->phys_addr, m->len);
+      __atomic_store_n(&ring->first, (ring->first + 1) % v->coalesced_max,
+                       __ATOMIC_RELEASE);
+      continue;
+    }
+
+    uint16_t port = m->phys_addr;
+    uint32_t n = 0;
+    while (n < COALESCED_BATCH &&
+           ring->first != __atomic_load_n(&ring->last, __ATOMIC_ACQUIRE)) {
+      m = &ring->coalesced_mmio[ring->first];
+      if (!m->pio || m->phys_addr != port || m->len != 1)
+        break;
+      batch[n++] = m->data[0];
+      __atomic_store_n(&ring->first, (ring->first + 1) % v->coalesced_max,
+                       __ATOMIC_RELEASE);
+    }
 
-  if (run->io.port >= COM1_PORT_BASE && run->io.port < COM1_PORT_END) {
-    serial_handle(&v->serial, run);
-  } else {
-    for (int i = 0; i < run->io.count; i++) {
-      bus_handle_io(&v->io_bus, data, is_write, addr, run->io.size);
-      addr += run->io.size;
+    if (n) {
+      vm_handle_pio(v, port, batch, 1, n, true);
+    } else {
+      // a wider write, replay it on its own
+      vm_handle_pio(v, port, m->data, m->len, 1, true);
+      __atomic_store_n(&ring->first, (ring->first + 1) % v->coalesced_max,
+                       __ATOMIC_RELEASE);
     }
   }
+  pthread_mutex_unlock(&v->coalesced_lock);
+  return true;
 }
 
-void vm_handle_mmio(vm_t *v, struct kvm_run *run) {
-  bus_handle_io(&v->mmio_bus, run->mmio.data, run->mmio.is_write, run->mmio.phys_addr, run->mmio.len);
+// Ask every vcpu to leave KVM_RUN. immediate_exit covers a vcpu that is
+// about to enter the guest when the signal arrives.
+static void vm_kick_vcpus(vm_t *v) {
+  for (int i = 0; i < v->nr_vcpus; i++) {
+    struct vcpu *vcpu = &v->vcpus[i];
+    __atomic_store_n(&vcpu->run->immediate_exit, 1, __ATOMIC_RELEASE);
+    if (vcpu->tid && !pthread_equal(vcpu->tid, pthread_self()))
+      pthread_kill(vcpu->tid, SIGUSR1);
+  }
 }
 
-int vm_run(vm_t *v) {
-  int run_size = ioctl(v->kvm_fd, KVM_GET_VCPU_MMAP_SIZE, 0);
-  struct kvm_run *run =
-      mmap(0, run_size, PROT_READ | PROT_WRITE, MAP_SHARED, v->vcpu_fd, 0);
-
-  while (1) {
-    int err = ioctl(v->vcpu_fd, KVM_RUN,0);
-    if ( err < 0 && (errno != EINTR && errno != EAGAIN)) {
-      munmap(run, run_size);
+void vm_stop(vm_t *v) {
+  pthread_mutex_lock(&v->pause_lock);
+  __atomic_store_n(&v->stop, true, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&v->pause_cond);
+  pthread_mutex_unlock(&v->pause_lock);
+  vm_kick_vcpus(v);
+  vm_coalesced_wake(v);
+}
+
+// vm_poweroff stops the VM for good, it is not rebooted even if the guest
+// has just asked for it.
+void vm_poweroff(vm_t *v) {
+  pthread_mutex_lock(&v->pause_lock);
+  v->reboot = false;
+  pthread_mutex_unlock(&v->pause_lock);
+  vm_stop(v);
+}
+
+// A vcpu leaving KVM_RUN on a PIO/MMIO exit only completes the access on its
+// next KVM_RUN. One more entry with immediate_exit set finishes it without
+// running guest code, so that the state seen while parked is consistent.
+static void vcpu_park(struct vcpu *vcpu) {
+  vm_t *v = vcpu->vm;
+
+  __atomic_store_n(&vcpu->run->immediate_exit, 1, __ATOMIC_RELEASE);
+  ioctl(vcpu->fd, KVM_RUN, 0);
+
+  pthread_mutex_lock(&v->pause_lock);
+  v->parked++;
+  pthread_cond_broadcast(&v->pause_cond);
+  while (v->pause && !v->stop)
+    pthread_cond_wait(&v->pause_cond, &v->pause_lock);
+  v->parked--;
+  pthread_mutex_unlock(&v->pause_lock);
+
+  __atomic_store_n(&vcpu->run->immediate_exit, 0, __ATOMIC_RELEASE);
+}
+
+// vm_pause returns once every vcpu is parked and the devices are idle, or
+// -1 if the VM stops first.
+int vm_pause(vm_t *v) {
+  pthread_mutex_lock(&v->pause_lock);
+  __atomic_store_n(&v->pause, true, __ATOMIC_RELEASE);
+  vm_kick_vcpus(v);
+  while (v->parked < v->nr_vcpus && !v->stop)
+    pthread_cond_wait(&v->pause_cond, &v->pause_lock);
+  bool stopped = v->stop;
+  pthread_mutex_unlock(&v->pause_lock);
+
+  if (stopped)
+    return -1;
+
+  vm_flush_coalesced(v);
+  virtio_blk_pause(&v->virtio_blk_dev);
+  virtio_console_pause(&v->virtio_console_dev);
+  return 0;
+}
+
+void vm_resume(vm_t *v) {
+  virtio_blk_resume(&v->virtio_blk_dev);
+  virtio_console_resume(&v->virtio_console_dev);
+  pthread_mutex_lock(&v->pause_lock);
+  __atomic_store_n(&v->pause, false, __ATOMIC_RELEASE);
+  pthread_cond_broadcast(&v->pause_cond);
+  pthread_mutex_unlock(&v->pause_lock);
+}
+
+static int vcpu_run(struct vcpu *vcpu) {
+  vm_t *v = vcpu->vm;
+  struct kvm_run *run = vcpu->run;
+
+  while (!__atomic_load_n(&v->stop, __ATOMIC_ACQUIRE)) {
+    if (__atomic_load_n(&v->pause, __ATOMIC_ACQUIRE)) {
+      vcpu_park(vcpu);
+      continue;
+    }
+    int err = ioctl(vcpu->fd, KVM_RUN, 0);
+    if (err < 0 && (errno != EINTR && errno != EAGAIN)) {
+      vm_stop(v);
       return throw_err("Failed to execute kvm_run");
     }
-    switch (run->exit_reason) {
+    // A signal (or immediate_exit) returns before the guest runs
+    uint32_t exit_reason = err < 0 ? KVM_EXIT_INTR : run->exit_reason;
+    uint64_t exit_tsc = vcpu->stats ? exit_stats_now() : 0;
+    // writes buffered before this exit must be seen by the devices first,
+    // more may follow without an exit
+    if (vm_flush_coalesced(v))
+      vm_coalesced_wake(v);
+    switch (exit_reason) {
     case KVM_EXIT_IO:
       vm_handle_io(v, run);
       break;
@@ -313,16 +851,133 @@ int vm_run(vm_t *v) {
       vm_handle_mmio(v, run);
       break;
     case KVM_EXIT_INTR:
-      serial_console(&v->serial);
       break;
     case KVM_EXIT_SHUTDOWN:
       printf("shutdown \n");
-      munmap(run, run_size);
+      // only a guest booted from a kernel image can be booted again
+      if (v->reboot && v->kernel_fd >= 0)
+        __atomic_store_n(&v->reboot_pending, true, __ATOMIC_RELEASE);
+      vm_stop(v);
       return 0;
     default:
-      printf("reason: %d\n", run->exit_reason);
-        munmap(run, run_size);
+      printf("reason: %d\n", exit_reason);
+      vm_stop(v);
       return -1;
     }
+    if (vcpu->stats)
+      exit_stats_account(vcpu->stats, run, exit_reason,
+                         exit_stats_now() - exit_tsc);
   }
+
+  return 0;
+}
+
+static void *vcpu_thread(void *arg) {
+  struct vcpu *vcpu = (struct vcpu *)arg;
+  return (void *)(long)vcpu_run(vcpu);
+}
+
+// vm_run_vcpus drives the bootstrap processor from the calling thread and
+// gives every other vcpu a thread of its own.
+static int vm_run_vcpus(vm_t *v) {
+  int started = 1;
+  int ret = 0;
+
+  v->vcpus[0].tid = pthread_self();
+  for (; started < v->nr_vcpus; started++) {
+    struct vcpu *vcpu = &v->vcpus[started];
+    if (pthread_create(&vcpu->tid, NULL, vcpu_thread, vcpu)) {
+      vcpu->tid = 0;
+      vm_stop(v);
+      ret = throw_err("Failed to create vcpu thread");
+      break;
+    }
+  }
+
+  if (vcpu_run(&v->vcpus[0]) < 0)
+    ret = -1;
+
+  for (int i = 1; i < started; i++) {
+    void *thread_ret;
+    pthread_join(v->vcpus[i].tid, &thread_ret);
+    if (thread_ret)
+      ret = -1;
+  }
+
+  return ret;
+}
+
+static long elapsed_ms(struct timespec *t0) {
+  struct timespec t1;
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  return (t1.tv_sec - t0->tv_sec) * 1000 +
+         (t1.tv_nsec - t0->tv_nsec) / 1000000;
+}
+
+// vm_reset turns the stopped VM back into a freshly created one: the KVM
+// VM, its memslots and the device threads stay, their state is reset and
+// the guest RAM is dropped and loaded with the kernel again. Returns 1 if
+// the VM was powered off while at it.
+static int vm_reset(vm_t *v) {
+  struct timespec t0;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  // the flush thread left with the stop, it is restarted below
+  if (v->coalesced_ring) {
+    pthread_join(v->coalesced_tid, NULL);
+    v->coalesced_tid = 0;
+  }
+  vm_flush_coalesced(v);
+
+  v->reset_state->pos = 0;
+  if (vm_snapshot_restore_cpus(v, v->reset_state) < 0)
+    return -1;
+  serial_reset(&v->serial);
+  acpi_pm_reset(&v->acpi_pm);
+  pci_reset(&v->pci);
+  virtio_blk_reset(&v->virtio_blk_dev);
+  virtio_console_reset(&v->virtio_console_dev);
+
+  uffd_ram_exit(&v->lazy_ram);
+  if (mem_discard(&v->ram) < 0)
+    return -1;
+  if (vm_load_kernel(v) < 0 || (v->initrd_fd >= 0 && vm_load_ramdisk(v) < 0))
+    return -1;
+
+  for (int i = 0; i < v->nr_vcpus; i++) {
+    v->vcpus[i].tid = 0;
+    __atomic_store_n(&v->vcpus[i].run->immediate_exit, 0, __ATOMIC_RELEASE);
+  }
+  __atomic_store_n(&v->reboot_pending, false, __ATOMIC_RELAXED);
+  pthread_mutex_lock(&v->pause_lock);
+  bool reboot = v->reboot;
+  if (reboot)
+    __atomic_store_n(&v->stop, false, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&v->pause_lock);
+  if (!reboot)
+    return 1; // powered off in the meantime
+  if (v->coalesced_ring &&
+      pthread_create(&v->coalesced_tid, NULL, vm_coalesced_thread, v))
+    return throw_err("Failed to create coalesced flush thread");
+
+  v->nr_reboots++;
+  printf("Reboot %d: guest reset in %ld ms\n", v->nr_reboots, elapsed_ms(&t0));
+  fflush(stdout);
+  return 0;
+}
+
+// vm_run returns when the guest stops for good, a reboot keeps the process,
+// the KVM VM and the guest RAM mapping.
+int vm_run(vm_t *v) {
+  int ret;
+
+  while ((ret = vm_run_vcpus(v)) == 0 &&
+         __atomic_load_n(&v->reboot_pending, __ATOMIC_ACQUIRE)) {
+    int err = vm_reset(v);
+    if (err)
+      return err < 0 ? -1 : 0;
+  }
+
+  return ret;
 }
@@ -1,32 +1,122 @@
 #ifndef VM_H
 #define VM_H
 
+#include <pthread.h>
+#include <stdbool.h>
+
+#include "acpi.h"
+#include "console.h"
+#include "diskimg.h"
+#include "mem.h"
 #include "serial.h"
 #include "pci.h"
+#include "uffd.h"
+#include "virtio-blk.h"
+#include "virtio-console.h"
+
+#define RAM_SIZE_DEFAULT (1ULL << 30)
 
-#define RAM_SIZE (1 << 30)
+/* Guest physical layout: RAM below the 32-bit PCI/MMIO hole goes into the
+ * low memslot, the rest is relocated above 4G into the high memslot. The
+ * hole also holds the IOAPIC, the LAPIC and the TSS/identity map pages. */
+#define MMIO_HOLE_START 0xc0000000ULL
+#define MMIO_HOLE_END 0x100000000ULL
+#define MEM_SLOT_LOW 0
+#define MEM_SLOT_HIGH 1
 #define KERNEL_OPTS "console=ttyS0"
+#define VM_MAX_VCPUS 64
+
+typedef struct vm vm_t;
+struct exit_stats;
+struct snapshot;
+
+struct vm_config {
+  int nr_vcpus;
+  uint64_t mem_size;
+  enum mem_backend mem_backend;
+  int mem_prealloc; // prefault guest RAM with that many threads, -1: off
+  const char *disk; // virtio-blk disk image, NULL for none
+  int disk_queues;  // virtio-blk request queues, 0: one per vcpu
+  int disk_cpus[VIRTIO_BLK_MAX_QUEUES]; // host CPUs for the queue threads
+  int nr_disk_cpus;
+  bool disk_direct; // cache=none: O_DIRECT, no host page cache
+  bool split_ring;  // virtio devices do not offer the packed ring layout
+  int ram_fd;       // map guest RAM privately from this file, -1: allocate
+  uint64_t ram_offset;
+  bool ram_lazy; // fill RAM from ram_fd through userfaultfd instead
+  bool no_reboot; // exit on shutdown instead of rebooting the guest
+  const char *console; // serial output: stdout (NULL), file:, unix: or pty
+  enum console_policy console_policy;
+  const char *vconsole[VIRTIO_CONSOLE_MAX_PORTS]; // virtio-console ports
+  int nr_vconsoles;
+};
+
+struct vcpu {
+  int id;
+  int fd;
+  struct kvm_run *run;
+  pthread_t tid;
+  vm_t *vm;
+  struct exit_stats *stats; // NULL unless exit accounting is enabled
+};
 
-typedef struct {
-  int kvm_fd, vm_fd, vcpu_fd;
-  void *mem;
+struct vm {
+  int kvm_fd, vm_fd;
+  int nr_vcpus;
+  int run_size;
+  struct vcpu vcpus[VM_MAX_VCPUS];
+  volatile bool stop; // set when a vcpu asks the others to leave the run loop
+  volatile bool pause; // vcpus park at their next exit until it is cleared
+  int parked;
+  pthread_mutex_t pause_lock;
+  pthread_cond_t pause_cond;
+  bool reboot;                 // a guest shutdown reboots it in place
+  volatile bool reboot_pending;
+  int nr_reboots;
+  struct snapshot *reset_state; // vcpus and irqchip as created
+  int kernel_fd, initrd_fd;    // kept open to be loaded again on reboot
+  struct kvm_coalesced_mmio_ring *coalesced_ring; // NULL if unsupported
+  unsigned int coalesced_max;
+  pthread_mutex_t coalesced_lock;
+  pthread_cond_t coalesced_cond; // the flush thread waits for output
+  bool coalesced_active;         // the flush thread polls the ring
+  pthread_t coalesced_tid;
+  struct guest_mem ram;
+  struct uffd_ram lazy_ram; // uffd < 0 unless restoring lazily
+  void *mem; // ram.host
+  uint64_t ram_size;
+  uint64_t low_size;  // RAM at [0, low_size)
+  uint64_t high_size; // RAM at [4G, 4G + high_size)
   serial_dev_t serial;
+  struct console console;
   struct bus mmio_bus;
   struct bus io_bus;
+  struct dev port61_dev;
+  struct acpi_pm acpi_pm;
   struct pci pci;
-} vm_t;
+  struct diskimg diskimg;
+  struct virtio_blk_dev virtio_blk_dev;
+  struct virtio_console_dev virtio_console_dev;
+};
 
-int vm_init(vm_t *v);
+int vm_init(vm_t *v, struct vm_config *cfg);
 int vm_load_image(vm_t *v, const char *image_path);
 int vm_load_initrd(vm_t *v, const char *initrd_path);
 int vm_run(vm_t *v);
+int vm_pause(vm_t *v);
+void vm_resume(vm_t *v);
+void vm_stop(vm_t *v);
+void vm_poweroff(vm_t *v);
 int vm_irq_line(vm_t *v, int irq, int level);
 void *vm_guest_to_host(vm_t *v, void *guest);
 void vm_irqfd_register(vm_t *v, int fd, int gsi, int flags);
+int vm_coalesced_register(vm_t *v, uint64_t addr, uint32_t size, bool pio);
+bool vm_flush_coalesced(vm_t *v);
 void vm_ioeventfd_register(vm_t *v,
                            int fd,
                            unsigned long long addr,
                            int len,
+                           uint64_t datamatch,
                            int flags);
 void vm_exit(vm_t *t);
 